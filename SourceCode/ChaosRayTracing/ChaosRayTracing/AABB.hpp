@@ -1,6 +1,4 @@
 #pragma once
-#include <vector>
-
 #include "Math3D.hpp"
 
 class AABB
@@ -15,29 +13,6 @@ public:
 	{
 	}
 
-	AABB(const Triangle& triangle)
-	{
-		minPoint = min(minPoint, min(triangle.v0.position, min(triangle.v1.position, triangle.v2.position)));
-		maxPoint = max(maxPoint, max(triangle.v0.position, max(triangle.v1.position, triangle.v2.position)));
-	}
-
-	AABB(const std::vector<Triangle>& triangles, Range range)
-	{
-		AABB resAABB;
-
-		auto start = triangles.begin() + range.start;
-		auto end = triangles.begin() + range.end;
-
-		std::for_each(start, end, [&resAABB](const auto& triangle)
-		{
-			AABB triAABB(triangle);
-			resAABB |= triAABB;
-		});
-
-		minPoint = resAABB.minPoint;
-		maxPoint = resAABB.maxPoint;
-	}
-
 	bool isValid() const
 	{
 		return maxPoint.x >= minPoint.x && maxPoint.y >= minPoint.y && maxPoint.z >= minPoint.z;
@@ -89,23 +64,31 @@ public:
 
 	bool intersect(const Ray& ray) const
 	{
-		float minT = 0.f;
-		float maxT = ray.maxT;
-
-		for (uint8_t d = 0; d < 3; ++d)
-		{
-			float t1 = (minPoint[d] - ray.origin[d]) * ray.directionNInv[d];
-			float t2 = (maxPoint[d] - ray.origin[d]) * ray.directionNInv[d];
-
-			if (t1 > t2)
-				std::swap(t1, t2);
-
-			t2 *= 1.f + std::numeric_limits<float>::epsilon();
+		float entryT;
+		return intersect(ray, entryT);
+	}
 
-			minT = std::max(minT, t1);
-			maxT = std::min(maxT, t2);
-		}
+	// entryT is where the ray enters the box, 0 if it starts inside
+	bool intersect(const Ray& ray, float& entryT) const
+	{
+		return intersect(Vector3A(ray.origin), Vector3A(ray.directionNInv), ray.maxT, entryT);
+	}
 
-		return minT < maxT;
+	// All three slabs at once, with the ray loaded into registers once per traversal. The min and max operands are
+	// ordered so that NaN distances, from a zero direction component on a slab plane, are skipped like in the scalar
+	// comparisons. Lanes are combined in axis order, so entryT matches the scalar loop exactly.
+	bool intersect(const Vector3A& origin, const Vector3A& inverseDirection, float rayMaxT, float& entryT) const
+	{
+		const __m128 t1 = _mm_mul_ps(_mm_sub_ps(SimdMath::load3(minPoint.data), origin.v), inverseDirection.v);
+		const __m128 t2 = _mm_mul_ps(_mm_sub_ps(SimdMath::load3(maxPoint.data), origin.v), inverseDirection.v);
+		const __m128 nearT = _mm_max_ps(_mm_min_ps(t2, t1), _mm_setzero_ps());
+		const __m128 farT = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t1, t2),
+		                                          _mm_set1_ps(1.f + std::numeric_limits<float>::epsilon())),
+		                               _mm_set1_ps(rayMaxT));
+
+		const __m128 minT = _mm_max_ss(SimdMath::splat<2>(nearT), _mm_max_ss(SimdMath::splat<1>(nearT), nearT));
+		const __m128 maxT = _mm_min_ss(SimdMath::splat<2>(farT), _mm_min_ss(SimdMath::splat<1>(farT), farT));
+		entryT = _mm_cvtss_f32(minT);
+		return _mm_comilt_ss(minT, maxT);
 	}
 };
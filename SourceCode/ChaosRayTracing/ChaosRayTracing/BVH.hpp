@@ -1,11 +1,18 @@
 #pragma once
+#include <atomic>
+#include <bit>
+#include <cassert>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <numeric>
 #include <stack>
 #include <vector>
 
 #include "AABB.hpp"
-#include "Material.hpp"
+#include "Kernels.hpp"
+#include "RayInterleaver.hpp"
+#include "ThreadPool.hpp"
 
 struct BVHNode
 {
@@ -17,7 +24,7 @@ struct BVHNode
 		uint32_t secondChildOffset; // interior
 	};
 
-	uint16_t primitiveCount; // 0 -> interior node
+	uint16_t primitiveCount; // 0 -> interior node, BVH::stubMarker -> leaf whose subtree is built on the first visit
 	uint8_t splitAxis;
 
 	bool isLeaf() const
@@ -26,6 +33,91 @@ struct BVHNode
 	}
 };
 
+// Four-wide node with the child bounds quantized to 8 bits on a grid relative to the node's own box, one cache line
+// each. The grid spacing is a power of two per axis, so dequantizing is a single multiply-add.
+struct alignas(64) QuantizedBVHNode
+{
+	static constexpr uint32_t maxChildCount = 4;
+
+	Vector3 origin;
+	int8_t exponents[3]; // grid spacing is 2^exponent
+	uint8_t childCount;
+	uint8_t childMin[3][maxChildCount];
+	uint8_t childMax[3][maxChildCount];
+	uint32_t childOffsets[maxChildCount]; // inner child -> node index, leaf child -> primitives offset
+	uint16_t primitiveCounts[maxChildCount]; // 0 -> inner child
+
+	float spacing(uint8_t axis) const
+	{
+		return std::bit_cast<float>(static_cast<uint32_t>(exponents[axis] + 127) << 23);
+	}
+
+	float dequantize(uint8_t axis, uint8_t value) const
+	{
+		return origin[axis] + static_cast<float>(value) * spacing(axis);
+	}
+
+	AABB childBounds(uint32_t child) const
+	{
+		Vector3 minPoint;
+		Vector3 maxPoint;
+		for (uint8_t axis = 0; axis < 3; ++axis)
+		{
+			minPoint[axis] = dequantize(axis, childMin[axis][child]);
+			maxPoint[axis] = dequantize(axis, childMax[axis][child]);
+		}
+		return {minPoint, maxPoint};
+	}
+
+	// Rounds outwards and verifies the rounding with the same arithmetic as dequantize, so the dequantized child
+	// bounds always contain the exact ones
+	void encode(const AABB* bounds, uint32_t count)
+	{
+		AABB nodeBounds;
+		for (uint32_t child = 0; child < count; ++child)
+			nodeBounds |= bounds[child];
+
+		origin = nodeBounds.minPoint;
+		childCount = static_cast<uint8_t>(count);
+		for (uint8_t axis = 0; axis < 3; ++axis)
+		{
+			int exponent = -126;
+			const float extent = nodeBounds.maxPoint[axis] - origin[axis];
+			if (extent > 0.f)
+				std::frexp(extent / 255.f, &exponent); // 2^exponent > extent / 255
+			exponents[axis] = static_cast<int8_t>(std::clamp(exponent, -126, 127));
+			while (exponents[axis] < 127 && dequantize(axis, 255) < nodeBounds.maxPoint[axis])
+				++exponents[axis];
+
+			const float gridSpacing = spacing(axis);
+			for (uint32_t child = 0; child < maxChildCount; ++child)
+			{
+				if (child >= count)
+				{
+					childMin[axis][child] = 0;
+					childMax[axis][child] = 0;
+					continue;
+				}
+
+				const float minValue = bounds[child].minPoint[axis];
+				const float maxValue = bounds[child].maxPoint[axis];
+				auto lo = static_cast<uint8_t>(std::clamp(std::floor((minValue - origin[axis]) / gridSpacing), 0.f,
+				                                          255.f));
+				auto hi = static_cast<uint8_t>(std::clamp(std::ceil((maxValue - origin[axis]) / gridSpacing), 0.f,
+				                                          255.f));
+				while (lo > 0 && dequantize(axis, lo) > minValue)
+					--lo;
+				while (hi < 255 && dequantize(axis, hi) < maxValue)
+					++hi;
+				childMin[axis][child] = lo;
+				childMax[axis][child] = hi;
+			}
+		}
+	}
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 64);
+
 class BVH
 {
 public:
@@ -36,75 +128,445 @@ public:
 		SAH
 	};
 
+	struct BuildSettings
+	{
+		SplitHeuristic splitHeuristic = SplitHeuristic::Middle;
+		uint32_t maxDepth = 10;
+		uint32_t maxPrimitiveCountPerLeaf = 4;
+
+		// Spatial splits (SBVH), only used with SAH and when the primitives can be clipped
+		bool spatialSplits = false;
+		float spatialSplitOverlap = 1e-5f; // child overlap area, relative to the root, above which they are tried
+		float spatialSplitBudget = 0.3f; // duplicated references allowed, relative to the primitive count
+
+		// Treelet restructuring and leaf collapsing after the build, worth it when a static scene is rendered for
+		// many frames
+		bool optimize = false;
+	};
+
+	// Cost of a box test relative to a primitive test, used by sahCost and the post-build optimization
+	static constexpr float nodeCost = 1.2f;
+
+	// Bounds of the part of a primitive that lies inside the box
+	using ClipFunction = std::function<AABB(uint32_t primitiveIndex, const AABB& box)>;
+
+	// Builds the subtree of a stub over the primitives [primitivesStart, primitivesEnd), which it may reorder among
+	// themselves. Its leaves reference the primitives by their index in the whole set. depth is that of the stub.
+	using SubtreeBuilder = std::function<void(BVH& subtree, uint32_t primitivesStart, uint32_t primitivesEnd,
+	                                          uint32_t depth)>;
+
 	BVH() = default;
 
-	BVH(std::vector<Triangle>& triangles)
+	// Builds the nodes over the primitive bounds and returns the primitives referenced by the leaves, in order. Without
+	// spatial splits this is a permutation, the caller reorders its primitives with applyPermutation so that every leaf
+	// covers a contiguous range. Spatial splits reference primitives straddling a split plane from both sides, so the
+	// result can be longer than the primitive count and contain the same index more than once.
+	std::vector<uint32_t> build(const std::vector<AABB>& primitiveBounds,
+	                            const std::vector<Vector3>& primitiveCentroids, const BuildSettings& settings,
+	                            const ClipFunction& clipPrimitive = {})
+	{
+		nodes.clear();
+		quantizedNodes.clear();
+		stubs.clear();
+		buildSubtree = {};
+
+		std::vector<uint32_t> permutation(primitiveBounds.size());
+		std::iota(permutation.begin(), permutation.end(), 0);
+		if (primitiveBounds.empty())
+			return permutation;
+
+		nodes.reserve(2 * primitiveBounds.size() / std::max(1u, settings.maxPrimitiveCountPerLeaf) + 1);
+		if (settings.splitHeuristic == SplitHeuristic::SAH && settings.spatialSplits && clipPrimitive)
+		{
+			std::vector<Reference> references;
+			references.reserve(primitiveBounds.size());
+			AABB rootBounds;
+			for (uint32_t primitiveIndex = 0; primitiveIndex < primitiveBounds.size(); ++primitiveIndex)
+			{
+				references.push_back({primitiveIndex, primitiveBounds[primitiveIndex]});
+				rootBounds |= primitiveBounds[primitiveIndex];
+			}
+
+			SpatialBuildContext context{
+				.settings = settings,
+				.clipPrimitive = clipPrimitive,
+				.minOverlapArea = settings.spatialSplitOverlap * rootBounds.area(),
+				.maxReferenceCount = static_cast<size_t>(static_cast<float>(primitiveBounds.size()) *
+					(1.f + settings.spatialSplitBudget)),
+				.referenceCount = primitiveBounds.size()
+			};
+			context.leafReferences.reserve(context.maxReferenceCount);
+			buildSpatial(context, references, 0);
+			permutation = std::move(context.leafReferences);
+		}
+		else
+		{
+			BuildContext context{settings, primitiveBounds, primitiveCentroids};
+			build(context, permutation, Range{0, static_cast<uint32_t>(primitiveBounds.size())}, 0);
+		}
+
+		if (settings.optimize)
+			optimize(permutation, std::min(settings.maxDepth, maxStackDepth - 2));
+		referenceCost = sahCost();
+		return permutation;
+	}
+
+	// build for the top levels only, ranges of up to stubPrimitiveCount primitives become stub leaves. A stub is
+	// expanded by subtreeBuilder when a ray first reaches it, concurrent rays wait for the first one. The top levels
+	// split at the middle, SAH sorts all primitives on every level and would take most of the build time. They are
+	// neither optimized nor quantized and have no spatial splits, so the result is always a permutation.
+	std::vector<uint32_t> buildLazy(const std::vector<AABB>& primitiveBounds,
+	                                const std::vector<Vector3>& primitiveCentroids, const BuildSettings& settings,
+	                                uint32_t stubPrimitiveCount, SubtreeBuilder subtreeBuilder)
 	{
-		Range range{0, static_cast<uint32_t>(triangles.size())};
-		build(triangles, range, 0);
+		nodes.clear();
+		quantizedNodes.clear();
+		stubs.clear();
+		buildSubtree = std::move(subtreeBuilder);
+
+		std::vector<uint32_t> permutation(primitiveBounds.size());
+		std::iota(permutation.begin(), permutation.end(), 0);
+		if (primitiveBounds.empty())
+			return permutation;
+
+		BuildSettings topSettings = settings;
+		topSettings.splitHeuristic = SplitHeuristic::Middle;
+		BuildContext context{topSettings, primitiveBounds, primitiveCentroids, std::max(1u, stubPrimitiveCount)};
+		build(context, permutation, Range{0, static_cast<uint32_t>(primitiveBounds.size())}, 0);
+		referenceCost = sahCost();
+		return permutation;
 	}
 
-	HitInfo closestHit(const std::vector<Triangle>& triangles, const std::vector<Material>& materials, Ray& ray) const
+	// Moves the primitive ranges of the leaves by offset, for a subtree built over a part of the primitives
+	void offsetPrimitives(uint32_t offset)
 	{
-		std::function closestHitFunc = [&triangles, &ray, &materials](HitInfo& hitInfo, uint32_t trianglesStart,
-		                                                              uint32_t trianglesEnd)
+		for (BVHNode& node : nodes)
 		{
-			for (uint32_t triangleIndex = trianglesStart; triangleIndex < trianglesEnd; ++triangleIndex)
-			{
-				const auto& triangle = triangles[triangleIndex];
-				const auto& material = materials[triangle.materialIndex];
+			if (node.isLeaf())
+				node.primitivesOffset += offset;
+		}
+	}
 
-				HitInfo currHitInfo = triangle.intersect(ray, material.cullBackFace());
+	// Recomputes the node bounds after the primitives moved, the topology and the primitive order are kept. The
+	// bounds are indexed like the primitives after applyPermutation.
+	void refit(const std::vector<AABB>& primitiveBounds)
+	{
+		if (isQuantized())
+		{
+			refitQuantized(0, primitiveBounds);
+			return;
+		}
 
-				if (currHitInfo.hit && currHitInfo.t < hitInfo.t)
+		// Children are always stored after their parent, so a backwards sweep updates them first
+		for (size_t nodeIndex = nodes.size(); nodeIndex-- > 0;)
+		{
+			BVHNode& node = nodes[nodeIndex];
+			AABB boundingBox;
+			if (node.primitiveCount == stubMarker)
+			{
+				// An unvisited stub has no subtree yet, its bounds are those of its primitives
+				const Stub& stub = *stubs[node.primitivesOffset];
+				if (stub.built.load(std::memory_order_acquire))
 				{
-					currHitInfo.triangleIndex = triangleIndex;
-					hitInfo = currHitInfo;
-					ray.maxT = hitInfo.t;
+					stub.subtree->refit(primitiveBounds);
+					boundingBox = stub.subtree->bounds();
+				}
+				else
+				{
+					for (uint32_t index = stub.primitives.start; index < stub.primitives.end; ++index)
+						boundingBox |= primitiveBounds[index];
 				}
 			}
-			return false;
-		};
-		return traverse(ray, closestHitFunc);
+			else if (node.isLeaf())
+			{
+				const uint32_t primitivesEnd = node.primitivesOffset + node.primitiveCount;
+				for (uint32_t index = node.primitivesOffset; index < primitivesEnd; ++index)
+					boundingBox |= primitiveBounds[index];
+			}
+			else
+			{
+				boundingBox = nodes[nodeIndex + 1].boundingBox;
+				boundingBox |= nodes[node.secondChildOffset].boundingBox;
+			}
+			node.boundingBox = boundingBox;
+		}
 	}
 
-	bool anyHit(const std::vector<Triangle>& triangles, const std::vector<Material>& materials, Ray& ray) const
+	// Expected traversal cost by the surface area heuristic (nodeCost per box test and one unit per primitive test),
+	// relative to the area of the root
+	float sahCost() const
 	{
-		std::function anyHitFunc = [&triangles, &materials, &ray](HitInfo& hitInfo, uint32_t trianglesStart,
-		                                                          uint32_t trianglesEnd)
+		const float rootArea = bounds().area();
+		if ((nodes.empty() && !isQuantized()) || rootArea <= 0.f)
+			return 0.f;
+
+		float cost = 0.f;
+		for (const auto& node : quantizedNodes)
 		{
-			for (uint32_t triangleIndex = trianglesStart; triangleIndex < trianglesEnd; ++triangleIndex)
+			// A quantized node tests all of its child boxes at once
+			AABB nodeBounds;
+			for (uint32_t child = 0; child < node.childCount; ++child)
+			{
+				const AABB childBounds = node.childBounds(child);
+				nodeBounds |= childBounds;
+				cost += childBounds.area() * static_cast<float>(node.primitiveCounts[child]);
+			}
+			cost += nodeBounds.area() * static_cast<float>(node.childCount) * nodeCost;
+		}
+		for (const auto& node : nodes)
+		{
+			if (node.primitiveCount == stubMarker)
+			{
+				// A built stub costs what its subtree does, an unvisited one counts as a single leaf
+				const Stub& stub = *stubs[node.primitivesOffset];
+				if (stub.built.load(std::memory_order_acquire))
+					cost += stub.subtree->sahCost() * stub.subtree->bounds().area();
+				else
+					cost += node.boundingBox.area() * static_cast<float>(stub.primitives.count());
+				continue;
+			}
+			cost += node.boundingBox.area() * (node.isLeaf() ? static_cast<float>(node.primitiveCount) : nodeCost);
+		}
+		return cost / rootArea;
+	}
+
+	// Degradation by refitting since the last build, 1 -> as good as the built tree
+	float costGrowth() const
+	{
+		return referenceCost > 0.f ? sahCost() / referenceCost : 1.f;
+	}
+
+	// Converts the built tree to four-wide quantized nodes and releases the binary ones. Traversal, refitting and the
+	// cost metric keep working on the quantized form.
+	void quantize()
+	{
+		// The top levels of a lazy build stay binary, their subtrees are quantized by the subtree builder
+		if (nodes.empty() || !stubs.empty())
+			return;
+
+		quantizedNodes.clear();
+		quantizedNodes.reserve(nodes.size() / 3 + 1);
+		quantizeNode(0);
+		nodes = {};
+		referenceCost = sahCost();
+	}
+
+	bool isQuantized() const
+	{
+		return !quantizedNodes.empty();
+	}
+
+	size_t memoryUsage() const
+	{
+		size_t usage = nodes.size() * sizeof(BVHNode) + quantizedNodes.size() * sizeof(QuantizedBVHNode);
+		for (const auto& stub : stubs)
+		{
+			if (stub->built.load(std::memory_order_acquire))
+				usage += stub->subtree->memoryUsage();
+		}
+		return usage;
+	}
+
+	template <typename Primitive>
+	static void applyPermutation(std::vector<Primitive>& primitives, const std::vector<uint32_t>& permutation)
+	{
+		std::vector<Primitive> reordered;
+		reordered.reserve(permutation.size());
+		for (uint32_t primitiveIndex : permutation)
+			reordered.push_back(primitives[primitiveIndex]);
+		primitives = std::move(reordered);
+	}
+
+	AABB bounds() const
+	{
+		if (isQuantized())
+		{
+			AABB rootBounds;
+			for (uint32_t child = 0; child < quantizedNodes.front().childCount; ++child)
+				rootBounds |= quantizedNodes.front().childBounds(child);
+			return rootBounds;
+		}
+		return nodes.empty() ? AABB{} : nodes.front().boundingBox;
+	}
+
+	HitInfo traverse(const Ray& ray, const std::function<bool(HitInfo&, uint32_t, uint32_t)>& hitFunction) const
+	{
+		HitInfo hitInfo;
+		traverse(ray, hitInfo, hitFunction);
+		return hitInfo;
+	}
+
+	// traverse as a coroutine for interleaveTraversals. Each node is prefetched and the ray suspended before the node
+	// is read. hitFunction returns a TraversalTask as well, so it can suspend on its primitives. The hits go to
+	// hitInfo, the result tells whether hitFunction ended the traversal.
+	template <typename HitFunction>
+	TraversalTask traverseInterleaved(const Ray& ray, HitInfo& hitInfo, HitFunction hitFunction,
+	                                  TraversalContext& context) const
+	{
+		if (isQuantized())
+		{
+			const auto intersectChildren = Kernels::active().intersectChildren;
+			StackEntry nodesToTraverse[3 * maxStackDepth + 1];
+			int32_t stackIndex = 0;
+			nodesToTraverse[stackIndex++] = {0, 0.f};
+
+			while (stackIndex > 0)
 			{
-				const auto& triangle = triangles[triangleIndex];
-				const auto& material = materials[triangle.materialIndex];
-				HitInfo currHitInfo = triangle.intersect(ray, material.cullBackFace());
+				const StackEntry entry = nodesToTraverse[--stackIndex];
+				if (entry.entryT > ray.maxT)
+					continue;
 
-				if (currHitInfo.hit)
+				TraversalContext::prefetch(&quantizedNodes[entry.index]);
+				co_await context.suspend();
+
+				const QuantizedBVHNode& node = quantizedNodes[entry.index];
+				StackEntry innerChildren[QuantizedBVHNode::maxChildCount];
+				StackEntry leafChildren[QuantizedBVHNode::maxChildCount];
+				uint32_t innerCount;
+				uint32_t leafCount;
+				hitChildren(node, ray, intersectChildren, innerChildren, innerCount, leafChildren, leafCount);
+
+				for (uint32_t leaf = 0; leaf < leafCount; ++leaf)
 				{
-					const auto& material = materials[triangle.materialIndex];
-					if (material.type != Material::Type::REFRACTIVE)
-					{
-						hitInfo.hit = true;
-						return true;
-					}
+					if (leafChildren[leaf].entryT > ray.maxT)
+						break;
+
+					const uint32_t child = leafChildren[leaf].index;
+					const uint32_t primitivesOffset = node.childOffsets[child];
+					if (co_await hitFunction(hitInfo, primitivesOffset, primitivesOffset + node.primitiveCounts[child]))
+						co_return true;
 				}
+
+				for (uint32_t inner = innerCount; inner-- > 0;)
+					nodesToTraverse[stackIndex++] = innerChildren[inner];
 			}
-			return false;
-		};
-		HitInfo hitInfo = traverse(ray, anyHitFunc);
-		return hitInfo.hit;
+			co_return false;
+		}
+
+		if (nodes.empty())
+			co_return false;
+
+		const bool dirIsNegative[3] = {ray.directionN.x < 0.f, ray.directionN.y < 0.f, ray.directionN.z < 0.f};
+		uint32_t nodesToTraverse[maxStackDepth];
+		int32_t stackIndex = 0;
+		nodesToTraverse[stackIndex++] = 0;
+
+		while (stackIndex > 0)
+		{
+			const uint32_t nodeIndex = nodesToTraverse[--stackIndex];
+			TraversalContext::prefetch(&nodes[nodeIndex]);
+			co_await context.suspend();
+
+			const BVHNode& node = nodes[nodeIndex];
+			float entryT;
+			if (!node.boundingBox.intersect(ray, entryT))
+				continue;
+
+			if (node.primitiveCount == stubMarker)
+			{
+				if (co_await stubSubtree(node.primitivesOffset).traverseInterleaved(ray, hitInfo, hitFunction, context))
+					co_return true;
+			}
+			else if (node.primitiveCount > 0)
+			{
+				if (co_await hitFunction(hitInfo, node.primitivesOffset, node.primitivesOffset + node.primitiveCount))
+					co_return true;
+			}
+			else
+			{
+				uint32_t firstChild = nodeIndex + 1;
+				uint32_t secondChild = node.secondChildOffset;
+				if (dirIsNegative[node.splitAxis])
+					std::swap(firstChild, secondChild);
+				nodesToTraverse[stackIndex++] = firstChild;
+				nodesToTraverse[stackIndex++] = secondChild;
+			}
+		}
+		co_return false;
 	}
 
-	HitInfo traverse(const Ray& ray, const std::function<bool(HitInfo&, uint32_t, uint32_t)>& hitFunction) const
+private:
+	friend class BVHCache;
+
+	struct StackEntry
 	{
-		HitInfo hitInfo;
+		uint32_t index;
+		float entryT;
+	};
+
+	static constexpr uint16_t stubMarker = std::numeric_limits<uint16_t>::max();
+
+	// Leaf of the top levels of a lazy build, its primitivesOffset is the stub index
+	struct Stub
+	{
+		Range primitives;
+		uint32_t depth;
+		std::unique_ptr<BVH> subtree = std::make_unique<BVH>();
+		std::once_flag once;
+		std::atomic<bool> built = false;
+	};
+
+	const BVH& stubSubtree(uint32_t stubIndex) const
+	{
+		Stub& stub = *stubs[stubIndex];
+		if (!stub.built.load(std::memory_order_acquire))
+		{
+			std::call_once(stub.once, [this, &stub]
+			{
+				buildSubtree(*stub.subtree, stub.primitives.start, stub.primitives.end, stub.depth);
+				stub.built.store(true, std::memory_order_release);
+			});
+		}
+		return *stub.subtree;
+	}
+
+	// Insertion sort, nodes have at most four children
+	static void sortNearerFirst(StackEntry* entries, uint32_t count)
+	{
+		for (uint32_t i = 1; i < count; ++i)
+		{
+			for (uint32_t j = i; j > 0 && entries[j].entryT < entries[j - 1].entryT; --j)
+				std::swap(entries[j], entries[j - 1]);
+		}
+	}
+
+	// Splits the children of a quantized node that the ray hits into leaves, by child slot, and inner nodes, by node
+	// index, both sorted near to far
+	static void hitChildren(const QuantizedBVHNode& node, const Ray& ray,
+	                        decltype(Kernels::Table::intersectChildren) intersect,
+	                        StackEntry (&innerChildren)[QuantizedBVHNode::maxChildCount], uint32_t& innerCount,
+	                        StackEntry (&leafChildren)[QuantizedBVHNode::maxChildCount], uint32_t& leafCount)
+	{
+		innerCount = 0;
+		leafCount = 0;
+		float entryT[QuantizedBVHNode::maxChildCount];
+		for (uint32_t hitMask = intersect(node, ray, entryT); hitMask; hitMask &= hitMask - 1)
+		{
+			const auto child = static_cast<uint32_t>(std::countr_zero(hitMask));
+			if (node.primitiveCounts[child] > 0)
+				leafChildren[leafCount++] = {child, entryT[child]};
+			else
+				innerChildren[innerCount++] = {node.childOffsets[child], entryT[child]};
+		}
+		sortNearerFirst(leafChildren, leafCount);
+		sortNearerFirst(innerChildren, innerCount);
+	}
+
+	// Adds the hits to hitInfo, returns whether hitFunction ended the traversal
+	bool traverse(const Ray& ray, HitInfo& hitInfo,
+	              const std::function<bool(HitInfo&, uint32_t, uint32_t)>& hitFunction) const
+	{
+		if (isQuantized())
+			return traverseQuantized(ray, hitInfo, hitFunction);
+
 		if (nodes.empty())
-			return hitInfo;
+			return false;
 
 		const bool dirIsNegative[3] = {ray.directionN.x < 0.f, ray.directionN.y < 0.f, ray.directionN.z < 0.f};
+		const Vector3A origin(ray.origin);
+		const Vector3A inverseDirection(ray.directionNInv);
 
 		// Fixed-size stack to avoid dynamic memory allocation
-		constexpr size_t maxStackDepth = 32;
 		uint32_t nodesToTraverse[maxStackDepth];
 		int32_t stackIndex = 0;
 
@@ -116,14 +578,20 @@ public:
 		{
 			const uint32_t nodeIndex = nodesToTraverse[--stackIndex];
 			const BVHNode& node = nodes[nodeIndex];
-			if (node.boundingBox.intersect(ray))
+			float entryT;
+			if (node.boundingBox.intersect(origin, inverseDirection, ray.maxT, entryT))
 			{
-				if (node.primitiveCount > 0)
+				if (node.primitiveCount == stubMarker)
 				{
-					uint32_t trianglesOffset = node.primitivesOffset;
-					uint32_t trianglesCount = node.primitiveCount;
-					if (hitFunction(hitInfo, trianglesOffset, trianglesOffset + trianglesCount))
-						return hitInfo;
+					if (stubSubtree(node.primitivesOffset).traverse(ray, hitInfo, hitFunction))
+						return true;
+				}
+				else if (node.primitiveCount > 0)
+				{
+					uint32_t primitivesOffset = node.primitivesOffset;
+					uint32_t primitivesCount = node.primitiveCount;
+					if (hitFunction(hitInfo, primitivesOffset, primitivesOffset + primitivesCount))
+						return true;
 				}
 				else
 				{
@@ -137,14 +605,171 @@ public:
 			}
 		}
 
-		return hitInfo;
+		return false;
 	}
 
-private:
-	void build(std::vector<Triangle>& triangles, Range range, uint32_t depth)
+	bool traverseQuantized(const Ray& ray, HitInfo& hitInfo,
+	                       const std::function<bool(HitInfo&, uint32_t, uint32_t)>& hitFunction) const
+	{
+		const auto intersectChildren = Kernels::active().intersectChildren;
+
+		// Every node pops one entry and pushes at most four
+		StackEntry nodesToTraverse[3 * maxStackDepth + 1];
+		int32_t stackIndex = 0;
+		nodesToTraverse[stackIndex++] = {0, 0.f};
+
+		while (stackIndex > 0)
+		{
+			const StackEntry entry = nodesToTraverse[--stackIndex];
+
+			// A nearer hit may have been found since the node was pushed
+			if (entry.entryT > ray.maxT)
+				continue;
+
+			const QuantizedBVHNode& node = quantizedNodes[entry.index];
+			StackEntry innerChildren[QuantizedBVHNode::maxChildCount];
+			StackEntry leafChildren[QuantizedBVHNode::maxChildCount];
+			uint32_t innerCount;
+			uint32_t leafCount;
+			hitChildren(node, ray, intersectChildren, innerChildren, innerCount, leafChildren, leafCount);
+
+			// Leaves right away from near to far, so that their hits cull the inner children
+			for (uint32_t leaf = 0; leaf < leafCount; ++leaf)
+			{
+				if (leafChildren[leaf].entryT > ray.maxT)
+					break;
+
+				const uint32_t child = leafChildren[leaf].index;
+				const uint32_t primitivesOffset = node.childOffsets[child];
+				if (hitFunction(hitInfo, primitivesOffset, primitivesOffset + node.primitiveCounts[child]))
+					return true;
+			}
+
+			// Pushed far to near, so the nearest inner child is visited next
+			for (uint32_t inner = innerCount; inner-- > 0;)
+				nodesToTraverse[stackIndex++] = innerChildren[inner];
+		}
+
+		return false;
+	}
+
+	uint32_t quantizeNode(uint32_t binaryIndex)
+	{
+		// Pull grandchildren up until the node is four wide, opening the largest inner child first
+		uint32_t children[QuantizedBVHNode::maxChildCount];
+		uint32_t childCount = 0;
+		if (nodes[binaryIndex].isLeaf())
+		{
+			children[childCount++] = binaryIndex;
+		}
+		else
+		{
+			children[childCount++] = binaryIndex + 1;
+			children[childCount++] = nodes[binaryIndex].secondChildOffset;
+		}
+
+		while (childCount < QuantizedBVHNode::maxChildCount)
+		{
+			int32_t largestInner = -1;
+			float largestArea = -1.f;
+			for (uint32_t child = 0; child < childCount; ++child)
+			{
+				const BVHNode& childNode = nodes[children[child]];
+				if (!childNode.isLeaf() && childNode.boundingBox.area() > largestArea)
+				{
+					largestInner = static_cast<int32_t>(child);
+					largestArea = childNode.boundingBox.area();
+				}
+			}
+			if (largestInner < 0)
+				break;
+
+			const uint32_t opened = children[largestInner];
+			children[largestInner] = opened + 1;
+			children[childCount++] = nodes[opened].secondChildOffset;
+		}
+
+		AABB childBounds[QuantizedBVHNode::maxChildCount];
+		for (uint32_t child = 0; child < childCount; ++child)
+			childBounds[child] = nodes[children[child]].boundingBox;
+
+		const uint32_t nodeIndex = static_cast<uint32_t>(quantizedNodes.size());
+		quantizedNodes.emplace_back();
+		quantizedNodes[nodeIndex].encode(childBounds, childCount);
+		for (uint32_t child = 0; child < QuantizedBVHNode::maxChildCount; ++child)
+		{
+			uint32_t childOffset = 0;
+			uint16_t primitiveCount = 0;
+			if (child < childCount)
+			{
+				const BVHNode& childNode = nodes[children[child]];
+				primitiveCount = childNode.isLeaf() ? childNode.primitiveCount : 0;
+				childOffset = childNode.isLeaf() ? childNode.primitivesOffset : quantizeNode(children[child]);
+			}
+			quantizedNodes[nodeIndex].childOffsets[child] = childOffset;
+			quantizedNodes[nodeIndex].primitiveCounts[child] = primitiveCount;
+		}
+		return nodeIndex;
+	}
+
+	AABB refitQuantized(uint32_t nodeIndex, const std::vector<AABB>& primitiveBounds)
+	{
+		QuantizedBVHNode& node = quantizedNodes[nodeIndex];
+		AABB childBounds[QuantizedBVHNode::maxChildCount];
+		AABB nodeBounds;
+		for (uint32_t child = 0; child < node.childCount; ++child)
+		{
+			if (node.primitiveCounts[child] > 0)
+			{
+				const uint32_t primitivesEnd = node.childOffsets[child] + node.primitiveCounts[child];
+				for (uint32_t index = node.childOffsets[child]; index < primitivesEnd; ++index)
+					childBounds[child] |= primitiveBounds[index];
+			}
+			else
+			{
+				childBounds[child] = refitQuantized(node.childOffsets[child], primitiveBounds);
+			}
+			nodeBounds |= childBounds[child];
+		}
+		node.encode(childBounds, node.childCount);
+		return nodeBounds;
+	}
+
+	struct BuildContext
+	{
+		const BuildSettings& settings;
+		const std::vector<AABB>& primitiveBounds;
+		const std::vector<Vector3>& primitiveCentroids;
+		uint32_t stubPrimitiveCount = 0; // buildLazy, 0 -> the whole tree is built
+	};
+
+	void build(const BuildContext& context, std::vector<uint32_t>& permutation, Range range, uint32_t depth)
 	{
-		AABB boundingBox{triangles, range};
-		if (depth >= maxDepth || range.count() <= maxTriangleCountPerLeaf)
+		const auto& centroids = context.primitiveCentroids;
+		const auto first = permutation.begin() + range.start;
+		const auto last = permutation.begin() + range.end;
+
+		AABB boundingBox;
+		for (auto it = first; it != last; ++it)
+			boundingBox |= context.primitiveBounds[*it];
+
+		const uint32_t maxDepth = std::min(context.settings.maxDepth, maxStackDepth - 2);
+		if (depth < maxDepth && range.count() > context.settings.maxPrimitiveCountPerLeaf &&
+			range.count() <= context.stubPrimitiveCount)
+		{
+			BVHNode stubNode{
+				.boundingBox = boundingBox,
+				.primitivesOffset = static_cast<uint32_t>(stubs.size()),
+				.primitiveCount = stubMarker
+			};
+			nodes.emplace_back(stubNode);
+			Stub& stub = *stubs.emplace_back(std::make_unique<Stub>());
+			stub.primitives = range;
+			stub.depth = depth;
+			return;
+		}
+
+		if (depth >= maxDepth || range.count() <= context.settings.maxPrimitiveCountPerLeaf)
 		{
 			// Create leaf node
 			BVHNode leafNode{
@@ -153,107 +778,655 @@ private:
 				.primitiveCount = static_cast<uint16_t>(range.count())
 			};
 			nodes.emplace_back(leafNode);
+			return;
 		}
-		else
+
+		uint32_t mid = (range.start + range.end) / 2;
+		Vector3 extent = boundingBox.extent();
+		uint8_t splitAxis = static_cast<uint8_t>(std::distance(std::begin(extent.data),
+		                                                       std::ranges::max_element(extent.data)));
+
+		auto centroidLess = [&centroids](uint8_t axis)
 		{
-			uint32_t mid = (range.start + range.end) / 2;
-			Vector3 extent = boundingBox.extent();
-			uint8_t splitAxis = static_cast<uint8_t>(std::distance(std::begin(extent.data),
-			                                                       std::ranges::max_element(extent.data)));
+			return [&centroids, axis](uint32_t indexA, uint32_t indexB)
+			{
+				return centroids[indexA][axis] < centroids[indexB][axis];
+			};
+		};
 
-			switch (splitHeuristic)
+		switch (context.settings.splitHeuristic)
+		{
+		case SplitHeuristic::Middle:
 			{
-			case SplitHeuristic::Middle:
+				float midVal = (boundingBox.minPoint[splitAxis] + boundingBox.maxPoint[splitAxis]) * 0.5f;
+				auto midIt = std::partition(first, last, [&centroids, splitAxis, midVal](uint32_t index)
 				{
-					float midVal = (boundingBox.minPoint[splitAxis] + boundingBox.maxPoint[splitAxis]) * 0.5f;
-					auto midIt = std::partition(triangles.begin() + range.start, triangles.begin() + range.end,
-					                            [splitAxis, midVal](const Triangle& tri)
-					                            {
-						                            return tri.centroid()[splitAxis] < midVal;
-					                            });
-					mid = static_cast<uint32_t>(std::distance(triangles.begin(), midIt));
-					if (midIt != triangles.begin() + range.start && midIt != triangles.begin() + range.end)
-						break;
-				}
-			case SplitHeuristic::Equal:
+					return centroids[index][splitAxis] < midVal;
+				});
+				mid = static_cast<uint32_t>(std::distance(permutation.begin(), midIt));
+				if (midIt != first && midIt != last)
+					break;
+			}
+		case SplitHeuristic::Equal:
+			{
+				mid = (range.start + range.end) / 2;
+				std::nth_element(first, permutation.begin() + mid, last, centroidLess(splitAxis));
+			}
+			break;
+		case SplitHeuristic::SAH:
+		default:
+			{
+				if (range.count() == 2)
 				{
 					mid = (range.start + range.end) / 2;
-					std::nth_element(triangles.begin() + range.start, triangles.begin() + mid,
-					                 triangles.begin() + range.end,
-					                 [splitAxis](const Triangle& triA, const Triangle& triB)
-					                 {
-						                 return triA.centroid()[splitAxis] < triB.centroid()[splitAxis];
-					                 });
+					std::nth_element(first, permutation.begin() + mid, last, centroidLess(splitAxis));
 				}
-				break;
-			case SplitHeuristic::SAH:
-			default:
+				else
 				{
-					if (range.count() == 2)
+					// Sweep over the sorted primitives, right-side areas are accumulated from the back first
+					std::vector<float> rightAreas(range.count());
+					float minCost = std::numeric_limits<float>::max();
+					float boundingBoxArea = boundingBox.area();
+					for (uint8_t axis = 0; axis < 3; axis++)
 					{
-						mid = (range.start + range.end) / 2;
-						std::nth_element(triangles.begin() + range.start, triangles.begin() + mid,
-						                 triangles.begin() + range.end,
-						                 [splitAxis](const Triangle& triA, const Triangle& triB)
-						                 {
-							                 return triA.centroid()[splitAxis] < triB.centroid()[splitAxis];
-						                 });
-					}
-					else
-					{
-						float minCost = std::numeric_limits<float>::max();
-						float boundingBoxArea = boundingBox.area();
-						for (uint8_t axis = 0; axis < 3; axis++)
+						std::sort(first, last, centroidLess(axis));
+
+						AABB right;
+						for (uint32_t index = range.end - 1; index > range.start; index--)
 						{
-							std::sort(triangles.begin() + range.start, triangles.begin() + range.end,
-							          [axis](const Triangle& triA, const Triangle& triB)
-							          {
-								          return triA.centroid()[axis] < triB.centroid()[axis];
-							          });
-							for (uint32_t index = range.start + 1; index < range.end; index++)
+							right |= context.primitiveBounds[permutation[index]];
+							rightAreas[index - range.start] = right.area();
+						}
+
+						AABB left;
+						for (uint32_t index = range.start + 1; index < range.end; index++)
+						{
+							left |= context.primitiveBounds[permutation[index - 1]];
+							float cost = ((index - range.start) * left.area() + (range.end - index) * rightAreas[index -
+								range.start]) / boundingBoxArea;
+							if (cost < minCost)
 							{
-								AABB left = AABB(triangles, Range(range.start, index));
-								AABB right = AABB(triangles, Range{index, range.end});
-								float cost = ((index - range.start) * left.area() + (range.end - index) * right.area())
-									/ boundingBoxArea;
-								if (cost < minCost)
-								{
-									minCost = cost;
-									splitAxis = axis;
-									mid = index;
-								}
+								minCost = cost;
+								splitAxis = axis;
+								mid = index;
 							}
 						}
-
-						std::sort(triangles.begin() + range.start, triangles.begin() + range.end,
-						          [splitAxis](const Triangle& triA, const Triangle& triB)
-						          {
-							          return triA.centroid()[splitAxis] < triB.centroid()[splitAxis];
-						          });
 					}
+
+					std::sort(first, last, centroidLess(splitAxis));
+				}
+			}
+			break;
+		}
+
+		BVHNode interiorNode{
+			.boundingBox = boundingBox,
+			.primitiveCount = 0,
+			.splitAxis = splitAxis
+		};
+
+		uint32_t interiorNodeIndex = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back(interiorNode);
+
+		build(context, permutation, Range{range.start, mid}, depth + 1);
+
+		nodes[interiorNodeIndex].secondChildOffset = static_cast<uint32_t>(nodes.size());
+
+		build(context, permutation, Range{mid, range.end}, depth + 1);
+	}
+
+	// Explicit tree used by the post-build optimization, indexed like the nodes it was created from
+	struct OptimizationNode
+	{
+		AABB bounds;
+		uint32_t children[2];
+		Range primitives; // leaf, into the references
+		uint32_t primitiveCount; // whole subtree
+		float cost;
+		bool isLeaf;
+		bool collapsed = false;
+	};
+
+	static constexpr uint32_t treeletSize = 7;
+	static constexpr uint32_t optimizationPasses = 3;
+	static constexpr uint32_t maxCollapsedLeafSize = 16;
+
+	// TRBVH (Karras and Aila 2013): every treelet of up to seven subtrees is rearranged into the binary tree of minimal
+	// SAH cost, bottom-up, in a few passes. Afterwards subtrees are collapsed into leaves where that is cheaper.
+	void optimize(std::vector<uint32_t>& references, uint32_t maxDepth)
+	{
+		std::vector<OptimizationNode> tree(nodes.size());
+		for (size_t nodeIndex = nodes.size(); nodeIndex-- > 0;)
+		{
+			const BVHNode& node = nodes[nodeIndex];
+			OptimizationNode& treeNode = tree[nodeIndex];
+			treeNode.bounds = node.boundingBox;
+			treeNode.isLeaf = node.isLeaf();
+			if (node.isLeaf())
+			{
+				treeNode.primitives = {node.primitivesOffset, node.primitivesOffset + node.primitiveCount};
+				treeNode.primitiveCount = node.primitiveCount;
+				treeNode.cost = node.boundingBox.area() * static_cast<float>(node.primitiveCount);
+			}
+			else
+			{
+				treeNode.children[0] = static_cast<uint32_t>(nodeIndex) + 1;
+				treeNode.children[1] = node.secondChildOffset;
+				updateOptimizationNode(tree, treeNode);
+			}
+		}
+
+		// Independent subtrees go to the thread pool, the nodes above them are handled afterwards. A treelet reuses the
+		// nodes it opens, subtree roots included, so the split is redone on the restructured tree before every pass.
+		std::unique_ptr<ThreadPool> threadPool;
+		for (uint32_t pass = 0; pass < optimizationPasses; ++pass)
+		{
+			std::vector<uint32_t> topNodes;
+			const std::vector<uint32_t> subtrees = splitIntoSubtrees(tree, topNodes);
+			if (subtrees.size() > 1)
+			{
+				// One pool for all passes, no larger than the work since this runs inside the per-mesh build tasks
+				if (!threadPool)
+				{
+					const uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+					threadPool = std::make_unique<ThreadPool>(std::min<size_t>(subtrees.size(), threadCount));
 				}
+
+				std::vector<std::future<void>> results;
+				for (uint32_t subtree : subtrees)
+					results.emplace_back(threadPool->Enqueue([&tree, subtree] { restructureSubtree(tree, subtree); }));
+				for (auto&& result : results)
+					result.get();
+			}
+			else
+			{
+				restructureSubtree(tree, subtrees.front());
+			}
+
+			// Children were split off after their parents
+			for (auto it = topNodes.rbegin(); it != topNodes.rend(); ++it)
+				restructureTreelet(tree, *it);
+		}
+
+		collapseSubtree(tree, 0);
+
+		std::vector<BVHNode> optimizedNodes;
+		std::vector<uint32_t> optimizedReferences;
+		optimizedNodes.reserve(nodes.size());
+		optimizedReferences.reserve(references.size());
+		linearize(tree, 0, 0, maxDepth, references, optimizedNodes, optimizedReferences);
+		nodes = std::move(optimizedNodes);
+		references = std::move(optimizedReferences);
+	}
+
+	// Disjoint subtrees of the current topology for the thread pool, found by opening the largest one until there
+	// are a few per thread. The opened nodes go to topNodes, parents first. Small trees are not worth the threads.
+	static std::vector<uint32_t> splitIntoSubtrees(const std::vector<OptimizationNode>& tree,
+	                                               std::vector<uint32_t>& topNodes)
+	{
+		constexpr uint32_t minParallelPrimitiveCount = 1024;
+		const size_t subtreeTarget = 4 * std::max(1u, std::thread::hardware_concurrency());
+		std::vector<uint32_t> subtrees{0};
+		while (subtrees.size() < subtreeTarget)
+		{
+			auto largest = std::ranges::max_element(subtrees, {}, [&tree](uint32_t nodeIndex)
+			{
+				return tree[nodeIndex].isLeaf ? 0u : tree[nodeIndex].primitiveCount;
+			});
+			if (tree[*largest].isLeaf || tree[*largest].primitiveCount < minParallelPrimitiveCount)
 				break;
+
+			const uint32_t parent = *largest;
+			topNodes.push_back(parent);
+			*largest = tree[parent].children[0];
+			subtrees.push_back(tree[parent].children[1]);
+		}
+		return subtrees;
+	}
+
+	static void updateOptimizationNode(const std::vector<OptimizationNode>& tree, OptimizationNode& node)
+	{
+		const OptimizationNode& left = tree[node.children[0]];
+		const OptimizationNode& right = tree[node.children[1]];
+		node.bounds = left.bounds;
+		node.bounds |= right.bounds;
+		node.primitiveCount = left.primitiveCount + right.primitiveCount;
+		node.cost = nodeCost * node.bounds.area() + left.cost + right.cost;
+	}
+
+	static void restructureSubtree(std::vector<OptimizationNode>& tree, uint32_t nodeIndex)
+	{
+		if (tree[nodeIndex].isLeaf)
+			return;
+
+		restructureSubtree(tree, tree[nodeIndex].children[0]);
+		restructureSubtree(tree, tree[nodeIndex].children[1]);
+		restructureTreelet(tree, nodeIndex);
+	}
+
+	static void restructureTreelet(std::vector<OptimizationNode>& tree, uint32_t rootIndex)
+	{
+		// Grow the treelet by opening its largest inner leaf, the opened nodes are reused for the new topology
+		uint32_t leaves[treeletSize];
+		uint32_t innerNodes[treeletSize - 2];
+		uint32_t leafCount = 2;
+		uint32_t innerCount = 0;
+		leaves[0] = tree[rootIndex].children[0];
+		leaves[1] = tree[rootIndex].children[1];
+		while (leafCount < treeletSize)
+		{
+			int32_t largest = -1;
+			float largestArea = -1.f;
+			for (uint32_t leaf = 0; leaf < leafCount; ++leaf)
+			{
+				const OptimizationNode& node = tree[leaves[leaf]];
+				if (!node.isLeaf && node.bounds.area() > largestArea)
+				{
+					largest = static_cast<int32_t>(leaf);
+					largestArea = node.bounds.area();
+				}
+			}
+			if (largest < 0)
+				break;
+
+			const uint32_t opened = leaves[largest];
+			innerNodes[innerCount++] = opened;
+			leaves[largest] = tree[opened].children[0];
+			leaves[leafCount++] = tree[opened].children[1];
+		}
+		if (leafCount < 3)
+			return;
+
+		// Optimal partition of every subset of the treelet leaves, smaller subsets have smaller masks
+		constexpr uint32_t subsetCount = 1 << treeletSize;
+		AABB subsetBounds[subsetCount];
+		float subsetCost[subsetCount];
+		uint8_t bestPartition[subsetCount];
+		const uint32_t fullSet = (1u << leafCount) - 1;
+		for (uint32_t subset = 1; subset <= fullSet; ++subset)
+		{
+			const uint32_t lowestBit = subset & (~subset + 1);
+			const uint32_t lowestLeaf = std::countr_zero(subset);
+			if (subset == lowestBit)
+			{
+				subsetBounds[subset] = tree[leaves[lowestLeaf]].bounds;
+				subsetCost[subset] = tree[leaves[lowestLeaf]].cost;
+				continue;
+			}
+
+			subsetBounds[subset] = subsetBounds[subset ^ lowestBit];
+			subsetBounds[subset] |= subsetBounds[lowestBit];
+
+			// Only partitions containing the lowest leaf, the mirrored ones cost the same
+			float bestCost = std::numeric_limits<float>::max();
+			for (uint32_t part = (subset - 1) & subset; part != 0; part = (part - 1) & subset)
+			{
+				if (!(part & lowestBit))
+					continue;
+
+				const float cost = subsetCost[part] + subsetCost[subset ^ part];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestPartition[subset] = static_cast<uint8_t>(part);
+				}
+			}
+			subsetCost[subset] = nodeCost * subsetBounds[subset].area() + bestCost;
+		}
+
+		if (subsetCost[fullSet] >= tree[rootIndex].cost)
+			return;
+
+		// Rebuild top-down, reusing the opened nodes
+		uint32_t nextInner = 0;
+		auto assign = [&](auto& self, uint32_t subset, uint32_t nodeIndex) -> void
+		{
+			const uint32_t parts[2] = {bestPartition[subset], subset ^ bestPartition[subset]};
+			for (uint32_t side = 0; side < 2; ++side)
+			{
+				if (std::has_single_bit(parts[side]))
+				{
+					tree[nodeIndex].children[side] = leaves[std::countr_zero(parts[side])];
+				}
+				else
+				{
+					const uint32_t childIndex = innerNodes[nextInner++];
+					self(self, parts[side], childIndex);
+					tree[nodeIndex].children[side] = childIndex;
+				}
+			}
+			updateOptimizationNode(tree, tree[nodeIndex]);
+		};
+		assign(assign, fullSet, rootIndex);
+	}
+
+	static void collapseSubtree(std::vector<OptimizationNode>& tree, uint32_t nodeIndex)
+	{
+		OptimizationNode& node = tree[nodeIndex];
+		if (node.isLeaf)
+			return;
+
+		collapseSubtree(tree, node.children[0]);
+		collapseSubtree(tree, node.children[1]);
+		updateOptimizationNode(tree, node);
+
+		const float leafCost = node.bounds.area() * static_cast<float>(node.primitiveCount);
+		if (node.primitiveCount <= maxCollapsedLeafSize && leafCost < node.cost)
+		{
+			node.collapsed = true;
+			node.cost = leafCost;
+		}
+	}
+
+	static void gatherReferences(const std::vector<OptimizationNode>& tree, uint32_t nodeIndex,
+	                             const std::vector<uint32_t>& references, std::vector<uint32_t>& gathered)
+	{
+		const OptimizationNode& node = tree[nodeIndex];
+		if (node.isLeaf)
+		{
+			gathered.insert(gathered.end(), references.begin() + node.primitives.start,
+			                references.begin() + node.primitives.end);
+			return;
+		}
+
+		gatherReferences(tree, node.children[0], references, gathered);
+		gatherReferences(tree, node.children[1], references, gathered);
+	}
+
+	// Back to the depth-first layout, every leaf gets its references as one contiguous range
+	static void linearize(const std::vector<OptimizationNode>& tree, uint32_t nodeIndex, uint32_t depth,
+	                      uint32_t maxDepth, const std::vector<uint32_t>& references, std::vector<BVHNode>& nodes,
+	                      std::vector<uint32_t>& optimizedReferences)
+	{
+		const OptimizationNode& node = tree[nodeIndex];
+
+		// Restructuring can deepen the tree, whatever would not fit the traversal stack becomes a leaf
+		if (node.isLeaf || node.collapsed || depth >= maxDepth)
+		{
+			const uint32_t primitivesOffset = static_cast<uint32_t>(optimizedReferences.size());
+			gatherReferences(tree, nodeIndex, references, optimizedReferences);
+			assert(optimizedReferences.size() - primitivesOffset <= std::numeric_limits<uint16_t>::max());
+			nodes.push_back({
+				.boundingBox = node.bounds,
+				.primitivesOffset = primitivesOffset,
+				.primitiveCount = static_cast<uint16_t>(optimizedReferences.size() - primitivesOffset)
+			});
+			return;
+		}
+
+		// Children are ordered along the axis that separates them most
+		const Vector3 separation = tree[node.children[1]].bounds.center() - tree[node.children[0]].bounds.center();
+		const Vector3 absSeparation(std::abs(separation.x), std::abs(separation.y), std::abs(separation.z));
+		const uint8_t splitAxis = static_cast<uint8_t>(std::distance(std::begin(absSeparation.data),
+		                                                             std::ranges::max_element(absSeparation.data)));
+		const bool swapChildren = separation[splitAxis] < 0.f;
+
+		const uint32_t interiorNodeIndex = static_cast<uint32_t>(nodes.size());
+		nodes.push_back({.boundingBox = node.bounds, .primitiveCount = 0, .splitAxis = splitAxis});
+		linearize(tree, node.children[swapChildren ? 1 : 0], depth + 1, maxDepth, references, nodes,
+		          optimizedReferences);
+		nodes[interiorNodeIndex].secondChildOffset = static_cast<uint32_t>(nodes.size());
+		linearize(tree, node.children[swapChildren ? 0 : 1], depth + 1, maxDepth, references, nodes,
+		          optimizedReferences);
+	}
+
+	struct Reference
+	{
+		uint32_t primitiveIndex;
+		AABB bounds; // clipped by the spatial splits above
+	};
+
+	struct SpatialBuildContext
+	{
+		const BuildSettings& settings;
+		const ClipFunction& clipPrimitive;
+		float minOverlapArea;
+		size_t maxReferenceCount;
+		size_t referenceCount; // over all pending nodes, limited by the duplication budget
+		std::vector<uint32_t> leafReferences;
+	};
+
+	struct SpatialSplit
+	{
+		float cost = std::numeric_limits<float>::max();
+		uint8_t axis = 0;
+		float position = 0.f;
+	};
+
+	// Binned search for the best split plane, primitives are clipped into every bin they overlap
+	static SpatialSplit findSpatialSplit(const SpatialBuildContext& context, const std::vector<Reference>& references,
+	                                     const AABB& boundingBox)
+	{
+		constexpr uint32_t binCount = 32;
+
+		SpatialSplit best;
+		const float boundingBoxArea = boundingBox.area();
+		for (uint8_t axis = 0; axis < 3; axis++)
+		{
+			const float origin = boundingBox.minPoint[axis];
+			const float binWidth = boundingBox.extent()[axis] / static_cast<float>(binCount);
+			if (binWidth <= 0.f)
+				continue;
+
+			auto binOf = [origin, binWidth](float position)
+			{
+				return std::min(static_cast<uint32_t>(std::max((position - origin) / binWidth, 0.f)), binCount - 1);
+			};
+
+			AABB binBounds[binCount];
+			uint32_t entries[binCount] = {};
+			uint32_t exits[binCount] = {};
+			for (const auto& reference : references)
+			{
+				const uint32_t firstBin = binOf(reference.bounds.minPoint[axis]);
+				const uint32_t lastBin = binOf(reference.bounds.maxPoint[axis]);
+				if (firstBin == lastBin)
+				{
+					binBounds[firstBin] |= reference.bounds;
+				}
+				else
+				{
+					for (uint32_t bin = firstBin; bin <= lastBin; ++bin)
+					{
+						AABB slab = reference.bounds;
+						if (bin != firstBin)
+							slab.minPoint[axis] = origin + static_cast<float>(bin) * binWidth;
+						if (bin != lastBin)
+							slab.maxPoint[axis] = origin + static_cast<float>(bin + 1) * binWidth;
+						binBounds[bin] |= context.clipPrimitive(reference.primitiveIndex, slab);
+					}
+				}
+				++entries[firstBin];
+				++exits[lastBin];
+			}
+
+			float rightAreas[binCount];
+			uint32_t rightCounts[binCount];
+			AABB right;
+			uint32_t rightCount = 0;
+			for (uint32_t bin = binCount - 1; bin > 0; bin--)
+			{
+				right |= binBounds[bin];
+				rightCount += exits[bin];
+				rightAreas[bin] = right.area();
+				rightCounts[bin] = rightCount;
+			}
+
+			AABB left;
+			uint32_t leftCount = 0;
+			for (uint32_t plane = 1; plane < binCount; plane++)
+			{
+				left |= binBounds[plane - 1];
+				leftCount += entries[plane - 1];
+				if (leftCount == 0 || rightCounts[plane] == 0)
+					continue;
+
+				float cost = (static_cast<float>(leftCount) * left.area() + static_cast<float>(rightCounts[plane]) *
+					rightAreas[plane]) / boundingBoxArea;
+				if (cost < best.cost)
+				{
+					best.cost = cost;
+					best.axis = axis;
+					best.position = origin + static_cast<float>(plane) * binWidth;
+				}
 			}
+		}
+
+		return best;
+	}
 
-			BVHNode interiorNode{
+	void buildSpatial(SpatialBuildContext& context, std::vector<Reference>& references, uint32_t depth)
+	{
+		AABB boundingBox;
+		for (const auto& reference : references)
+			boundingBox |= reference.bounds;
+
+		const uint32_t maxDepth = std::min(context.settings.maxDepth, maxStackDepth - 2);
+		if (depth >= maxDepth || references.size() <= context.settings.maxPrimitiveCountPerLeaf)
+		{
+			// Create leaf node
+			BVHNode leafNode{
 				.boundingBox = boundingBox,
-				.primitiveCount = 0,
-				.splitAxis = splitAxis
+				.primitivesOffset = static_cast<uint32_t>(context.leafReferences.size()),
+				.primitiveCount = static_cast<uint16_t>(references.size())
 			};
+			nodes.emplace_back(leafNode);
+			for (const auto& reference : references)
+				context.leafReferences.push_back(reference.primitiveIndex);
+			return;
+		}
 
-			uint32_t interiorNodeIndex = static_cast<uint32_t>(nodes.size());
-			nodes.emplace_back(interiorNode);
+		auto centroidLess = [](uint8_t axis)
+		{
+			return [axis](const Reference& a, const Reference& b)
+			{
+				return a.bounds.center()[axis] < b.bounds.center()[axis];
+			};
+		};
 
-			build(triangles, Range{range.start, mid}, depth + 1);
+		// Object split, the same sweep as the SAH of the regular build
+		const uint32_t count = static_cast<uint32_t>(references.size());
+		std::vector<float> rightAreas(count);
+		float objectCost = std::numeric_limits<float>::max();
+		uint8_t objectAxis = 0;
+		uint32_t objectMid = count / 2;
+		const float boundingBoxArea = boundingBox.area();
+		for (uint8_t axis = 0; axis < 3; axis++)
+		{
+			std::ranges::sort(references, centroidLess(axis));
 
-			nodes[interiorNodeIndex].secondChildOffset = static_cast<uint32_t>(nodes.size());
+			AABB right;
+			for (uint32_t index = count - 1; index > 0; index--)
+			{
+				right |= references[index].bounds;
+				rightAreas[index] = right.area();
+			}
 
-			build(triangles, Range{mid, range.end}, depth + 1);
+			AABB left;
+			for (uint32_t index = 1; index < count; index++)
+			{
+				left |= references[index - 1].bounds;
+				float cost = (index * left.area() + (count - index) * rightAreas[index]) / boundingBoxArea;
+				if (cost < objectCost)
+				{
+					objectCost = cost;
+					objectAxis = axis;
+					objectMid = index;
+				}
+			}
 		}
+
+		std::ranges::sort(references, centroidLess(objectAxis));
+		AABB objectLeft;
+		AABB objectRight;
+		for (uint32_t index = 0; index < count; index++)
+			(index < objectMid ? objectLeft : objectRight) |= references[index].bounds;
+
+		// Spatial splits only pay off where the object split leaves the children overlapping
+		SpatialSplit spatialSplit;
+		AABB overlap = objectLeft;
+		overlap.intersection(objectRight);
+		if (overlap.isValid() && overlap.area() > context.minOverlapArea &&
+			context.referenceCount < context.maxReferenceCount)
+			spatialSplit = findSpatialSplit(context, references, boundingBox);
+
+		std::vector<Reference> leftReferences;
+		std::vector<Reference> rightReferences;
+		uint8_t splitAxis = objectAxis;
+		if (spatialSplit.cost < objectCost)
+		{
+			splitAxis = spatialSplit.axis;
+			const float position = spatialSplit.position;
+			for (const auto& reference : references)
+			{
+				if (reference.bounds.maxPoint[splitAxis] <= position)
+				{
+					leftReferences.push_back(reference);
+				}
+				else if (reference.bounds.minPoint[splitAxis] >= position)
+				{
+					rightReferences.push_back(reference);
+				}
+				else if (context.referenceCount >= context.maxReferenceCount)
+				{
+					// Out of budget, the reference goes to one side as a whole
+					(reference.bounds.center()[splitAxis] < position ? leftReferences : rightReferences).push_back(
+						reference);
+				}
+				else
+				{
+					AABB leftSlab = reference.bounds;
+					leftSlab.maxPoint[splitAxis] = position;
+					AABB rightSlab = reference.bounds;
+					rightSlab.minPoint[splitAxis] = position;
+					const AABB leftBounds = context.clipPrimitive(reference.primitiveIndex, leftSlab);
+					const AABB rightBounds = context.clipPrimitive(reference.primitiveIndex, rightSlab);
+					if (!leftBounds.isValid())
+					{
+						rightReferences.push_back(reference);
+					}
+					else if (!rightBounds.isValid())
+					{
+						leftReferences.push_back(reference);
+					}
+					else
+					{
+						leftReferences.push_back({reference.primitiveIndex, leftBounds});
+						rightReferences.push_back({reference.primitiveIndex, rightBounds});
+						++context.referenceCount;
+					}
+				}
+			}
+		}
+
+		if (leftReferences.empty() || rightReferences.empty())
+		{
+			splitAxis = objectAxis;
+			leftReferences.assign(references.begin(), references.begin() + objectMid);
+			rightReferences.assign(references.begin() + objectMid, references.end());
+		}
+		references = {};
+
+		BVHNode interiorNode{
+			.boundingBox = boundingBox,
+			.primitiveCount = 0,
+			.splitAxis = splitAxis
+		};
+
+		uint32_t interiorNodeIndex = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back(interiorNode);
+
+		buildSpatial(context, leftReferences, depth + 1);
+
+		nodes[interiorNodeIndex].secondChildOffset = static_cast<uint32_t>(nodes.size());
+
+		buildSpatial(context, rightReferences, depth + 1);
 	}
 
 	std::vector<BVHNode> nodes;
-	static constexpr uint32_t maxDepth = 10;
-	static constexpr uint32_t maxTriangleCountPerLeaf = 4;
-	static constexpr SplitHeuristic splitHeuristic = SplitHeuristic::Middle;
+	std::vector<QuantizedBVHNode> quantizedNodes;
+	std::vector<std::unique_ptr<Stub>> stubs; // lazy builds only
+	SubtreeBuilder buildSubtree;
+	float referenceCost = 0.f; // sahCost right after the build
+	static constexpr uint32_t maxStackDepth = 32;
 };
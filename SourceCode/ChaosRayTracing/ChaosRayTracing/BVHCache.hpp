@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "BVH.hpp"
+#include "FileUtils.hpp"
+#include "Mesh.hpp"
+
+// On-disk cache of built mesh BVHs. Entries are keyed by a hash of the triangle positions (in parse order) and of the
+// build settings, so any change in geometry or configuration results in a different file and a fresh build.
+class BVHCache
+{
+public:
+	BVHCache(std::filesystem::path directory) : directory(std::move(directory))
+	{
+	}
+
+	// Same result as Mesh::buildBVH, returns whether the entry was found in the cache
+	bool loadOrBuild(Mesh& mesh, const BVH::BuildSettings& settings) const
+	{
+		const uint64_t key = computeKey(mesh, settings);
+		const std::filesystem::path filePath = directory / (toHex(key) + ".bvh");
+
+		std::vector<uint32_t> references;
+		const bool loaded = load(filePath, key, static_cast<uint32_t>(mesh.triangles.size()), mesh.bvh, references);
+		if (!loaded)
+		{
+			references = mesh.bvh.build(mesh.triangleBounds(), mesh.triangleCentroids(), settings,
+			                            mesh.triangleClipFunction());
+			save(filePath, key, static_cast<uint32_t>(mesh.triangles.size()), mesh.bvh, references);
+		}
+
+		mesh.applyBVHReferences(std::move(references));
+		return loaded;
+	}
+
+	static uint64_t computeKey(const Mesh& mesh, const BVH::BuildSettings& settings)
+	{
+		// FNV-1a
+		uint64_t hash = 14695981039346656037ull;
+		auto hashBytes = [&hash](const void* data, size_t size)
+		{
+			const auto* bytes = static_cast<const unsigned char*>(data);
+			for (size_t i = 0; i < size; ++i)
+			{
+				hash ^= bytes[i];
+				hash *= 1099511628211ull;
+			}
+		};
+
+		const uint32_t formatVersion = version;
+		const uint32_t nodeSize = sizeof(BVHNode);
+		const uint32_t splitHeuristic = static_cast<uint32_t>(settings.splitHeuristic);
+		hashBytes(&formatVersion, sizeof(formatVersion));
+		hashBytes(&nodeSize, sizeof(nodeSize));
+		hashBytes(&splitHeuristic, sizeof(splitHeuristic));
+		hashBytes(&settings.maxDepth, sizeof(settings.maxDepth));
+		hashBytes(&settings.maxPrimitiveCountPerLeaf, sizeof(settings.maxPrimitiveCountPerLeaf));
+		hashBytes(&settings.spatialSplits, sizeof(settings.spatialSplits));
+		hashBytes(&settings.optimize, sizeof(settings.optimize));
+		if (settings.spatialSplits)
+		{
+			hashBytes(&settings.spatialSplitOverlap, sizeof(settings.spatialSplitOverlap));
+			hashBytes(&settings.spatialSplitBudget, sizeof(settings.spatialSplitBudget));
+		}
+
+		const uint64_t triangleCount = mesh.triangles.size();
+		hashBytes(&triangleCount, sizeof(triangleCount));
+		for (const auto& triangle : mesh.triangles)
+		{
+			for (uint32_t vertex = 0; vertex < 3; ++vertex)
+				hashBytes(triangle.position(mesh, vertex).data, sizeof(Vector3::data));
+		}
+
+		return hash;
+	}
+
+private:
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t nodeSize;
+		uint64_t key;
+		uint32_t triangleCount;
+		uint32_t referenceCount;
+		uint32_t nodeCount;
+	};
+
+	static_assert(std::is_trivially_copyable_v<BVHNode>);
+
+	static std::string toHex(uint64_t value)
+	{
+		char buffer[17];
+		std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+		return {buffer};
+	}
+
+	static bool load(const std::filesystem::path& filePath, uint64_t key, uint32_t triangleCount, BVH& bvh,
+	                 std::vector<uint32_t>& references)
+	{
+		std::ifstream ifs(filePath, std::ios::in | std::ios::binary);
+		if (!ifs.is_open())
+			return false;
+
+		Header header{};
+		if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header)))
+			return false;
+
+		if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.version != version ||
+			header.nodeSize != sizeof(BVHNode) || header.key != key || header.triangleCount != triangleCount)
+			return false;
+
+		if (header.referenceCount < triangleCount)
+			return false;
+
+		std::vector<BVHNode> nodes(header.nodeCount);
+		references.resize(header.referenceCount);
+		if (!ifs.read(reinterpret_cast<char*>(nodes.data()), nodes.size() * sizeof(BVHNode)) ||
+			!ifs.read(reinterpret_cast<char*>(references.data()), references.size() * sizeof(uint32_t)))
+			return false;
+
+		// Reject truncated or corrupted entries instead of traversing garbage, every triangle has to be referenced and
+		// only spatial splits may reference one more than once
+		std::vector<bool> referenced(triangleCount, false);
+		uint32_t referencedCount = 0;
+		for (uint32_t triangleIndex : references)
+		{
+			if (triangleIndex >= triangleCount)
+				return false;
+			referencedCount += !referenced[triangleIndex];
+			referenced[triangleIndex] = true;
+		}
+		if (referencedCount != triangleCount || nodes.empty())
+			return false;
+
+		// Children have to come after their parent, the first one right after it, which also rules out cycles. The
+		// traversal stack has room for trees as deep as the builder makes them.
+		const uint32_t maxDepth = BVH::maxStackDepth - 2;
+		std::vector<uint32_t> depths(nodes.size(), 0);
+		for (size_t nodeIndex = 0; nodeIndex < nodes.size(); ++nodeIndex)
+		{
+			const BVHNode& node = nodes[nodeIndex];
+			if (depths[nodeIndex] > maxDepth)
+				return false;
+
+			if (node.isLeaf())
+			{
+				if (static_cast<uint64_t>(node.primitivesOffset) + node.primitiveCount > references.size())
+					return false;
+				continue;
+			}
+
+			const size_t firstChild = nodeIndex + 1;
+			if (firstChild >= nodes.size() || node.secondChildOffset <= firstChild ||
+				node.secondChildOffset >= nodes.size())
+				return false;
+			depths[firstChild] = std::max(depths[firstChild], depths[nodeIndex] + 1);
+			depths[node.secondChildOffset] = std::max(depths[node.secondChildOffset], depths[nodeIndex] + 1);
+		}
+
+		bvh.nodes = std::move(nodes);
+		bvh.referenceCost = bvh.sahCost();
+		return true;
+	}
+
+	static void save(const std::filesystem::path& filePath, uint64_t key, uint32_t triangleCount, const BVH& bvh,
+	                 const std::vector<uint32_t>& references)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(filePath.parent_path(), error);
+		if (error)
+			return;
+
+		Header header{};
+		std::memcpy(header.magic, magic, sizeof(header.magic));
+		header.version = version;
+		header.nodeSize = sizeof(BVHNode);
+		header.key = key;
+		header.triangleCount = triangleCount;
+		header.referenceCount = static_cast<uint32_t>(references.size());
+		header.nodeCount = static_cast<uint32_t>(bvh.nodes.size());
+
+		WriteFileAtomically(filePath, [&](std::ofstream& ofs)
+		{
+			ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			ofs.write(reinterpret_cast<const char*>(bvh.nodes.data()), bvh.nodes.size() * sizeof(BVHNode));
+			ofs.write(reinterpret_cast<const char*>(references.data()), references.size() * sizeof(uint32_t));
+			return static_cast<bool>(ofs);
+		});
+	}
+
+	static constexpr char magic[8] = {'C', 'R', 'T', 'B', 'V', 'H', '\0', '\0'};
+	static constexpr uint32_t version = 4;
+
+	std::filesystem::path directory;
+};
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// BC1 (DXT1) blocks: 4x4 RGB texels in 8 bytes, two RGB565 endpoints followed by a 2-bit palette index per texel,
+// texels in row order starting at the lowest bits. The layout matches the GPU format, so blocks could also come
+// from an offline compressor.
+namespace BlockCompression
+{
+	constexpr int blockSize = 4;
+	constexpr int blockBytes = 8;
+
+	inline uint16_t toRGB565(const float (&color)[3])
+	{
+		const auto quantize = [](float value, float maximum)
+		{
+			return static_cast<uint16_t>(std::lround(std::clamp(value, 0.f, 255.f) * maximum / 255.f));
+		};
+		return static_cast<uint16_t>(quantize(color[0], 31.f) << 11 | quantize(color[1], 63.f) << 5 |
+		                             quantize(color[2], 31.f));
+	}
+
+	// Bit replication maps 0 and the maximum exactly to 0 and 255
+	inline void fromRGB565(uint16_t packed, uint8_t (&rgb)[3])
+	{
+		const uint32_t red = packed >> 11;
+		const uint32_t green = (packed >> 5) & 63;
+		const uint32_t blue = packed & 31;
+		rgb[0] = static_cast<uint8_t>(red << 3 | red >> 2);
+		rgb[1] = static_cast<uint8_t>(green << 2 | green >> 4);
+		rgb[2] = static_cast<uint8_t>(blue << 3 | blue >> 2);
+	}
+
+	// The four colors the indices of the block select from
+	inline void decodePalette(const uint8_t* block, uint8_t (&palette)[4][3])
+	{
+		const uint16_t color0 = static_cast<uint16_t>(block[0] | block[1] << 8);
+		const uint16_t color1 = static_cast<uint16_t>(block[2] | block[3] << 8);
+		fromRGB565(color0, palette[0]);
+		fromRGB565(color1, palette[1]);
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			const int value0 = palette[0][channel];
+			const int value1 = palette[1][channel];
+			if (color0 > color1)
+			{
+				palette[2][channel] = static_cast<uint8_t>((2 * value0 + value1) / 3);
+				palette[3][channel] = static_cast<uint8_t>((value0 + 2 * value1) / 3);
+			}
+			else
+			{
+				palette[2][channel] = static_cast<uint8_t>((value0 + value1) / 2);
+				palette[3][channel] = 0;
+			}
+		}
+	}
+
+	inline uint32_t paletteIndex(const uint8_t* block, int texelInBlock)
+	{
+		uint32_t indices;
+		std::memcpy(&indices, block + 4, sizeof(indices));
+		return (indices >> (2 * texelInBlock)) & 3;
+	}
+
+	// Picks the nearest palette color for every texel, returns the squared error
+	inline uint32_t encodeIndices(const uint8_t (&texels)[16][3], uint8_t* block)
+	{
+		uint8_t palette[4][3];
+		decodePalette(block, palette);
+
+		uint32_t indices = 0;
+		uint32_t error = 0;
+		for (int texel = 0; texel < 16; ++texel)
+		{
+			uint32_t bestIndex = 0;
+			uint32_t bestDistance = std::numeric_limits<uint32_t>::max();
+			for (uint32_t index = 0; index < 4; ++index)
+			{
+				uint32_t distance = 0;
+				for (int channel = 0; channel < 3; ++channel)
+				{
+					const int difference = texels[texel][channel] - palette[index][channel];
+					distance += difference * difference;
+				}
+				if (distance < bestDistance)
+				{
+					bestDistance = distance;
+					bestIndex = index;
+				}
+			}
+			indices |= bestIndex << (2 * texel);
+			error += bestDistance;
+		}
+		std::memcpy(block + 4, &indices, sizeof(indices));
+		return error;
+	}
+
+	// Four color mode needs color0 > color1, equal endpoints fall back to three colors and index 0 is still exact
+	inline uint32_t encodeEndpoints(float (&endpoint0)[3], float (&endpoint1)[3], const uint8_t (&texels)[16][3],
+	                                uint8_t* block)
+	{
+		uint16_t color0 = toRGB565(endpoint0);
+		uint16_t color1 = toRGB565(endpoint1);
+		if (color0 < color1)
+			std::swap(color0, color1);
+		block[0] = static_cast<uint8_t>(color0);
+		block[1] = static_cast<uint8_t>(color0 >> 8);
+		block[2] = static_cast<uint8_t>(color1);
+		block[3] = static_cast<uint8_t>(color1 >> 8);
+		return encodeIndices(texels, block);
+	}
+
+	// Endpoints at the extremes of the texels along their principal axis, then one least squares refit of the
+	// endpoints to the chosen indices, kept when it lowers the error
+	inline void encodeBlock(const uint8_t (&texels)[16][3], uint8_t* block)
+	{
+		float mean[3] = {0.f, 0.f, 0.f};
+		for (const auto& texel : texels)
+		{
+			for (int channel = 0; channel < 3; ++channel)
+				mean[channel] += static_cast<float>(texel[channel]) / 16.f;
+		}
+
+		float covariance[3][3] = {};
+		for (const auto& texel : texels)
+		{
+			for (int row = 0; row < 3; ++row)
+			{
+				for (int column = 0; column < 3; ++column)
+				{
+					covariance[row][column] += (static_cast<float>(texel[row]) - mean[row]) *
+						(static_cast<float>(texel[column]) - mean[column]);
+				}
+			}
+		}
+
+		// Power iteration starting at the covariance row of the widest channel, a few steps are enough to separate the
+		// endpoints
+		int widestChannel = 0;
+		for (int channel = 1; channel < 3; ++channel)
+		{
+			if (covariance[channel][channel] > covariance[widestChannel][widestChannel])
+				widestChannel = channel;
+		}
+		float axis[3] = {covariance[widestChannel][0], covariance[widestChannel][1], covariance[widestChannel][2]};
+		for (int iteration = 0; iteration < 8; ++iteration)
+		{
+			float next[3];
+			for (int row = 0; row < 3; ++row)
+				next[row] = covariance[row][0] * axis[0] + covariance[row][1] * axis[1] + covariance[row][2] * axis[2];
+			const float length = std::sqrt(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+			if (length < 1e-6f)
+				break;
+			for (int channel = 0; channel < 3; ++channel)
+				axis[channel] = next[channel] / length;
+		}
+		const float axisLength = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		for (float& component : axis)
+			component = axisLength > 1e-6f ? component / axisLength : 0.f;
+
+		float minProjection = 0.f;
+		float maxProjection = 0.f;
+		for (const auto& texel : texels)
+		{
+			float projection = 0.f;
+			for (int channel = 0; channel < 3; ++channel)
+				projection += (static_cast<float>(texel[channel]) - mean[channel]) * axis[channel];
+			minProjection = std::min(minProjection, projection);
+			maxProjection = std::max(maxProjection, projection);
+		}
+
+		float endpoint0[3];
+		float endpoint1[3];
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			endpoint0[channel] = mean[channel] + axis[channel] * maxProjection;
+			endpoint1[channel] = mean[channel] + axis[channel] * minProjection;
+		}
+		const uint32_t error = encodeEndpoints(endpoint0, endpoint1, texels, block);
+		const uint16_t color0 = static_cast<uint16_t>(block[0] | block[1] << 8);
+		const uint16_t color1 = static_cast<uint16_t>(block[2] | block[3] << 8);
+		if (error == 0 || color0 == color1)
+			return;
+
+		// Each texel is w * endpoint0 + (1 - w) * endpoint1 with the weight of its index, solve the 2x2 normal
+		// equations for both endpoints
+		constexpr float weights[4] = {1.f, 0.f, 2.f / 3.f, 1.f / 3.f};
+		float aa = 0.f;
+		float ab = 0.f;
+		float bb = 0.f;
+		float ax[3] = {0.f, 0.f, 0.f};
+		float bx[3] = {0.f, 0.f, 0.f};
+		for (int texel = 0; texel < 16; ++texel)
+		{
+			const float a = weights[paletteIndex(block, texel)];
+			const float b = 1.f - a;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			for (int channel = 0; channel < 3; ++channel)
+			{
+				ax[channel] += a * static_cast<float>(texels[texel][channel]);
+				bx[channel] += b * static_cast<float>(texels[texel][channel]);
+			}
+		}
+		const float determinant = aa * bb - ab * ab;
+		if (std::abs(determinant) < 1e-6f)
+			return;
+
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			endpoint0[channel] = (bb * ax[channel] - ab * bx[channel]) / determinant;
+			endpoint1[channel] = (aa * bx[channel] - ab * ax[channel]) / determinant;
+		}
+		uint8_t refitted[blockBytes];
+		if (encodeEndpoints(endpoint0, endpoint1, texels, refitted) < error)
+			std::memcpy(block, refitted, blockBytes);
+	}
+}
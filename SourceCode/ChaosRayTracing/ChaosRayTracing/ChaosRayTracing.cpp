@@ -1,9 +1,37 @@
 #include <iostream>
+#include <string>
 
+#include "Kernels.hpp"
 #include "Renderer.hpp"
+#include "SamplingBenchmark.hpp"
+#include "TextureBenchmark.hpp"
+#include "TraversalBenchmark.hpp"
 
-int main()
+int main(int argc, char** argv)
 {
+	// ChaosRayTracing --texture-benchmark <image> measures lookups per texture layout instead of rendering
+	if (argc == 3 && std::string(argv[1]) == "--texture-benchmark")
+	{
+		runTextureBenchmark(argv[2]);
+		return 0;
+	}
+
+	// ChaosRayTracing --traversal-benchmark <triangle count> compares single and interleaved closest-hit traversal
+	if (argc == 3 && std::string(argv[1]) == "--traversal-benchmark")
+		return runTraversalBenchmark(static_cast<uint32_t>(std::stoul(argv[2]))) ? 0 : 1;
+
+	// ChaosRayTracing --sampling-benchmark compares the cosine hemisphere samplers
+	if (argc == 2 && std::string(argv[1]) == "--sampling-benchmark")
+		return runSamplingBenchmark() ? 0 : 1;
+
+	// ChaosRayTracing --kernels <scalar|sse4.2|avx2|avx512> renders with the given kernels instead of the best ones
+	if (argc == 3 && std::string(argv[1]) == "--kernels" && !Kernels::select(argv[2]))
+	{
+		std::cout << "Kernels " << argv[2] << " are unknown or not supported by this CPU." << std::endl;
+		return 1;
+	}
+	std::cout << "Using " << Kernels::active().name << " kernels." << std::endl;
+
 	std::vector<std::unique_ptr<Scene>> scenes;
 
 	// Add scenes to the vector using make_unique
@@ -1,35 +1,282 @@
 #pragma once
 
 #include "Light.hpp"
+#include "LightBVH.hpp"
 
 #include <vector>
 #include <algorithm>
 #include <functional>
 #include <optional>
 
+// Emissive triangles in world space (instances of the same mesh are placed differently), picked by their estimated
+// contribution to the shading point through a light BVH, or in proportion to their power through an alias table. The
+// per-triangle data is kept in separate arrays and precomputed once in finalize, sampling only touches the arrays it
+// needs.
 class EmissiveSampler
 {
 public:
-	std::optional<EmissiveLightSample> sample(const Vector3 posW, const Vector3& rnd) const
+	void clear()
 	{
-		if (emissiveTriangles.empty())
+		vertices.clear();
+		edges1.clear();
+		edges2.clear();
+		normals.clear();
+		areas.clear();
+		emissions.clear();
+		selectionPdfs.clear();
+		aliasProbabilities.clear();
+		aliases.clear();
+		lightBVH = {};
+	}
+
+	void addTriangle(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Vector3& emission)
+	{
+		const Vector3 edge1 = p1 - p0;
+		const Vector3 edge2 = p2 - p0;
+		const Vector3 crossEdges = Cross(edge1, edge2);
+		const float doubleArea = crossEdges.magnitude();
+
+		vertices.push_back(p0);
+		edges1.push_back(edge1);
+		edges2.push_back(edge2);
+		normals.push_back(doubleArea > 0.f ? crossEdges / doubleArea : Vector3{0.f});
+		areas.push_back(doubleArea * 0.5f);
+		emissions.push_back(emission);
+	}
+
+	// Builds the alias table once all triangles are added, weighted by area times luminance of the emission, and the
+	// light BVH if it is used. sphericalTriangles samples points uniformly in the solid angle of the chosen triangle
+	// instead of uniformly in its area.
+	void finalize(bool buildLightBVH, bool sphericalTriangles)
+	{
+		sampleSolidAngle = sphericalTriangles;
+		const size_t count = size();
+		selectionPdfs.resize(count);
+		aliasProbabilities.assign(count, 1.f);
+		aliases.resize(count);
+		if (count == 0)
+			return;
+
+		double totalWeight = 0.0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			selectionPdfs[i] = areas[i] * std::max(0.f, Luminance(emissions[i]));
+			totalWeight += selectionPdfs[i];
+		}
+
+		// Black or degenerate emitters only, fall back to uniform selection
+		if (totalWeight <= 0.0)
+		{
+			std::ranges::fill(selectionPdfs, 1.f);
+			totalWeight = static_cast<double>(count);
+		}
+
+		// Vose's method, every column holds its own triangle up to aliasProbabilities and its alias above
+		std::vector<float> scaledWeights(count);
+		std::vector<uint32_t> small;
+		std::vector<uint32_t> large;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			selectionPdfs[i] = static_cast<float>(selectionPdfs[i] / totalWeight);
+			scaledWeights[i] = selectionPdfs[i] * static_cast<float>(count);
+			aliases[i] = i;
+			(scaledWeights[i] < 1.f ? small : large).push_back(i);
+		}
+
+		while (!small.empty() && !large.empty())
+		{
+			const uint32_t lesser = small.back();
+			small.pop_back();
+			const uint32_t greater = large.back();
+
+			aliasProbabilities[lesser] = scaledWeights[lesser];
+			aliases[lesser] = greater;
+			scaledWeights[greater] -= 1.f - scaledWeights[lesser];
+			if (scaledWeights[greater] < 1.f)
+			{
+				large.pop_back();
+				small.push_back(greater);
+			}
+		}
+		// Whatever is left is 1 up to rounding and keeps aliasProbabilities = 1
+
+		if (buildLightBVH)
+		{
+			std::vector<LightBounds> lightBounds(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				const Vector3 p1 = vertices[i] + edges1[i];
+				const Vector3 p2 = vertices[i] + edges2[i];
+				lightBounds[i].bounds = AABB(min(vertices[i], min(p1, p2)), max(vertices[i], max(p1, p2)));
+				lightBounds[i].power = areas[i] * std::max(0.f, Luminance(emissions[i]));
+				lightBounds[i].axis = normals[i];
+			}
+			lightBVH.build(lightBounds);
+		}
+	}
+
+	// normalW is the surface normal at posW, it steers the light BVH away from lights below the surface
+	std::optional<EmissiveLightSample> sample(const Vector3 posW, const Vector3& normalW, const Vector3& rnd) const
+	{
+		const size_t count = size();
+		if (count == 0)
 			return std::nullopt;
 
-		size_t emissiveIndex = static_cast<size_t>(rnd.x * emissiveTriangles.size());
-		emissiveIndex = std::min(emissiveIndex, emissiveTriangles.size() - 1);
+		size_t emissiveIndex;
+		float selectionPdf;
+		if (!lightBVH.empty())
+		{
+			std::optional<LightBVH::Sample> lightSample = lightBVH.sample(posW, normalW, rnd.x);
+			if (!lightSample.has_value())
+				return std::nullopt;
+			emissiveIndex = lightSample->lightIndex;
+			selectionPdf = lightSample->pmf;
+		}
+		else
+		{
+			// O(1) selection, the fraction of rnd.x left after picking the column chooses between it and its alias
+			const float scaled = rnd.x * static_cast<float>(count);
+			emissiveIndex = std::min(static_cast<size_t>(scaled), count - 1);
+			if (scaled - static_cast<float>(emissiveIndex) >= aliasProbabilities[emissiveIndex])
+				emissiveIndex = aliases[emissiveIndex];
+			selectionPdf = selectionPdfs[emissiveIndex];
+		}
 
-		EmissiveLightSample sample = emissiveTriangles[emissiveIndex].sample(posW, rnd.yz());
+		EmissiveLightSample sample;
+		sample.Le = emissions[emissiveIndex];
 
-		sample.pdf *= 1.f / static_cast<float>(emissiveTriangles.size());
+		const float solidAngle = sampleSolidAngle ? subtendedSolidAngle(emissiveIndex, posW) : 0.f;
+		if (usesSphericalSampling(solidAngle))
+		{
+			sample.position = sampleSphericalTriangle(emissiveIndex, posW, rnd.yz());
+			sample.pdf = selectionPdf / solidAngle;
+			return sample;
+		}
 
+		float u = rnd.y;
+		float v = rnd.z;
+		if (u + v > 1.0f)
+		{
+			u = 1.0f - u;
+			v = 1.0f - v;
+		}
+
+		sample.position = vertices[emissiveIndex] + edges1[emissiveIndex] * u + edges2[emissiveIndex] * v;
+		sample.pdf = selectionPdf * areaSamplingPdf(emissiveIndex, posW, sample.position);
 		return sample;
 	}
 
-	float evalPdf(size_t emissiveTriangleIndex, const Vector3& posW, const Vector3& sampledPosition) const
+	// Pdf of sample returning the point, posW and normalW have to match the ones passed to sample
+	float evalPdf(size_t emissiveTriangleIndex, const Vector3& posW, const Vector3& normalW,
+	              const Vector3& sampledPosition) const
+	{
+		const float selectionPdf = lightBVH.empty()
+			                           ? selectionPdfs[emissiveTriangleIndex]
+			                           : lightBVH.pmf(static_cast<uint32_t>(emissiveTriangleIndex), posW, normalW);
+		const float solidAngle = sampleSolidAngle ? subtendedSolidAngle(emissiveTriangleIndex, posW) : 0.f;
+		if (usesSphericalSampling(solidAngle))
+			return selectionPdf / solidAngle;
+		return selectionPdf * areaSamplingPdf(emissiveTriangleIndex, posW, sampledPosition);
+	}
+
+	size_t size() const
+	{
+		return areas.size();
+	}
+
+private:
+	// Below the lower bound the spherical triangle is too thin for the sampling to be accurate in single precision and
+	// the area pdf is nearly constant anyway, close to a hemisphere the arc computations lose precision
+	static constexpr float minSphericalSolidAngle = 3e-4f;
+	static constexpr float maxSphericalSolidAngle = 6.22f;
+
+	bool usesSphericalSampling(float solidAngle) const
 	{
-		return emissiveTriangles[emissiveTriangleIndex].pdf(posW, sampledPosition) / static_cast<float>(
-			emissiveTriangles.size());
+		return solidAngle > minSphericalSolidAngle && solidAngle < maxSphericalSolidAngle;
 	}
 
-	std::vector<EmissiveTriangle> emissiveTriangles;
+	// Solid angle of the triangle seen from posW (Van Oosterom and Strackee), 0 when posW is behind it
+	float subtendedSolidAngle(size_t emissiveIndex, const Vector3& posW) const
+	{
+		const Vector3 toVertex = vertices[emissiveIndex] - posW;
+		if (Dot(normals[emissiveIndex], toVertex) >= 0.f)
+			return 0.f;
+
+		const Vector3 a = Normalize(toVertex);
+		const Vector3 b = Normalize(toVertex + edges1[emissiveIndex]);
+		const Vector3 c = Normalize(toVertex + edges2[emissiveIndex]);
+		return 2.f * std::atan2(std::abs(Dot(a, Cross(b, c))), 1.f + Dot(a, b) + Dot(b, c) + Dot(c, a));
+	}
+
+	// Arvo's stratified sampling of spherical triangles: rnd.x picks the sub-triangle with the right area, rnd.y
+	// the direction along its last edge. Returns the point where that direction meets the triangle.
+	Vector3 sampleSphericalTriangle(size_t emissiveIndex, const Vector3& posW, const Vector2& rnd) const
+	{
+		const Vector3 toVertex = vertices[emissiveIndex] - posW;
+		const Vector3 a = Normalize(toVertex);
+		const Vector3 b = Normalize(toVertex + edges1[emissiveIndex]);
+		const Vector3 c = Normalize(toVertex + edges2[emissiveIndex]);
+
+		// Interior angles from the normals of the great circles through the edges
+		const Vector3 nAB = Normalize(Cross(a, b));
+		const Vector3 nBC = Normalize(Cross(b, c));
+		const Vector3 nCA = Normalize(Cross(c, a));
+		const float alpha = angleBetween(nAB, -nCA);
+		const float beta = angleBetween(nBC, -nAB);
+		const float gamma = angleBetween(nCA, -nBC);
+
+		// Area of the sub-triangle (a, b, c') to reach, plus pi
+		const float areaPlusPi = std::lerp(PI, alpha + beta + gamma, rnd.x);
+		const float cosAlpha = std::cos(alpha);
+		const float sinAlpha = std::sin(alpha);
+		const float sinPhi = std::sin(areaPlusPi) * cosAlpha - std::cos(areaPlusPi) * sinAlpha;
+		const float cosPhi = std::cos(areaPlusPi) * cosAlpha + std::sin(areaPlusPi) * sinAlpha;
+		const float k1 = cosPhi + cosAlpha;
+		const float k2 = sinPhi - sinAlpha * Dot(a, b);
+		float cosBPrime = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) / ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+		cosBPrime = std::clamp(cosBPrime, -1.f, 1.f);
+		const float sinBPrime = std::sqrt(std::max(0.f, 1.f - cosBPrime * cosBPrime));
+		const Vector3 cPrime = a * cosBPrime + Normalize(c - a * Dot(c, a)) * sinBPrime;
+
+		// Uniform in the solid angle along the arc from b to c'
+		const float cosTheta = 1.f - rnd.y * (1.f - Dot(cPrime, b));
+		const float sinTheta = std::sqrt(std::max(0.f, 1.f - cosTheta * cosTheta));
+		const Vector3 direction = b * cosTheta + Normalize(cPrime - b * Dot(cPrime, b)) * sinTheta;
+
+		const float t = Dot(toVertex, normals[emissiveIndex]) / Dot(direction, normals[emissiveIndex]);
+		return posW + direction * t;
+	}
+
+	static float angleBetween(const Vector3& v1, const Vector3& v2)
+	{
+		// Numerically stable for nearly parallel and nearly opposite vectors
+		if (Dot(v1, v2) < 0.f)
+			return PI - 2.f * std::asin(std::min(1.f, (v1 + v2).magnitude() * 0.5f));
+		return 2.f * std::asin(std::min(1.f, (v2 - v1).magnitude() * 0.5f));
+	}
+
+	// Pdf of sampling sampledPosition uniformly on the triangle, converted to solid angle as seen from posW. The
+	// triangles emit on the side of their normal only.
+	float areaSamplingPdf(size_t emissiveIndex, const Vector3& posW, const Vector3& sampledPosition) const
+	{
+		const Vector3 toLight = sampledPosition - posW;
+		const float distSqr = std::max(FLT_MIN, Dot(toLight, toLight));
+		const float cosTheta = -Dot(normals[emissiveIndex], toLight) / std::sqrt(distSqr);
+		if (cosTheta <= 0.f || areas[emissiveIndex] <= 0.f)
+			return 0.f;
+		return distSqr / (cosTheta * areas[emissiveIndex]);
+	}
+
+	std::vector<Vector3> vertices; // first vertex
+	std::vector<Vector3> edges1;
+	std::vector<Vector3> edges2;
+	std::vector<Vector3> normals;
+	std::vector<float> areas;
+	std::vector<Vector3> emissions;
+
+	std::vector<float> selectionPdfs;
+	std::vector<float> aliasProbabilities;
+	std::vector<uint32_t> aliases;
+	LightBVH lightBVH; // empty -> the alias table is used
+	bool sampleSolidAngle = false;
 };
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+
+// Writes filePath through write(stream) into a temporary file next to it and renames that over filePath, so readers
+// never see a partial file. The temporary name is unique per call, concurrent writers of the same file in one or
+// several processes each write their own and the last rename wins. Returns false and removes the temporary file when
+// a write fails.
+template <typename WriteFunction>
+bool WriteFileAtomically(const std::filesystem::path& filePath, WriteFunction write)
+{
+	static thread_local std::mt19937_64 generator(std::random_device{}() ^
+	                                              std::hash<std::thread::id>{}(std::this_thread::get_id()));
+	char suffix[22];
+	std::snprintf(suffix, sizeof(suffix), ".%016llx.tmp", static_cast<unsigned long long>(generator()));
+	std::filesystem::path tempPath = filePath;
+	tempPath += suffix;
+
+	bool written;
+	{
+		std::ofstream ofs(tempPath, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!ofs.is_open())
+			return false;
+
+		written = write(ofs) && ofs.flush();
+	}
+
+	std::error_code error;
+	if (written)
+		std::filesystem::rename(tempPath, filePath, error);
+	if (!written || error)
+	{
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "AABB.hpp"
+#include "Math3D.hpp"
+
+// Placement of a mesh in the scene. Rays are moved into object space to traverse the mesh's bottom-level BVH.
+struct Instance
+{
+	uint32_t meshIndex;
+	uint32_t materialIndex;
+	Matrix4 transform = Matrix4::identity(); // object -> world
+	Matrix4 inverseTransform = Matrix4::identity();
+	Matrix4 normalTransform = Matrix4::identity(); // inverse transpose of the linear part
+	bool isIdentity = true;
+	int32_t emissiveOffset = -1; // index of the first emissive triangle of this instance in the EmissiveSampler
+
+	void setTransform(const Matrix4& objectToWorld)
+	{
+		transform = objectToWorld;
+		inverseTransform = inverseAffine(objectToWorld);
+		normalTransform = Matrix4::identity();
+		for (int i = 0; i < 3; ++i)
+		{
+			for (int j = 0; j < 3; ++j)
+				normalTransform(i, j) = inverseTransform(j, i);
+		}
+
+		isIdentity = true;
+		for (int i = 0; i < 4; ++i)
+		{
+			for (int j = 0; j < 4; ++j)
+				isIdentity &= transform(i, j) == (i == j ? 1.f : 0.f);
+		}
+	}
+
+	// The direction is not renormalized, so the ray parameter t is the same in both spaces
+	Ray rayToObject(const Ray& ray) const
+	{
+		if (isIdentity)
+			return ray;
+		return {transformPoint(inverseTransform, ray.origin), inverseTransform * ray.directionN, ray.maxT};
+	}
+
+	Vector3 pointToWorld(const Vector3& point) const
+	{
+		return isIdentity ? point : transformPoint(transform, point);
+	}
+
+	Vector3 vectorToObject(const Vector3& vector) const
+	{
+		return isIdentity ? vector : inverseTransform * vector;
+	}
+
+	Vector3 normalToWorld(const Vector3& normal) const
+	{
+		if (isIdentity)
+			return normal;
+
+		return Normalize(normalTransform * Vector3A(normal)).toVector3();
+	}
+
+	AABB boundsToWorld(const AABB& bounds) const
+	{
+		if (isIdentity || !bounds.isValid())
+			return bounds;
+
+		AABB result;
+		for (uint32_t corner = 0; corner < 8; ++corner)
+		{
+			Vector3 point(corner & 1 ? bounds.maxPoint.x : bounds.minPoint.x,
+			              corner & 2 ? bounds.maxPoint.y : bounds.minPoint.y,
+			              corner & 4 ? bounds.maxPoint.z : bounds.minPoint.z);
+			point = transformPoint(transform, point);
+			result |= AABB(point, point);
+		}
+		return result;
+	}
+
+private:
+	static Vector3 transformPoint(const Matrix4& m, const Vector3& point)
+	{
+		return (m * Vector4(point, 1.f)).xyz();
+	}
+};
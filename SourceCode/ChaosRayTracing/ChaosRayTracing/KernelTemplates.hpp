@@ -0,0 +1,261 @@
+#pragma once
+
+// Kernels shared by the SIMD variants. Each Kernels*.cpp defines KERNEL_TARGET, the function attribute that enables
+// its instruction set, includes this file and instantiates the templates with a Simd struct for its vector type.
+// Everything here has internal linkage, so no copy built for one instruction set can be linked into code that runs
+// on another.
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <limits>
+
+#include "BVH.hpp"
+#include "Kernels.hpp"
+#include "Mesh.hpp"
+
+#ifndef KERNEL_TARGET
+#error "KERNEL_TARGET has to be defined before KernelTemplates.hpp is included"
+#endif
+
+namespace
+{
+	// Bounds of the four children on one axis, dequantized like QuantizedBVHNode::dequantize
+	KERNEL_TARGET __m128 childPlanes(const QuantizedBVHNode& node, uint8_t axis, const uint8_t (&values)[4])
+	{
+		int32_t packed;
+		std::memcpy(&packed, values, sizeof(packed));
+		const __m128 quantized = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+		return _mm_add_ps(_mm_set1_ps(node.origin.data[axis]), _mm_mul_ps(quantized, _mm_set1_ps(node.spacing(axis))));
+	}
+
+	// AABB::intersect on the four children at once. The node has four children in every variant, wider registers
+	// holding the lower and upper planes together measured no faster. The min and max operands are in the order of
+	// AABB::intersect, so NaN distances are skipped the same way.
+	KERNEL_TARGET uint32_t intersectChildren(const QuantizedBVHNode& node, const Ray& ray, float (&entryT)[4])
+	{
+		const __m128 growth = _mm_set1_ps(1.f + std::numeric_limits<float>::epsilon());
+		__m128 minT = _mm_setzero_ps();
+		__m128 maxT = _mm_set1_ps(ray.maxT);
+		for (uint8_t axis = 0; axis < 3; ++axis)
+		{
+			const __m128 origin = _mm_set1_ps(ray.origin.data[axis]);
+			const __m128 inverseDirection = _mm_set1_ps(ray.directionNInv.data[axis]);
+			const __m128 t1 = _mm_mul_ps(_mm_sub_ps(childPlanes(node, axis, node.childMin[axis]), origin),
+			                             inverseDirection);
+			const __m128 t2 = _mm_mul_ps(_mm_sub_ps(childPlanes(node, axis, node.childMax[axis]), origin),
+			                             inverseDirection);
+			minT = _mm_max_ps(_mm_min_ps(t2, t1), minT);
+			maxT = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t1, t2), growth), maxT);
+		}
+
+		_mm_storeu_ps(entryT, minT);
+		return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmplt_ps(minT, maxT))) & ((1u << node.childCount) - 1);
+	}
+
+	// Four lanes, with the encoding of whichever instruction set KERNEL_TARGET enables
+	struct Simd128
+	{
+		using Float = __m128;
+		static constexpr uint32_t width = 4;
+
+		KERNEL_TARGET static Float load(const float* values) { return _mm_load_ps(values); }
+		KERNEL_TARGET static void store(float* values, Float v) { _mm_store_ps(values, v); }
+		KERNEL_TARGET static Float broadcast(float value) { return _mm_set1_ps(value); }
+		KERNEL_TARGET static Float add(Float a, Float b) { return _mm_add_ps(a, b); }
+		KERNEL_TARGET static Float sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+		KERNEL_TARGET static Float mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+		KERNEL_TARGET static Float div(Float a, Float b) { return _mm_div_ps(a, b); }
+
+		// Lane masks of the negated comparisons, true for NaNs
+		KERNEL_TARGET static uint32_t notLess(Float a, Float b)
+		{
+			return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpnlt_ps(a, b)));
+		}
+
+		KERNEL_TARGET static uint32_t notGreater(Float a, Float b)
+		{
+			return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpngt_ps(a, b)));
+		}
+
+		KERNEL_TARGET static uint32_t notGreaterEqual(Float a, Float b)
+		{
+			return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpnge_ps(a, b)));
+		}
+	};
+
+	// Vertices of up to Simd::width triangles, one lane per triangle
+	template <typename Simd>
+	struct TriangleBatch
+	{
+		alignas(64) float a[3][Simd::width];
+		alignas(64) float b[3][Simd::width];
+		alignas(64) float c[3][Simd::width];
+		uint32_t references[Simd::width];
+		uint32_t count;
+	};
+
+	// Fills the batch from the references [start, end), lanes past the end repeat the last triangle
+	template <typename Simd>
+	KERNEL_TARGET void gatherTriangles(const Mesh& mesh, uint32_t start, uint32_t end, TriangleBatch<Simd>& batch)
+	{
+		batch.count = std::min(end - start, Simd::width);
+		for (uint32_t lane = 0; lane < Simd::width; ++lane)
+		{
+			const uint32_t reference = start + std::min(lane, batch.count - 1);
+			const uint32_t triangleIndex =
+				mesh.triangleReferences.empty() ? reference : mesh.triangleReferences[reference];
+			const uint32_t* indices = mesh.triangles[triangleIndex].indices;
+			for (uint32_t axis = 0; axis < 3; ++axis)
+			{
+				batch.a[axis][lane] = mesh.positions[indices[0]].data[axis];
+				batch.b[axis][lane] = mesh.positions[indices[1]].data[axis];
+				batch.c[axis][lane] = mesh.positions[indices[2]].data[axis];
+			}
+			batch.references[lane] = reference;
+		}
+	}
+
+	template <typename Simd>
+	KERNEL_TARGET void subtract(const typename Simd::Float (&u)[3], const typename Simd::Float (&v)[3],
+	                            typename Simd::Float (&result)[3])
+	{
+		for (uint32_t axis = 0; axis < 3; ++axis)
+			result[axis] = Simd::sub(u[axis], v[axis]);
+	}
+
+	// Same products and differences as Cross in Math3D.hpp
+	template <typename Simd>
+	KERNEL_TARGET void cross(const typename Simd::Float (&u)[3], const typename Simd::Float (&v)[3],
+	                         typename Simd::Float (&result)[3])
+	{
+		result[0] = Simd::sub(Simd::mul(u[1], v[2]), Simd::mul(u[2], v[1]));
+		result[1] = Simd::sub(Simd::mul(u[2], v[0]), Simd::mul(u[0], v[2]));
+		result[2] = Simd::sub(Simd::mul(u[0], v[1]), Simd::mul(u[1], v[0]));
+	}
+
+	template <typename Simd>
+	KERNEL_TARGET typename Simd::Float dot(const typename Simd::Float (&u)[3], const typename Simd::Float (&v)[3])
+	{
+		return Simd::add(Simd::add(Simd::mul(u[0], v[0]), Simd::mul(u[1], v[1])), Simd::mul(u[2], v[2]));
+	}
+
+	// Triangle::intersect for every lane. Bit i of the result is set when triangle i is hit, t[i] is then the
+	// distance. The comparisons are negated like the early returns of Triangle::intersect, so NaNs pass the same way.
+	template <typename Simd>
+	KERNEL_TARGET uint32_t intersectTriangles(const TriangleBatch<Simd>& batch, const Ray& ray, bool backFaceCull,
+	                                          float* t)
+	{
+		using Float = typename Simd::Float;
+
+		Float a[3];
+		Float b[3];
+		Float c[3];
+		Float origin[3];
+		Float direction[3];
+		for (uint32_t axis = 0; axis < 3; ++axis)
+		{
+			a[axis] = Simd::load(batch.a[axis]);
+			b[axis] = Simd::load(batch.b[axis]);
+			c[axis] = Simd::load(batch.c[axis]);
+			origin[axis] = Simd::broadcast(ray.origin.data[axis]);
+			direction[axis] = Simd::broadcast(ray.directionN.data[axis]);
+		}
+
+		Float edge0[3];
+		Float edge1[3];
+		Float edge2[3];
+		Float normal[3];
+		subtract<Simd>(b, a, edge0);
+		subtract<Simd>(c, b, edge1);
+		subtract<Simd>(a, c, edge2);
+		Float aToC[3];
+		subtract<Simd>(c, a, aToC);
+		cross<Simd>(edge0, aToC, normal);
+
+		const Float zero = Simd::broadcast(0.f);
+		const Float dirDotNorm = dot<Simd>(direction, normal);
+		uint32_t hitMask = (1u << batch.count) - 1;
+		if (backFaceCull)
+			hitMask &= Simd::notGreaterEqual(dirDotNorm, zero);
+
+		Float originToA[3];
+		subtract<Simd>(a, origin, originToA);
+		const Float distance = Simd::div(dot<Simd>(originToA, normal), dirDotNorm);
+		hitMask &= Simd::notLess(distance, zero) & Simd::notGreater(distance, Simd::broadcast(ray.maxT));
+		if (!hitMask)
+			return 0;
+
+		Float point[3];
+		for (uint32_t axis = 0; axis < 3; ++axis)
+			point[axis] = Simd::add(origin[axis], Simd::mul(direction[axis], distance));
+
+		const Float (*vertices[3])[3] = {&a, &b, &c};
+		const Float (*edges[3])[3] = {&edge0, &edge1, &edge2};
+		for (uint32_t edge = 0; edge < 3; ++edge)
+		{
+			Float toPoint[3];
+			Float edgeCross[3];
+			subtract<Simd>(point, *vertices[edge], toPoint);
+			cross<Simd>(*edges[edge], toPoint, edgeCross);
+			hitMask &= Simd::notLess(dot<Simd>(normal, edgeCross), zero);
+		}
+
+		Simd::store(t, distance);
+		return hitMask;
+	}
+
+	template <typename Simd>
+	KERNEL_TARGET uint32_t closestTriangle(const Mesh& mesh, const Ray& ray, uint32_t start, uint32_t end,
+	                                       bool backFaceCull)
+	{
+		// Most leaves hold at most four triangles, wider batches would mostly test padding
+		if constexpr (Simd::width > Simd128::width)
+		{
+			if (end - start <= Simd128::width)
+				return closestTriangle<Simd128>(mesh, ray, start, end, backFaceCull);
+		}
+
+		uint32_t closest = Kernels::noTriangle;
+		float closestT = std::numeric_limits<float>::infinity();
+		TriangleBatch<Simd> batch;
+		alignas(64) float t[Simd::width];
+		for (uint32_t batchStart = start; batchStart < end; batchStart += Simd::width)
+		{
+			gatherTriangles(mesh, batchStart, end, batch);
+			for (uint32_t hitMask = intersectTriangles(batch, ray, backFaceCull, t); hitMask; hitMask &= hitMask - 1)
+			{
+				const uint32_t lane = static_cast<uint32_t>(std::countr_zero(hitMask));
+				if (t[lane] < closestT)
+				{
+					closestT = t[lane];
+					closest = batch.references[lane];
+				}
+			}
+		}
+		return closest;
+	}
+
+	template <typename Simd>
+	KERNEL_TARGET uint32_t anyTriangle(const Mesh& mesh, const Ray& ray, uint32_t start, uint32_t end,
+	                                   bool backFaceCull)
+	{
+		if constexpr (Simd::width > Simd128::width)
+		{
+			if (end - start <= Simd128::width)
+				return anyTriangle<Simd128>(mesh, ray, start, end, backFaceCull);
+		}
+
+		TriangleBatch<Simd> batch;
+		alignas(64) float t[Simd::width];
+		for (uint32_t batchStart = start; batchStart < end; batchStart += Simd::width)
+		{
+			gatherTriangles(mesh, batchStart, end, batch);
+			if (const uint32_t hitMask = intersectTriangles(batch, ray, backFaceCull, t))
+				return batch.references[std::countr_zero(hitMask)];
+		}
+		return Kernels::noTriangle;
+	}
+}
@@ -0,0 +1,165 @@
+#include "Kernels.hpp"
+
+#include "BVH.hpp"
+#include "Mesh.hpp"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define KERNELS_X86
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define KERNELS_X86
+#endif
+
+namespace
+{
+#ifdef KERNELS_X86
+	void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t (&registers)[4])
+	{
+#ifdef _MSC_VER
+		int values[4];
+		__cpuidex(values, static_cast<int>(leaf), static_cast<int>(subleaf));
+		for (int i = 0; i < 4; ++i)
+			registers[i] = static_cast<uint32_t>(values[i]);
+#else
+		__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	}
+
+	// Register state the operating system saves on context switches
+	uint64_t enabledStateComponents()
+	{
+#ifdef _MSC_VER
+		return _xgetbv(0);
+#else
+		uint32_t low;
+		uint32_t high;
+		__asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+		return static_cast<uint64_t>(high) << 32 | low;
+#endif
+	}
+#endif
+
+	uint32_t scalarIntersectChildren(const QuantizedBVHNode& node, const Ray& ray, float (&entryT)[4])
+	{
+		uint32_t hitMask = 0;
+		for (uint32_t child = 0; child < node.childCount; ++child)
+		{
+			if (node.childBounds(child).intersect(ray, entryT[child]))
+				hitMask |= 1u << child;
+		}
+		return hitMask;
+	}
+
+	uint32_t triangleIndex(const Mesh& mesh, uint32_t reference)
+	{
+		return mesh.triangleReferences.empty() ? reference : mesh.triangleReferences[reference];
+	}
+
+	uint32_t scalarClosestTriangle(const Mesh& mesh, const Ray& ray, uint32_t start, uint32_t end, bool backFaceCull)
+	{
+		uint32_t closest = Kernels::noTriangle;
+		float closestT = std::numeric_limits<float>::infinity();
+		for (uint32_t reference = start; reference < end; ++reference)
+		{
+			const HitInfo hitInfo = mesh.triangles[triangleIndex(mesh, reference)].intersect(mesh, ray, backFaceCull);
+			if (hitInfo.hit && hitInfo.t < closestT)
+			{
+				closestT = hitInfo.t;
+				closest = reference;
+			}
+		}
+		return closest;
+	}
+
+	uint32_t scalarAnyTriangle(const Mesh& mesh, const Ray& ray, uint32_t start, uint32_t end, bool backFaceCull)
+	{
+		for (uint32_t reference = start; reference < end; ++reference)
+		{
+			if (mesh.triangles[triangleIndex(mesh, reference)].intersect(mesh, ray, backFaceCull).hit)
+				return reference;
+		}
+		return Kernels::noTriangle;
+	}
+
+	const Kernels::Table& tableFor(Kernels::InstructionSet instructionSet)
+	{
+		switch (instructionSet)
+		{
+		case Kernels::InstructionSet::SSE42:
+			return Kernels::sse42Table();
+		case Kernels::InstructionSet::AVX2:
+			return Kernels::avx2Table();
+		case Kernels::InstructionSet::AVX512:
+			return Kernels::avx512Table();
+		default:
+			return Kernels::scalarTable();
+		}
+	}
+
+	// Set before main, rendering threads only read it
+	const Kernels::Table* activeTable = &tableFor(Kernels::supportedInstructionSet());
+}
+
+Kernels::InstructionSet Kernels::supportedInstructionSet()
+{
+#ifdef KERNELS_X86
+	uint32_t registers[4];
+	cpuid(0, 0, registers);
+	const uint32_t maxLeaf = registers[0];
+	if (maxLeaf < 1)
+		return InstructionSet::Scalar;
+
+	cpuid(1, 0, registers);
+	const bool sse42 = (registers[2] >> 19 & 1) && (registers[2] >> 20 & 1);
+	const bool osxsave = registers[2] >> 27 & 1;
+	const bool avx = registers[2] >> 28 & 1;
+	if (!sse42)
+		return InstructionSet::Scalar;
+	if (!osxsave || !avx || maxLeaf < 7)
+		return InstructionSet::SSE42;
+
+	// The operating system has to save the YMM registers for AVX2, and the mask and upper ZMM registers for AVX-512
+	const uint64_t stateComponents = enabledStateComponents();
+	cpuid(7, 0, registers);
+	const bool avx2 = (registers[1] >> 5 & 1) && (stateComponents & 0x6) == 0x6;
+	const bool avx512 = (registers[1] >> 16 & 1) && (stateComponents & 0xe6) == 0xe6;
+	if (avx2 && avx512)
+		return InstructionSet::AVX512;
+	if (avx2)
+		return InstructionSet::AVX2;
+	return InstructionSet::SSE42;
+#else
+	return InstructionSet::Scalar;
+#endif
+}
+
+bool Kernels::select(const std::string& name)
+{
+	for (InstructionSet instructionSet :
+	     {InstructionSet::Scalar, InstructionSet::SSE42, InstructionSet::AVX2, InstructionSet::AVX512})
+	{
+		const Table& table = tableFor(instructionSet);
+		if (name == table.name)
+		{
+			if (table.instructionSet > supportedInstructionSet())
+				return false;
+			activeTable = &table;
+			return true;
+		}
+	}
+	return false;
+}
+
+const Kernels::Table& Kernels::active()
+{
+	return *activeTable;
+}
+
+const Kernels::Table& Kernels::scalarTable()
+{
+	static const Table table{
+		InstructionSet::Scalar, "scalar", scalarIntersectChildren, scalarClosestTriangle, scalarAnyTriangle
+	};
+	return table;
+}
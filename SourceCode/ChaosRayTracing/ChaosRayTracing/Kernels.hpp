@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+struct Mesh;
+struct QuantizedBVHNode;
+struct Ray;
+
+// Hot intersection kernels compiled once per instruction set, the best one the CPU supports is picked at startup.
+// The SIMD variants use the same operations in the same order as the scalar code and no fused multiply-add, so every
+// variant finds the same hits.
+namespace Kernels
+{
+	enum class InstructionSet
+	{
+		Scalar,
+		SSE42,
+		AVX2,
+		AVX512
+	};
+
+	constexpr uint32_t noTriangle = std::numeric_limits<uint32_t>::max();
+
+	struct Table
+	{
+		InstructionSet instructionSet;
+		const char* name;
+
+		// Slab tests of the children of a quantized node like AABB::intersect. Bit i of the result is set when child
+		// i is hit, entryT[i] is then where the ray enters it.
+		uint32_t (*intersectChildren)(const QuantizedBVHNode& node, const Ray& ray, float (&entryT)[4]);
+
+		// Triangle references [start, end) of the mesh tested like Triangle::intersect. Returns the first reference
+		// with the nearest hit, or noTriangle.
+		uint32_t (*closestTriangle)(const Mesh& mesh, const Ray& ray, uint32_t start, uint32_t end, bool backFaceCull);
+
+		// Returns the first reference that is hit at all, or noTriangle
+		uint32_t (*anyTriangle)(const Mesh& mesh, const Ray& ray, uint32_t start, uint32_t end, bool backFaceCull);
+	};
+
+	// Best instruction set of this CPU that the kernels have a variant for
+	InstructionSet supportedInstructionSet();
+
+	// Overrides the detected variant, for benchmarking. name is one of scalar, sse4.2, avx2 and avx512. Returns false
+	// and keeps the current variant when the name is unknown or the CPU lacks the instruction set.
+	bool select(const std::string& name);
+
+	const Table& active();
+
+	// Variants, each in its own translation unit
+	const Table& scalarTable();
+	const Table& sse42Table();
+	const Table& avx2Table();
+	const Table& avx512Table();
+}
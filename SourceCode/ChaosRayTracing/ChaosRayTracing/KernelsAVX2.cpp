@@ -0,0 +1,62 @@
+#include "Kernels.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+
+// No "fma", contracted products would round differently from the scalar code
+#ifdef _MSC_VER
+#define KERNEL_TARGET
+#else
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#endif
+
+#include "KernelTemplates.hpp"
+
+namespace
+{
+	struct AVX2
+	{
+		using Float = __m256;
+		static constexpr uint32_t width = 8;
+
+		KERNEL_TARGET static Float load(const float* values) { return _mm256_load_ps(values); }
+		KERNEL_TARGET static void store(float* values, Float v) { _mm256_store_ps(values, v); }
+		KERNEL_TARGET static Float broadcast(float value) { return _mm256_set1_ps(value); }
+		KERNEL_TARGET static Float add(Float a, Float b) { return _mm256_add_ps(a, b); }
+		KERNEL_TARGET static Float sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+		KERNEL_TARGET static Float mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+		KERNEL_TARGET static Float div(Float a, Float b) { return _mm256_div_ps(a, b); }
+
+		// Lane masks of the negated comparisons, true for NaNs
+		KERNEL_TARGET static uint32_t notLess(Float a, Float b)
+		{
+			return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NLT_UQ)));
+		}
+
+		KERNEL_TARGET static uint32_t notGreater(Float a, Float b)
+		{
+			return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NGT_UQ)));
+		}
+
+		KERNEL_TARGET static uint32_t notGreaterEqual(Float a, Float b)
+		{
+			return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_NGE_UQ)));
+		}
+	};
+}
+
+const Kernels::Table& Kernels::avx2Table()
+{
+	static const Table table{
+		InstructionSet::AVX2, "avx2", intersectChildren, closestTriangle<AVX2>, anyTriangle<AVX2>
+	};
+	return table;
+}
+
+#else
+
+const Kernels::Table& Kernels::avx2Table()
+{
+	return scalarTable();
+}
+
+#endif
@@ -0,0 +1,55 @@
+#include "Kernels.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+
+// AVX-512 foundation only, no "fma" for the same reason as the AVX2 variant
+#ifdef _MSC_VER
+#define KERNEL_TARGET
+#else
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+#endif
+
+#include "KernelTemplates.hpp"
+
+namespace
+{
+	struct AVX512
+	{
+		using Float = __m512;
+		static constexpr uint32_t width = 16;
+
+		KERNEL_TARGET static Float load(const float* values) { return _mm512_load_ps(values); }
+		KERNEL_TARGET static void store(float* values, Float v) { _mm512_store_ps(values, v); }
+		KERNEL_TARGET static Float broadcast(float value) { return _mm512_set1_ps(value); }
+		KERNEL_TARGET static Float add(Float a, Float b) { return _mm512_add_ps(a, b); }
+		KERNEL_TARGET static Float sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+		KERNEL_TARGET static Float mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+		KERNEL_TARGET static Float div(Float a, Float b) { return _mm512_div_ps(a, b); }
+
+		// Lane masks of the negated comparisons, true for NaNs
+		KERNEL_TARGET static uint32_t notLess(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_NLT_UQ); }
+		KERNEL_TARGET static uint32_t notGreater(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_NGT_UQ); }
+
+		KERNEL_TARGET static uint32_t notGreaterEqual(Float a, Float b)
+		{
+			return _mm512_cmp_ps_mask(a, b, _CMP_NGE_UQ);
+		}
+	};
+}
+
+const Kernels::Table& Kernels::avx512Table()
+{
+	static const Table table{
+		InstructionSet::AVX512, "avx512", intersectChildren, closestTriangle<AVX512>, anyTriangle<AVX512>
+	};
+	return table;
+}
+
+#else
+
+const Kernels::Table& Kernels::avx512Table()
+{
+	return scalarTable();
+}
+
+#endif
@@ -0,0 +1,28 @@
+#include "Kernels.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+
+#ifdef _MSC_VER
+#define KERNEL_TARGET
+#else
+#define KERNEL_TARGET __attribute__((target("sse4.2")))
+#endif
+
+#include "KernelTemplates.hpp"
+
+const Kernels::Table& Kernels::sse42Table()
+{
+	static const Table table{
+		InstructionSet::SSE42, "sse4.2", intersectChildren, closestTriangle<Simd128>, anyTriangle<Simd128>
+	};
+	return table;
+}
+
+#else
+
+const Kernels::Table& Kernels::sse42Table()
+{
+	return scalarTable();
+}
+
+#endif
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include "AABB.hpp"
+#include "Math3D.hpp"
+
+// Spatial and directional bounds of a group of emitters: where they are, which way they face (a cone of normals
+// widened by the angle they emit into around each normal) and how much power they emit
+struct LightBounds
+{
+	AABB bounds;
+	float power = 0.f;
+	Vector3 axis{0.f, 0.f, 1.f};
+	float cosNormalAngle = 1.f; // half angle of the cone of normals around axis
+	float cosEmissionAngle = 0.f; // how far past the normals they emit, 0 is a full hemisphere
+
+	// Union of the normal cones, the smallest cone containing both
+	static LightBounds merge(const LightBounds& a, const LightBounds& b)
+	{
+		if (a.power == 0.f)
+			return b;
+		if (b.power == 0.f)
+			return a;
+
+		LightBounds result;
+		result.bounds = a.bounds;
+		result.bounds.include(b.bounds);
+		result.power = a.power + b.power;
+		result.cosEmissionAngle = std::min(a.cosEmissionAngle, b.cosEmissionAngle);
+
+		const float angleA = safeAcos(a.cosNormalAngle);
+		const float angleB = safeAcos(b.cosNormalAngle);
+		const float angleBetween = safeAcos(Dot(a.axis, b.axis));
+		if (std::min(angleBetween + angleB, PI) <= angleA)
+		{
+			result.axis = a.axis;
+			result.cosNormalAngle = a.cosNormalAngle;
+			return result;
+		}
+		if (std::min(angleBetween + angleA, PI) <= angleB)
+		{
+			result.axis = b.axis;
+			result.cosNormalAngle = b.cosNormalAngle;
+			return result;
+		}
+
+		const float angle = (angleA + angleBetween + angleB) * 0.5f;
+		const Vector3 rotationAxis = Cross(a.axis, b.axis);
+		if (angle >= PI || Dot(rotationAxis, rotationAxis) == 0.f)
+		{
+			result.cosNormalAngle = -1.f; // whole sphere
+			return result;
+		}
+
+		// Rotate a's axis towards b's until the cone just contains both (Rodrigues' formula)
+		const Vector3 k = Normalize(rotationAxis);
+		const float rotation = angle - angleA;
+		const float cosRotation = std::cos(rotation);
+		const float sinRotation = std::sin(rotation);
+		result.axis = Normalize(a.axis * cosRotation + Cross(k, a.axis) * sinRotation +
+		                        k * (Dot(k, a.axis) * (1.f - cosRotation)));
+		result.cosNormalAngle = std::cos(angle);
+		return result;
+	}
+
+	// Conservative estimate of the contribution to a point with the given normal, zero when none of the emitters can
+	// reach it. A zero normal skips the cosine at the receiver.
+	float importance(const Vector3& point, const Vector3& normal) const
+	{
+		const Vector3 center = bounds.center();
+		const Vector3 toPoint = point - center;
+		const float radius = bounds.extent().magnitude() * 0.5f;
+		const float distSqr = std::max(Dot(toPoint, toPoint), radius);
+		const float distance = std::sqrt(Dot(toPoint, toPoint));
+		const Vector3 toPointN = distance > 0.f ? toPoint / distance : Vector3{0.f};
+
+		// Angle between the axis and the point, reduced by the cone and by the angle the bounds subtend
+		const float cosTheta = Dot(axis, toPointN);
+		const float sinTheta = safeSqrt(1.f - cosTheta * cosTheta);
+
+		float cosBounds = -1.f;
+		if (distance > radius)
+			cosBounds = safeSqrt(1.f - radius * radius / (distance * distance));
+		const float sinBounds = safeSqrt(1.f - cosBounds * cosBounds);
+
+		const float sinNormalAngle = safeSqrt(1.f - cosNormalAngle * cosNormalAngle);
+		const float cosReduced = cosSubClamped(sinTheta, cosTheta, sinNormalAngle, cosNormalAngle);
+		const float sinReduced = sinSubClamped(sinTheta, cosTheta, sinNormalAngle, cosNormalAngle);
+		const float cosFinal = cosSubClamped(sinReduced, cosReduced, sinBounds, cosBounds);
+		if (cosFinal <= cosEmissionAngle)
+			return 0.f;
+
+		float result = power * cosFinal / distSqr;
+		if (Dot(normal, normal) > 0.f)
+		{
+			const float cosIncident = std::abs(Dot(-toPointN, normal));
+			const float sinIncident = safeSqrt(1.f - cosIncident * cosIncident);
+			result *= cosSubClamped(sinIncident, cosIncident, sinBounds, cosBounds);
+		}
+		return std::max(result, 0.f);
+	}
+
+	// Orientation-weighted cost of a node in the build
+	float orientationMeasure() const
+	{
+		const float normalAngle = safeAcos(cosNormalAngle);
+		const float emissionAngle = safeAcos(cosEmissionAngle);
+		const float angle = std::min(normalAngle + emissionAngle, PI);
+		const float sinNormalAngle = safeSqrt(1.f - cosNormalAngle * cosNormalAngle);
+		return 2.f * PI * (1.f - cosNormalAngle) +
+			PI / 2.f * (2.f * angle * sinNormalAngle - std::cos(normalAngle - 2.f * angle) -
+				2.f * normalAngle * sinNormalAngle + cosNormalAngle);
+	}
+
+private:
+	static float safeSqrt(float x)
+	{
+		return std::sqrt(std::max(0.f, x));
+	}
+
+	static float safeAcos(float x)
+	{
+		return std::acos(std::clamp(x, -1.f, 1.f));
+	}
+
+	// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+	static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return cosA > cosB ? 1.f : cosA * cosB + sinA * sinB;
+	}
+
+	static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return cosA > cosB ? 0.f : sinA * cosB - cosA * sinB;
+	}
+};
+
+// BVH over emitters for sampling in proportion to their estimated contribution to a shading point. Traversal picks
+// one child at every inner node with probability proportional to its importance, the product of those choices is the
+// probability of the light. Every light remembers its leaf so that the same probability can be evaluated bottom-up
+// for MIS.
+class LightBVH
+{
+public:
+	struct Sample
+	{
+		uint32_t lightIndex;
+		float pmf;
+	};
+
+	void build(const std::vector<LightBounds>& lightBounds)
+	{
+		nodes.clear();
+		leafNodes.assign(lightBounds.size(), invalidNode);
+
+		std::vector<uint32_t> lightIndices;
+		for (uint32_t i = 0; i < lightBounds.size(); ++i)
+		{
+			if (lightBounds[i].power > 0.f)
+				lightIndices.push_back(i);
+		}
+		if (lightIndices.empty())
+			return;
+
+		nodes.reserve(2 * lightIndices.size() - 1);
+		buildRecursive(lightBounds, lightIndices, 0, static_cast<uint32_t>(lightIndices.size()), invalidNode);
+	}
+
+	bool empty() const
+	{
+		return nodes.empty();
+	}
+
+	std::optional<Sample> sample(const Vector3& point, const Vector3& normal, float u) const
+	{
+		if (nodes.empty() || nodes[0].lightBounds.importance(point, normal) == 0.f)
+			return std::nullopt;
+
+		uint32_t nodeIndex = 0;
+		float pmf = 1.f;
+		while (!nodes[nodeIndex].isLeaf)
+		{
+			const uint32_t children[2] = {nodeIndex + 1, nodes[nodeIndex].secondChildOrLight};
+			const float importances[2] = {nodes[children[0]].lightBounds.importance(point, normal),
+			                              nodes[children[1]].lightBounds.importance(point, normal)};
+			const float total = importances[0] + importances[1];
+			if (total == 0.f)
+				return std::nullopt;
+
+			// Pick a child and rescale u to [0, 1) for the next level
+			const float firstProbability = importances[0] / total;
+			const uint32_t child = u < firstProbability ? 0 : 1;
+			const float childProbability = child == 0 ? firstProbability : 1.f - firstProbability;
+			u = std::min((child == 0 ? u : u - firstProbability) / childProbability, oneMinusEpsilon);
+			pmf *= childProbability;
+			nodeIndex = children[child];
+		}
+		return Sample{nodes[nodeIndex].secondChildOrLight, pmf};
+	}
+
+	// Probability of sample returning the light from this point, the choices are replayed from the leaf upwards
+	float pmf(uint32_t lightIndex, const Vector3& point, const Vector3& normal) const
+	{
+		uint32_t nodeIndex = leafNodes[lightIndex];
+		if (nodeIndex == invalidNode || nodes[0].lightBounds.importance(point, normal) == 0.f)
+			return 0.f;
+
+		float pmf = 1.f;
+		while (nodeIndex != 0)
+		{
+			const uint32_t parent = nodes[nodeIndex].parent;
+			const uint32_t sibling = nodeIndex == parent + 1 ? nodes[parent].secondChildOrLight : parent + 1;
+			const float importance = nodes[nodeIndex].lightBounds.importance(point, normal);
+			if (importance == 0.f)
+				return 0.f;
+
+			pmf *= importance / (importance + nodes[sibling].lightBounds.importance(point, normal));
+			nodeIndex = parent;
+		}
+		return pmf;
+	}
+
+private:
+	struct Node
+	{
+		LightBounds lightBounds;
+		uint32_t secondChildOrLight; // second child of inner nodes, the first one follows its parent
+		uint32_t parent;
+		bool isLeaf;
+	};
+
+	static constexpr uint32_t invalidNode = std::numeric_limits<uint32_t>::max();
+	static constexpr uint32_t bucketCount = 12;
+	static constexpr float oneMinusEpsilon = 0x1.fffffep-1f;
+
+	// Splits on the bucket boundary with the lowest power times orientation measure times surface area, leaves hold
+	// one light each
+	LightBounds buildRecursive(const std::vector<LightBounds>& lightBounds, std::vector<uint32_t>& lightIndices,
+	                           uint32_t begin, uint32_t end, uint32_t parent)
+	{
+		const uint32_t nodeIndex = static_cast<uint32_t>(nodes.size());
+		nodes.emplace_back();
+
+		if (end - begin == 1)
+		{
+			const uint32_t lightIndex = lightIndices[begin];
+			nodes[nodeIndex] = {lightBounds[lightIndex], lightIndex, parent, true};
+			leafNodes[lightIndex] = nodeIndex;
+			return lightBounds[lightIndex];
+		}
+
+		AABB bounds;
+		AABB centroidBounds;
+		for (uint32_t i = begin; i < end; ++i)
+		{
+			const AABB& lightAABB = lightBounds[lightIndices[i]].bounds;
+			bounds.include(lightAABB);
+			const Vector3 centroid = lightAABB.center();
+			centroidBounds.include(AABB(centroid, centroid));
+		}
+
+		float bestCost = std::numeric_limits<float>::max();
+		uint32_t bestAxis = 0;
+		uint32_t bestBucket = 0;
+		bool splitFound = false;
+		const Vector3 boundsExtent = bounds.extent();
+		const float maxExtent = std::max({boundsExtent.x, boundsExtent.y, boundsExtent.z});
+		for (uint32_t axis = 0; axis < 3; ++axis)
+		{
+			const float minCentroid = centroidBounds.minPoint.data[axis];
+			const float centroidExtent = centroidBounds.maxPoint.data[axis] - minCentroid;
+			if (centroidExtent <= 0.f)
+				continue;
+
+			LightBounds buckets[bucketCount];
+			for (uint32_t i = begin; i < end; ++i)
+			{
+				const LightBounds& light = lightBounds[lightIndices[i]];
+				LightBounds& bucket = buckets[bucketFor(light, axis, minCentroid, centroidExtent)];
+				bucket = LightBounds::merge(bucket, light);
+			}
+
+			// Wide bounds across a thin axis are penalized, splitting them there leaves both halves as wide
+			const float aspectPenalty = maxExtent / boundsExtent.data[axis];
+			for (uint32_t split = 1; split < bucketCount; ++split)
+			{
+				LightBounds below;
+				LightBounds above;
+				for (uint32_t bucket = 0; bucket < split; ++bucket)
+					below = LightBounds::merge(below, buckets[bucket]);
+				for (uint32_t bucket = split; bucket < bucketCount; ++bucket)
+					above = LightBounds::merge(above, buckets[bucket]);
+
+				const float splitCost = aspectPenalty * (cost(below) + cost(above));
+				if (splitCost > 0.f && splitCost < bestCost)
+				{
+					bestCost = splitCost;
+					bestAxis = axis;
+					bestBucket = split;
+					splitFound = true;
+				}
+			}
+		}
+
+		uint32_t middle = (begin + end) / 2;
+		if (splitFound)
+		{
+			const float minCentroid = centroidBounds.minPoint.data[bestAxis];
+			const float centroidExtent = centroidBounds.maxPoint.data[bestAxis] - minCentroid;
+			auto* split = std::partition(lightIndices.data() + begin, lightIndices.data() + end,
+				[&](uint32_t lightIndex)
+				{
+					return bucketFor(lightBounds[lightIndex], bestAxis, minCentroid, centroidExtent) < bestBucket;
+				});
+			middle = static_cast<uint32_t>(split - lightIndices.data());
+			if (middle == begin || middle == end)
+				middle = (begin + end) / 2;
+		}
+
+		LightBounds first = buildRecursive(lightBounds, lightIndices, begin, middle, nodeIndex);
+		const uint32_t secondChild = static_cast<uint32_t>(nodes.size());
+		LightBounds second = buildRecursive(lightBounds, lightIndices, middle, end, nodeIndex);
+
+		nodes[nodeIndex] = {LightBounds::merge(first, second), secondChild, parent, false};
+		return nodes[nodeIndex].lightBounds;
+	}
+
+	static float cost(const LightBounds& lightBounds)
+	{
+		if (lightBounds.power == 0.f)
+			return 0.f;
+		return lightBounds.power * lightBounds.orientationMeasure() * lightBounds.bounds.area();
+	}
+
+	static uint32_t bucketFor(const LightBounds& light, uint32_t axis, float minCentroid, float centroidExtent)
+	{
+		const float offset = (light.bounds.center().data[axis] - minCentroid) / centroidExtent;
+		return std::min(static_cast<uint32_t>(offset * bucketCount), bucketCount - 1);
+	}
+
+	std::vector<Node> nodes;
+	std::vector<uint32_t> leafNodes; // per light
+};
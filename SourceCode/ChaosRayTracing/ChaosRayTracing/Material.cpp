@@ -1,10 +1,11 @@
 #include "Material.hpp"
 #include "Textures.hpp"
 
-Vector3 Material::getAlbedo(const Vector2& barycentrics, const Vector2& uv) const
+Vector3 Material::getAlbedo(const Vector2& barycentrics, const Vector2& uv,
+                            const UVDifferentials& uvDifferentials) const
 {
 	if (texture)
-		return texture->GetColor(barycentrics, uv);
+		return texture->GetColor(barycentrics, uv, uvDifferentials);
 
 	return albedo;
 }
@@ -29,7 +29,7 @@ public:
 		this->albedo = albedo;
 	}
 
-	Vector3 getAlbedo(const Vector2& barycentrics, const Vector2& uv) const;
+	Vector3 getAlbedo(const Vector2& barycentrics, const Vector2& uv, const UVDifferentials& uvDifferentials) const;
 
 	bool cullBackFace() const
 	{
@@ -7,6 +7,9 @@
 #include <algorithm>
 #include <random>
 #include <stdexcept>
+#include <limits>
+
+#include "SimdMath.hpp"
 
 constexpr float PI = std::numbers::pi_v<float>;
 
@@ -239,6 +242,12 @@ inline float Dot(const Vector3& a, const Vector3& b)
 	return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
+// Rec. 709 weights, for linear RGB
+inline float Luminance(const Vector3& rgb)
+{
+	return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+}
+
 inline Vector3 min(const Vector3& a, const Vector3& b)
 {
 	return Vector3(std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z));
@@ -249,6 +258,195 @@ inline Vector3 max(const Vector3& a, const Vector3& b)
 	return Vector3(std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z));
 }
 
+// Vector3 in an SSE register, for hot loops that keep their vectors in registers. The fourth lane is 0. Vector3 stays
+// the type that is stored, loading and storing converts.
+struct alignas(16) Vector3A
+{
+	__m128 v;
+
+	Vector3A() = default;
+
+	explicit Vector3A(__m128 v) : v(v)
+	{
+	}
+
+	explicit Vector3A(const Vector3& u) : v(SimdMath::load3(u.data))
+	{
+	}
+
+	Vector3A(float x, float y, float z) : v(_mm_setr_ps(x, y, z, 0.f))
+	{
+	}
+
+	float x() const
+	{
+		return _mm_cvtss_f32(v);
+	}
+
+	float y() const
+	{
+		return _mm_cvtss_f32(SimdMath::splat<1>(v));
+	}
+
+	float z() const
+	{
+		return _mm_cvtss_f32(SimdMath::splat<2>(v));
+	}
+
+	Vector3 toVector3() const
+	{
+		Vector3 result;
+		SimdMath::store3(result.data, v);
+		return result;
+	}
+};
+
+inline Vector3A operator +(const Vector3A& a, const Vector3A& b)
+{
+	return Vector3A(_mm_add_ps(a.v, b.v));
+}
+
+inline Vector3A operator -(const Vector3A& a, const Vector3A& b)
+{
+	return Vector3A(_mm_sub_ps(a.v, b.v));
+}
+
+inline Vector3A operator *(const Vector3A& v, float s)
+{
+	return Vector3A(_mm_mul_ps(v.v, _mm_set1_ps(s)));
+}
+
+inline Vector3A operator *(const Vector3A& v, const Vector3A& u)
+{
+	return Vector3A(_mm_mul_ps(v.v, u.v));
+}
+
+inline float Dot(const Vector3A& a, const Vector3A& b)
+{
+	return _mm_cvtss_f32(SimdMath::dot3(a.v, b.v));
+}
+
+inline Vector3A Cross(const Vector3A& a, const Vector3A& b)
+{
+	return Vector3A(SimdMath::cross3(a.v, b.v));
+}
+
+// Divided exactly like Normalize, SimdMath::rsqrt fails on lengths whose square is denormal or overflows
+inline Vector3A Normalize(const Vector3A& v)
+{
+	return Vector3A(_mm_div_ps(v.v, _mm_sqrt_ps(SimdMath::dot3(v.v, v.v))));
+}
+
+inline Vector3A min(const Vector3A& a, const Vector3A& b)
+{
+	return Vector3A(_mm_min_ps(a.v, b.v));
+}
+
+inline Vector3A max(const Vector3A& a, const Vector3A& b)
+{
+	return Vector3A(_mm_max_ps(a.v, b.v));
+}
+
+// Homogeneous point (w = 1) or direction (w = 0), 16-byte aligned so it loads into one SSE register
+struct alignas(16) Vector4
+{
+	union
+	{
+		struct
+		{
+			float x;
+			float y;
+			float z;
+			float w;
+		};
+
+		float data[4];
+	};
+
+	Vector4() = default;
+
+	Vector4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w)
+	{
+	}
+
+	Vector4(const Vector3& v, float w) : x(v.x), y(v.y), z(v.z), w(w)
+	{
+	}
+
+	explicit Vector4(__m128 v)
+	{
+		_mm_store_ps(data, v);
+	}
+
+	__m128 load() const
+	{
+		return _mm_load_ps(data);
+	}
+
+	Vector3 xyz() const
+	{
+		return {x, y, z};
+	}
+};
+
+// Eight Vector3s as separate x, y and z arrays, for streams of rays and hits. Each operation works on all eight
+// lanes, four at a time in SSE registers.
+struct alignas(16) Vector3x8
+{
+	static constexpr uint32_t width = 8;
+
+	float x[width];
+	float y[width];
+	float z[width];
+
+	Vector3x8() = default;
+
+	explicit Vector3x8(const Vector3& v)
+	{
+		std::fill(std::begin(x), std::end(x), v.x);
+		std::fill(std::begin(y), std::end(y), v.y);
+		std::fill(std::begin(z), std::end(z), v.z);
+	}
+
+	Vector3 operator[](uint32_t lane) const
+	{
+		return {x[lane], y[lane], z[lane]};
+	}
+
+	// Adds v * scales[lane] to every lane
+	Vector3x8& addScaled(const Vector3& v, const float (&scales)[width])
+	{
+		for (uint32_t lane = 0; lane < width; lane += 4)
+		{
+			const __m128 scale = _mm_loadu_ps(scales + lane);
+			_mm_store_ps(x + lane, _mm_add_ps(_mm_load_ps(x + lane), _mm_mul_ps(_mm_set1_ps(v.x), scale)));
+			_mm_store_ps(y + lane, _mm_add_ps(_mm_load_ps(y + lane), _mm_mul_ps(_mm_set1_ps(v.y), scale)));
+			_mm_store_ps(z + lane, _mm_add_ps(_mm_load_ps(z + lane), _mm_mul_ps(_mm_set1_ps(v.z), scale)));
+		}
+		return *this;
+	}
+
+	// Scales every lane to unit length and returns the scale factors, one over the former lengths. Uses the rsqrt
+	// estimate, so only for lengths well inside the float range, like the camera rays this is made for.
+	Vector3x8& normalize(float (&inverseLengths)[width])
+	{
+		for (uint32_t lane = 0; lane < width; lane += 4)
+		{
+			const __m128 vx = _mm_load_ps(x + lane);
+			const __m128 vy = _mm_load_ps(y + lane);
+			const __m128 vz = _mm_load_ps(z + lane);
+			const __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)),
+			                                        _mm_mul_ps(vz, vz));
+			const __m128 inverseLength = SimdMath::rsqrt(lengthSquared);
+			_mm_storeu_ps(inverseLengths + lane, inverseLength);
+			_mm_store_ps(x + lane, _mm_mul_ps(vx, inverseLength));
+			_mm_store_ps(y + lane, _mm_mul_ps(vy, inverseLength));
+			_mm_store_ps(z + lane, _mm_mul_ps(vz, inverseLength));
+		}
+		return *this;
+	}
+};
+
 struct Point3 : Vector3
 {
 	Point3() = default;
@@ -297,6 +495,7 @@ struct Ray
 	Ray(const Vector3& origin, const Vector3& directionN, float maxT = std::numeric_limits<float>::max())
 		: origin(origin), directionN(directionN), maxT(maxT)
 	{
+		// Divided exactly, the slab tests need 1 / +-0 to be +-infinity and a correctly rounded reciprocal
 		directionNInv = Vector3(1.f / directionN.x, 1.f / directionN.y, 1.f / directionN.z);
 	}
 
@@ -306,112 +505,79 @@ struct Ray
 	}
 };
 
-struct HitInfo
-{
-	bool hit = false;
-	float t = std::numeric_limits<float>::max();
-	Vector3 point;
-	Vector3 normal;
-	Vector2 barycentrics;
-	uint32_t materialIndex;
-	uint32_t triangleIndex;
-};
-
-struct Vertex
-{
-	Vector3 position;
-	Vector3 normal;
-	Vector2 uv;
-};
-
-struct Triangle
+// Derivatives of a ray's origin and direction with respect to one pixel step in screen x and y (Igehy, "Tracing Ray
+// Differentials"). Surfaces are treated as locally flat, the derivatives of the normal are left out.
+struct RayDifferentials
 {
-	Vertex v0;
-	Vertex v1;
-	Vertex v2;
+	Vector3 dOdx{0.f};
+	Vector3 dOdy{0.f};
+	Vector3 dDdx{0.f};
+	Vector3 dDdy{0.f};
+	bool valid = false; // false after diffuse bounces, texture lookups then use the finest level
 
-	uint32_t materialIndex;
-
-	Vector3 faceNormal;
-
-	int32_t emissiveIndex = -1;
-
-	Triangle(const Vertex& a, const Vertex& b, const Vertex& c, uint32_t materialIndex, int32_t emissiveIndex)
-		: v0(a), v1(b), v2(c), materialIndex(materialIndex), emissiveIndex(emissiveIndex)
+	// Moves the origin derivatives to the point where the ray hits the plane with the normal at distance t
+	RayDifferentials transfer(const Vector3& direction, float t, const Vector3& normal) const
 	{
-		this->faceNormal = Normalize(Cross(v1.position - v0.position, v2.position - v0.position));
-	}
+		const float dDotN = Dot(direction, normal);
+		if (!valid || dDotN == 0.f)
+			return {};
 
-	Vector3 centroid() const
-	{
-		return (v0.position + v1.position + v2.position) / 3.f;
+		RayDifferentials result = *this;
+		result.dOdx = dOdx + dDdx * t;
+		result.dOdy = dOdy + dDdy * t;
+		result.dOdx -= direction * (Dot(result.dOdx, normal) / dDotN);
+		result.dOdy -= direction * (Dot(result.dOdy, normal) / dDotN);
+		return result;
 	}
 
-	float area() const
+	// Mirror reflection about the normal, call on transferred differentials
+	RayDifferentials reflect(const Vector3& normal) const
 	{
-		return Cross(v1.position - v0.position, v2.position - v0.position).magnitude() * 0.5f;
+		RayDifferentials result = *this;
+		result.dDdx = dDdx - normal * (2.f * Dot(dDdx, normal));
+		result.dDdy = dDdy - normal * (2.f * Dot(dDdy, normal));
+		return result;
 	}
 
-	Vector3 getNormal(const Vector2& barycentrics) const
+	// Refraction into direction * etaRatio + normal * (etaRatio * cosThetaI - cosThetaT), the normal on the side of
+	// the incoming ray
+	RayDifferentials refract(const Vector3& normal, float etaRatio, float cosThetaI, float cosThetaT) const
 	{
-		float w = 1.f - barycentrics.x - barycentrics.y;
-		return Normalize(v1.normal * barycentrics.x + v2.normal * barycentrics.y + v0.normal * w);
-	}
+		const auto refractDerivative = [&](const Vector3& dD)
+		{
+			const float dCosThetaI = -Dot(dD, normal);
+			const float dCosThetaT = etaRatio * etaRatio * cosThetaI * dCosThetaI / cosThetaT;
+			return dD * etaRatio + normal * (etaRatio * dCosThetaI - dCosThetaT);
+		};
 
-	Vector2 getUVs(const Vector2& barycentrics) const
-	{
-		float w = 1.f - barycentrics.x - barycentrics.y;
-		return v1.uv * barycentrics.x + v2.uv * barycentrics.y + v0.uv * w;
+		RayDifferentials result = *this;
+		result.dDdx = refractDerivative(dDdx);
+		result.dDdy = refractDerivative(dDdy);
+		return result;
 	}
+};
 
-	HitInfo intersect(const Ray& ray, bool backFaceCull) const
-	{
-		HitInfo info;
-
-		const Vector3& a = v0.position;
-		const Vector3& b = v1.position;
-		const Vector3& c = v2.position;
-
-		float dirDotNorm = Dot(ray.directionN, faceNormal);
-		if (backFaceCull && dirDotNorm >= 0.f)
-			return info;
-
-		float t = Dot(a - ray.origin, faceNormal) / dirDotNorm;
-		if (t < 0.f || t > ray.maxT)
-			return info;
-
-		Vector3 p = ray(t);
-
-		Vector3 edge0 = b - a;
-		Vector3 edge1 = c - b;
-		Vector3 edge2 = a - c;
-		Vector3 C0 = p - a;
-		Vector3 C1 = p - b;
-		Vector3 C2 = p - c;
-
-		if (Dot(faceNormal, Cross(edge0, C0)) < 0.f)
-			return info;
-		if (Dot(faceNormal, Cross(edge1, C1)) < 0.f)
-			return info;
-		if (Dot(faceNormal, Cross(edge2, C2)) < 0.f)
-			return info;
-
-		// Calculate the barycentric coordinates
-		float triArea = Magnitude(Cross(b - a, c - a)); // area of the whole triangle
-		info.barycentrics.x = Magnitude(Cross(p - a, c - a)) / triArea;
-		info.barycentrics.y = Magnitude(Cross(b - a, p - a)) / triArea;
-
-		info.hit = true;
-		info.t = t;
-		info.point = p;
-		info.normal = faceNormal;
-		info.materialIndex = materialIndex;
+// Change of the texture coordinates over one pixel step in screen x and y, zero -> no footprint known
+struct UVDifferentials
+{
+	Vector2 dUVdx{0.f};
+	Vector2 dUVdy{0.f};
+};
 
-		return info;
-	}
+struct HitInfo
+{
+	bool hit = false;
+	float t = std::numeric_limits<float>::max();
+	Vector3 point;
+	Vector3 normal;
+	Vector2 barycentrics;
+	uint32_t materialIndex;
+	uint32_t triangleIndex;
+	uint32_t instanceIndex;
 };
 
-struct Matrix4
+// Stored by columns, each 16-byte aligned so the products below load them into SSE registers
+struct alignas(16) Matrix4
 {
 protected:
 	float n[4][4];
@@ -458,6 +624,11 @@ public:
 		return *reinterpret_cast<const Point3*>(n[3]);
 	}
 
+	__m128 column(int j) const
+	{
+		return _mm_load_ps(n[j]);
+	}
+
 	static Matrix4 identity()
 	{
 		return {
@@ -532,39 +703,85 @@ static Matrix4 lookAtInverse(const Vector3& eye, const Vector3& center, const Ve
 	};
 }
 
+// Linear part only, H(i, 0) * v.x + H(i, 1) * v.y + H(i, 2) * v.z in every row. The fourth lane stays 0 when the
+// last row is (0, 0, 0, 1).
+inline Vector3A operator *(const Matrix4& H, const Vector3A& v)
+{
+	return Vector3A(_mm_add_ps(_mm_add_ps(_mm_mul_ps(H.column(0), SimdMath::splat<0>(v.v)),
+	                                      _mm_mul_ps(H.column(1), SimdMath::splat<1>(v.v))),
+	                           _mm_mul_ps(H.column(2), SimdMath::splat<2>(v.v))));
+}
+
+inline Vector4 operator *(const Matrix4& H, const Vector4& v)
+{
+	const __m128 u = v.load();
+	const __m128 linear = _mm_add_ps(_mm_add_ps(_mm_mul_ps(H.column(0), SimdMath::splat<0>(u)),
+	                                            _mm_mul_ps(H.column(1), SimdMath::splat<1>(u))),
+	                                 _mm_mul_ps(H.column(2), SimdMath::splat<2>(u)));
+	return Vector4(_mm_add_ps(linear, _mm_mul_ps(H.column(3), SimdMath::splat<3>(u))));
+}
+
 inline Vector3 operator *(const Matrix4& H, const Vector3& v)
 {
-	return {
-		H(0, 0) * v.x + H(0, 1) * v.y + H(0, 2) * v.z,
-		H(1, 0) * v.x + H(1, 1) * v.y + H(1, 2) * v.z,
-		H(2, 0) * v.x + H(2, 1) * v.y + H(2, 2) * v.z
-	};
+	return (H * Vector3A(v)).toVector3();
 }
 
 inline Point3 operator *(const Matrix4& H, const Point3& p)
 {
-	return {
-		H(0, 0) * p.x + H(0, 1) * p.y + H(0, 2) * p.z + H(0, 3),
-		H(1, 0) * p.x + H(1, 1) * p.y + H(1, 2) * p.z + H(1, 3),
-		H(2, 0) * p.x + H(2, 1) * p.y + H(2, 2) * p.z + H(2, 3)
-	};
+	const Vector4 result = H * Vector4(p, 1.f);
+	return {result.x, result.y, result.z};
+}
+
+// Inverse of a matrix made of a linear 3x3 part and a translation
+inline Matrix4 inverseAffine(const Matrix4& m)
+{
+	Matrix4 inv = Matrix4::identity();
+
+	inv(0, 0) = m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1);
+	inv(1, 0) = m(1, 2) * m(2, 0) - m(1, 0) * m(2, 2);
+	inv(2, 0) = m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0);
+	inv(0, 1) = m(0, 2) * m(2, 1) - m(0, 1) * m(2, 2);
+	inv(1, 1) = m(0, 0) * m(2, 2) - m(0, 2) * m(2, 0);
+	inv(2, 1) = m(0, 1) * m(2, 0) - m(0, 0) * m(2, 1);
+	inv(0, 2) = m(0, 1) * m(1, 2) - m(0, 2) * m(1, 1);
+	inv(1, 2) = m(0, 2) * m(1, 0) - m(0, 0) * m(1, 2);
+	inv(2, 2) = m(0, 0) * m(1, 1) - m(0, 1) * m(1, 0);
+
+	const float invDet = 1.f / (m(0, 0) * inv(0, 0) + m(0, 1) * inv(1, 0) + m(0, 2) * inv(2, 0));
+	for (int i = 0; i < 3; ++i)
+	{
+		for (int j = 0; j < 3; ++j)
+			inv(i, j) *= invDet;
+	}
+
+	const Vector3 translation = inv * Vector3(m(0, 3), m(1, 3), m(2, 3));
+	inv(0, 3) = -translation.x;
+	inv(1, 3) = -translation.y;
+	inv(2, 3) = -translation.z;
+	return inv;
 }
 
+// Column j of the product is A times column j of B, the sum starts at 0 like the scalar definition
 inline Matrix4 operator*(const Matrix4& A, const Matrix4& B)
 {
-	Matrix4 result;
-	for (int i = 0; i < 4; ++i)
+	alignas(16) float columns[4][4];
+	for (int j = 0; j < 4; ++j)
 	{
-		for (int j = 0; j < 4; ++j)
-		{
-			result(i, j) = 0;
-			for (int k = 0; k < 4; ++k)
-			{
-				result(i, j) += A(i, k) * B(k, j);
-			}
-		}
+		const __m128 b = B.column(j);
+		__m128 sum = _mm_setzero_ps();
+		sum = _mm_add_ps(sum, _mm_mul_ps(A.column(0), SimdMath::splat<0>(b)));
+		sum = _mm_add_ps(sum, _mm_mul_ps(A.column(1), SimdMath::splat<1>(b)));
+		sum = _mm_add_ps(sum, _mm_mul_ps(A.column(2), SimdMath::splat<2>(b)));
+		sum = _mm_add_ps(sum, _mm_mul_ps(A.column(3), SimdMath::splat<3>(b)));
+		_mm_store_ps(columns[j], sum);
 	}
-	return result;
+
+	return {
+		columns[0][0], columns[1][0], columns[2][0], columns[3][0],
+		columns[0][1], columns[1][1], columns[2][1], columns[3][1],
+		columns[0][2], columns[1][2], columns[2][2], columns[3][2],
+		columns[0][3], columns[1][3], columns[2][3], columns[3][3]
+	};
 }
 
 struct Range
@@ -575,22 +792,77 @@ struct Range
 	uint32_t count() const { return end - start; }
 };
 
-inline Vector3 randomInHemisphereCosine(const Vector3& normal, const Vector2& rnd)
+// Tangent and bitangent completing normal (unit length) to a right-handed orthonormal basis, without branches or
+// square roots (Duff et al., "Building an Orthonormal Basis, Revisited")
+inline void orthonormalBasis(const Vector3& normal, Vector3& tangent, Vector3& bitangent)
+{
+	const float sign = std::copysign(1.f, normal.z);
+	const float a = -1.f / (sign + normal.z);
+	const float b = normal.x * normal.y * a;
+	tangent = {1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+	bitangent = {b, sign + normal.y * normal.y * a, -normal.y};
+}
+
+// Sine and cosine of |x| <= pi/4 as Taylor polynomials, exact to float precision in that range and free of branches
+inline void sinCosQuarterPi(float x, float& sine, float& cosine)
 {
-	float theta = acos(sqrt(1.0f - rnd.x)); // Theta follows a cosine distribution
-	float phi = 2.0f * PI * rnd.y;
+	const float x2 = x * x;
+	sine = x * (1.f + x2 * (-1.f / 6.f + x2 * (1.f / 120.f + x2 * (-1.f / 5040.f + x2 * (1.f / 362880.f)))));
+	cosine = 1.f + x2 * (-0.5f + x2 * (1.f / 24.f + x2 * (-1.f / 720.f + x2 * (1.f / 40320.f))));
+}
+
+// Shirley and Chiu's concentric mapping of the unit square to the unit disk, it keeps strata compact. The two kinds of
+// wedges are blended arithmetically instead of branched on, selects between divisions stop compilers from
+// vectorizing the batch loop.
+inline Vector2 concentricSampleDisk(const Vector2& rnd)
+{
+	const float a = 2.f * rnd.x - 1.f;
+	const float b = 2.f * rnd.y - 1.f;
+	const float aMajor = std::abs(a) > std::abs(b) ? 1.f : 0.f;
+	const float radius = aMajor * a + (1.f - aMajor) * b;
+	const float minor = aMajor * b + (1.f - aMajor) * a;
+	// |minor| <= |radius|, so the clamped divisor only matters at the center where minor is 0 too
+	const float divisor = std::copysign(std::max(std::abs(radius), std::numeric_limits<float>::min()), radius);
+
+	float sine;
+	float cosine;
+	sinCosQuarterPi(PI / 4.f * minor / divisor, sine, cosine);
+	// In the wedges where |b| is the radius the angle is measured from the y axis, so sine and cosine swap
+	return {
+		radius * (aMajor * cosine + (1.f - aMajor) * sine),
+		radius * (aMajor * sine + (1.f - aMajor) * cosine)
+	};
+}
 
-	float x = sin(theta) * cos(phi);
-	float y = sin(theta) * sin(phi);
-	float z = cos(theta);
+// Cosine weighted direction about normal (unit length), pdf = Dot(normal, direction) / PI. Malley's method: a uniform
+// point on the disk lifted to the hemisphere.
+inline Vector3 randomInHemisphereCosine(const Vector3& normal, const Vector2& rnd)
+{
+	const Vector2 disk = concentricSampleDisk(rnd);
+	const float z = std::sqrt(std::max(0.f, 1.f - disk.x * disk.x - disk.y * disk.y));
 
-	Vector3 randomDirection(x, y, z);
+	Vector3 tangent;
+	Vector3 bitangent;
+	orthonormalBasis(normal, tangent, bitangent);
+	return tangent * disk.x + bitangent * disk.y + normal * z;
+}
 
-	// Ensure it's in the same hemisphere as the normal
-	if (Dot(randomDirection, normal) < 0.0f)
+// Batch variant for many directions about one normal. Takes and fills separate component arrays, the loop body has
+// no branches so it vectorizes (GCC and Clang also need -fno-math-errno for the square root).
+inline void randomInHemisphereCosine(const Vector3& normalRef, const float* rnd1, const float* rnd2, size_t count,
+                                     float* directionsX, float* directionsY, float* directionsZ)
+{
+	// A local copy, the stores could otherwise alias the normal and force reloads
+	const Vector3 normal = normalRef;
+	Vector3 tangent;
+	Vector3 bitangent;
+	orthonormalBasis(normal, tangent, bitangent);
+	for (size_t i = 0; i < count; ++i)
 	{
-		randomDirection = -randomDirection;
+		const Vector2 disk = concentricSampleDisk({rnd1[i], rnd2[i]});
+		const float z = std::sqrt(std::max(0.f, 1.f - disk.x * disk.x - disk.y * disk.y));
+		directionsX[i] = tangent.x * disk.x + bitangent.x * disk.y + normal.x * z;
+		directionsY[i] = tangent.y * disk.x + bitangent.y * disk.y + normal.y * z;
+		directionsZ[i] = tangent.z * disk.x + bitangent.z * disk.y + normal.z * z;
 	}
-
-	return randomDirection;
 }
@@ -0,0 +1,532 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "AABB.hpp"
+#include "BVH.hpp"
+#include "Kernels.hpp"
+#include "Math3D.hpp"
+#include "RayInterleaver.hpp"
+#include "VertexCompression.hpp"
+
+struct Triangle;
+
+// Shared vertex data of an object, its triangles only store indices into these arrays. A mesh is placed in the
+// scene by one or more instances and carries its own bottom-level BVH in object space.
+struct Mesh
+{
+	std::vector<Triangle> triangles;
+	BVH bvh;
+	std::vector<uint32_t> triangleReferences; // leaf order of a BVH with spatial splits, empty -> same as triangles
+
+	std::vector<Vector3> positions;
+	std::vector<Vector3> normals;
+	std::vector<Vector2> uvs; // empty -> constant (1, 1)
+
+	// Optional compressed shading attributes, they replace normals and uvs when present
+	std::vector<uint32_t> packedNormals;
+	std::vector<uint32_t> packedUVs;
+	VertexCompression::UVQuantization uvQuantization;
+
+	Vector3 normal(uint32_t vertexIndex) const
+	{
+		if (!packedNormals.empty())
+			return VertexCompression::decodeNormal(packedNormals[vertexIndex]);
+		return normals[vertexIndex];
+	}
+
+	bool hasUVs() const
+	{
+		return !uvs.empty() || !packedUVs.empty();
+	}
+
+	Vector2 uv(uint32_t vertexIndex) const
+	{
+		if (!packedUVs.empty())
+			return uvQuantization.decode(packedUVs[vertexIndex]);
+		return uvs[vertexIndex];
+	}
+
+	// Replaces the full-precision normals and uvs with the packed ones and reports the introduced error
+	VertexCompression::ErrorReport compressAttributes()
+	{
+		using namespace VertexCompression;
+
+		ErrorReport report;
+		report.vertexCount = normals.size();
+		report.originalBytes = normals.size() * sizeof(Vector3) + uvs.size() * sizeof(Vector2);
+
+		packedNormals.reserve(normals.size());
+		for (const auto& n : normals)
+		{
+			const uint32_t packed = encodeNormal(n);
+			const float errorDegrees = radToDeg(std::acos(std::clamp(Dot(n, decodeNormal(packed)), -1.f, 1.f)));
+			report.maxNormalErrorDegrees = std::max(report.maxNormalErrorDegrees, errorDegrees);
+			report.sumNormalErrorDegrees += errorDegrees;
+			packedNormals.push_back(packed);
+		}
+
+		if (!uvs.empty())
+		{
+			uvQuantization = UVQuantization(uvs);
+			packedUVs.reserve(uvs.size());
+			for (const auto& uv : uvs)
+			{
+				const uint32_t packed = uvQuantization.encode(uv);
+				const Vector2 decoded = uvQuantization.decode(packed);
+				report.maxUVError = std::max({
+					report.maxUVError, std::abs(decoded.x - uv.x), std::abs(decoded.y - uv.y)
+				});
+				packedUVs.push_back(packed);
+			}
+		}
+
+		report.compressedBytes = (packedNormals.size() + packedUVs.size()) * sizeof(uint32_t);
+
+		normals = {};
+		uvs = {};
+		return report;
+	}
+
+	// Object-space bounds, also before the BVH is built
+	AABB bounds() const
+	{
+		AABB result = bvh.bounds();
+		if (result.isValid())
+			return result;
+
+		for (const auto& position : positions)
+			result |= AABB(position, position);
+		return result;
+	}
+
+	// Replaces the positions of an animated mesh, the smooth normals are recomputed to follow them
+	void setPositions(std::vector<Vector3> newPositions);
+
+	// Builds the bottom-level BVH and reorders the triangles to match it
+	void buildBVH(const BVH::BuildSettings& settings);
+
+	// buildBVH down to ranges of a few thousand triangles, each gets its subtree when a ray first reaches it. Without
+	// spatial splits, the subtrees are quantized when quantize is set. The mesh must not move while it has stubs.
+	void buildLazyBVH(const BVH::BuildSettings& settings, bool quantize);
+
+	// Takes over the leaf references returned by BVH::build
+	void applyBVHReferences(std::vector<uint32_t> references);
+
+	// Spatial-split references keep their full triangle bounds, which is conservative
+	void refitBVH();
+
+	std::vector<AABB> triangleBounds() const;
+	BVH::ClipFunction triangleClipFunction() const;
+	std::vector<Vector3> triangleCentroids() const;
+
+	// Nearest triangle of the references [trianglesStart, trianglesEnd), kept when it is nearer than hitInfo
+	void closestHitInLeaf(Ray& ray, HitInfo& hitInfo, uint32_t trianglesStart, uint32_t trianglesEnd,
+	                      bool backFaceCull) const;
+	HitInfo closestHit(Ray& ray, bool backFaceCull) const;
+	// closestHit for interleaveTraversals, each leaf prefetches its triangles and then their vertices
+	TraversalTask closestHitInterleaved(Ray& ray, bool backFaceCull, HitInfo& hitInfo,
+	                                    TraversalContext& context) const;
+	// occluderIndex, when given, receives the triangle that blocked the ray
+	bool anyHit(Ray& ray, bool backFaceCull, uint32_t* occluderIndex = nullptr) const;
+};
+
+struct Triangle
+{
+	uint32_t indices[3];
+
+	const Vector3& position(const Mesh& mesh, uint32_t vertex) const
+	{
+		return mesh.positions[indices[vertex]];
+	}
+
+	// Unnormalized, its length is twice the area of the triangle
+	Vector3 crossEdges(const Mesh& mesh) const
+	{
+		const Vector3& a = position(mesh, 0);
+		return Cross(position(mesh, 1) - a, position(mesh, 2) - a);
+	}
+
+	Vector3 faceNormal(const Mesh& mesh) const
+	{
+		return Normalize(crossEdges(mesh));
+	}
+
+	Vector3 centroid(const Mesh& mesh) const
+	{
+		return (position(mesh, 0) + position(mesh, 1) + position(mesh, 2)) / 3.f;
+	}
+
+	float area(const Mesh& mesh) const
+	{
+		return crossEdges(mesh).magnitude() * 0.5f;
+	}
+
+	AABB bounds(const Mesh& mesh) const
+	{
+		const Vector3& a = position(mesh, 0);
+		const Vector3& b = position(mesh, 1);
+		const Vector3& c = position(mesh, 2);
+		return {min(a, min(b, c)), max(a, max(b, c))};
+	}
+
+	Vector3 getNormal(const Mesh& mesh, const Vector2& barycentrics) const
+	{
+		float w = 1.f - barycentrics.x - barycentrics.y;
+		return Normalize(mesh.normal(indices[1]) * barycentrics.x + mesh.normal(indices[2]) * barycentrics.y +
+			mesh.normal(indices[0]) * w);
+	}
+
+	Vector2 getUVs(const Mesh& mesh, const Vector2& barycentrics) const
+	{
+		if (!mesh.hasUVs())
+			return 1.f;
+
+		float w = 1.f - barycentrics.x - barycentrics.y;
+		return mesh.uv(indices[1]) * barycentrics.x + mesh.uv(indices[2]) * barycentrics.y + mesh.uv(indices[0]) * w;
+	}
+
+	// Change of the uvs along the object space offsets dPdx and dPdy in the plane of the triangle, the offsets are
+	// expressed in the edges by least squares
+	UVDifferentials getUVDifferentials(const Mesh& mesh, const Vector3& dPdx, const Vector3& dPdy) const
+	{
+		if (!mesh.hasUVs())
+			return {};
+
+		const Vector3 edge1 = position(mesh, 1) - position(mesh, 0);
+		const Vector3 edge2 = position(mesh, 2) - position(mesh, 0);
+		const float e11 = Dot(edge1, edge1);
+		const float e12 = Dot(edge1, edge2);
+		const float e22 = Dot(edge2, edge2);
+		const float determinant = e11 * e22 - e12 * e12;
+		if (determinant <= 0.f)
+			return {};
+
+		const Vector2 uvEdge1 = mesh.uv(indices[1]) - mesh.uv(indices[0]);
+		const Vector2 uvEdge2 = mesh.uv(indices[2]) - mesh.uv(indices[0]);
+		const auto uvOffset = [&](const Vector3& dP)
+		{
+			const float d1 = Dot(edge1, dP);
+			const float d2 = Dot(edge2, dP);
+			const float dBarycentric1 = (e22 * d1 - e12 * d2) / determinant;
+			const float dBarycentric2 = (e11 * d2 - e12 * d1) / determinant;
+			return uvEdge1 * dBarycentric1 + uvEdge2 * dBarycentric2;
+		};
+		return {uvOffset(dPdx), uvOffset(dPdy)};
+	}
+
+	// Bounds of the part of the triangle inside the box, the polygon is clipped against the six planes of the box
+	AABB clippedBounds(const Mesh& mesh, const AABB& box) const
+	{
+		// Every plane adds at most one vertex
+		Vector3 polygon[9];
+		Vector3 clipped[9];
+		uint32_t vertexCount = 3;
+		for (uint32_t vertex = 0; vertex < 3; ++vertex)
+			polygon[vertex] = position(mesh, vertex);
+
+		for (uint8_t axis = 0; axis < 3; ++axis)
+		{
+			for (bool isMax : {false, true})
+			{
+				const float plane = isMax ? box.maxPoint[axis] : box.minPoint[axis];
+				auto inside = [axis, isMax, plane](const Vector3& point)
+				{
+					return isMax ? point[axis] <= plane : point[axis] >= plane;
+				};
+
+				uint32_t clippedCount = 0;
+				for (uint32_t vertex = 0; vertex < vertexCount; ++vertex)
+				{
+					const Vector3& a = polygon[vertex];
+					const Vector3& b = polygon[(vertex + 1) % vertexCount];
+					if (inside(a))
+						clipped[clippedCount++] = a;
+					if (inside(a) != inside(b))
+						clipped[clippedCount++] = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+				}
+
+				vertexCount = clippedCount;
+				if (vertexCount == 0)
+					return {};
+				std::copy_n(clipped, vertexCount, polygon);
+			}
+		}
+
+		AABB bounds;
+		for (uint32_t vertex = 0; vertex < vertexCount; ++vertex)
+			bounds |= AABB(polygon[vertex], polygon[vertex]);
+		return bounds.intersection(box);
+	}
+
+	HitInfo intersect(const Mesh& mesh, const Ray& ray, bool backFaceCull) const
+	{
+		HitInfo info;
+
+		const Vector3& a = position(mesh, 0);
+		const Vector3& b = position(mesh, 1);
+		const Vector3& c = position(mesh, 2);
+
+		// The plane and edge tests only depend on signs, so the normal is normalized just for reported hits
+		Vector3 normal = Cross(b - a, c - a);
+
+		float dirDotNorm = Dot(ray.directionN, normal);
+		if (backFaceCull && dirDotNorm >= 0.f)
+			return info;
+
+		float t = Dot(a - ray.origin, normal) / dirDotNorm;
+		if (t < 0.f || t > ray.maxT)
+			return info;
+
+		Vector3 p = ray(t);
+
+		Vector3 edge0 = b - a;
+		Vector3 edge1 = c - b;
+		Vector3 edge2 = a - c;
+		Vector3 C0 = p - a;
+		Vector3 C1 = p - b;
+		Vector3 C2 = p - c;
+
+		if (Dot(normal, Cross(edge0, C0)) < 0.f)
+			return info;
+		if (Dot(normal, Cross(edge1, C1)) < 0.f)
+			return info;
+		if (Dot(normal, Cross(edge2, C2)) < 0.f)
+			return info;
+
+		// Calculate the barycentric coordinates
+		float triArea = Magnitude(normal); // area of the whole triangle
+		info.barycentrics.x = Magnitude(Cross(p - a, c - a)) / triArea;
+		info.barycentrics.y = Magnitude(Cross(b - a, p - a)) / triArea;
+
+		info.hit = true;
+		info.t = t;
+		info.point = p;
+		info.normal = normal / triArea;
+
+		return info;
+	}
+};
+
+inline void Mesh::setPositions(std::vector<Vector3> newPositions)
+{
+	positions = std::move(newPositions);
+
+	std::vector<Vector3> vertexNormals(positions.size(), Vector3(0.f));
+	for (const auto& triangle : triangles)
+	{
+		const Vector3 faceNormal = triangle.faceNormal(*this);
+		for (uint32_t vertexIndex : triangle.indices)
+			vertexNormals[vertexIndex] += faceNormal;
+	}
+
+	if (packedNormals.empty())
+	{
+		for (auto& vertexNormal : vertexNormals)
+			vertexNormal = Normalize(vertexNormal);
+		normals = std::move(vertexNormals);
+	}
+	else
+	{
+		for (size_t vertexIndex = 0; vertexIndex < vertexNormals.size(); ++vertexIndex)
+			packedNormals[vertexIndex] = VertexCompression::encodeNormal(Normalize(vertexNormals[vertexIndex]));
+	}
+}
+
+inline void Mesh::buildBVH(const BVH::BuildSettings& settings)
+{
+	applyBVHReferences(bvh.build(triangleBounds(), triangleCentroids(), settings, triangleClipFunction()));
+}
+
+inline void Mesh::buildLazyBVH(const BVH::BuildSettings& settings, bool quantize)
+{
+	// A 256th of the mesh per stub keeps the top levels a fraction of the full build, small meshes get a single stub
+	const uint32_t stubTriangleCount = std::max(4096u, static_cast<uint32_t>(triangles.size() / 256));
+	BVH::SubtreeBuilder buildSubtree = [this, settings, quantize](BVH& subtree, uint32_t trianglesStart,
+	                                                             uint32_t trianglesEnd, uint32_t depth)
+	{
+		std::vector<AABB> bounds;
+		std::vector<Vector3> centroids;
+		bounds.reserve(trianglesEnd - trianglesStart);
+		centroids.reserve(trianglesEnd - trianglesStart);
+		for (uint32_t triangleIndex = trianglesStart; triangleIndex < trianglesEnd; ++triangleIndex)
+		{
+			bounds.push_back(triangles[triangleIndex].bounds(*this));
+			centroids.push_back(triangles[triangleIndex].centroid(*this));
+		}
+
+		// The stub counts towards the depth limit like the levels above it
+		BVH::BuildSettings subtreeSettings = settings;
+		subtreeSettings.maxDepth = settings.maxDepth - std::min(settings.maxDepth, depth);
+		subtreeSettings.spatialSplits = false;
+		const std::vector<uint32_t> permutation = subtree.build(bounds, centroids, subtreeSettings);
+
+		// Only the triangles of the range move, rays reach the others through their own stubs
+		std::vector<Triangle> reordered;
+		reordered.reserve(permutation.size());
+		for (uint32_t index : permutation)
+			reordered.push_back(triangles[trianglesStart + index]);
+		std::ranges::copy(reordered, triangles.begin() + trianglesStart);
+		subtree.offsetPrimitives(trianglesStart);
+		if (quantize)
+			subtree.quantize();
+	};
+
+	triangleReferences.clear();
+	BVH::applyPermutation(triangles, bvh.buildLazy(triangleBounds(), triangleCentroids(), settings, stubTriangleCount,
+	                                               std::move(buildSubtree)));
+}
+
+inline BVH::ClipFunction Mesh::triangleClipFunction() const
+{
+	return [this](uint32_t triangleIndex, const AABB& box)
+	{
+		return triangles[triangleIndex].clippedBounds(*this, box);
+	};
+}
+
+inline void Mesh::applyBVHReferences(std::vector<uint32_t> references)
+{
+	if (references.size() == triangles.size())
+	{
+		BVH::applyPermutation(triangles, references);
+		triangleReferences.clear();
+		return;
+	}
+
+	// Order the triangles by their first reference, which keeps most of them in leaf order for locality
+	std::vector<uint32_t> order;
+	std::vector<uint32_t> newIndices(triangles.size(), std::numeric_limits<uint32_t>::max());
+	order.reserve(triangles.size());
+	for (uint32_t& triangleIndex : references)
+	{
+		if (newIndices[triangleIndex] == std::numeric_limits<uint32_t>::max())
+		{
+			newIndices[triangleIndex] = static_cast<uint32_t>(order.size());
+			order.push_back(triangleIndex);
+		}
+		triangleIndex = newIndices[triangleIndex];
+	}
+	BVH::applyPermutation(triangles, order);
+	triangleReferences = std::move(references);
+}
+
+inline void Mesh::refitBVH()
+{
+	if (triangleReferences.empty())
+	{
+		bvh.refit(triangleBounds());
+		return;
+	}
+
+	std::vector<AABB> referenceBounds;
+	referenceBounds.reserve(triangleReferences.size());
+	for (uint32_t triangleIndex : triangleReferences)
+		referenceBounds.push_back(triangles[triangleIndex].bounds(*this));
+	bvh.refit(referenceBounds);
+}
+
+inline std::vector<AABB> Mesh::triangleBounds() const
+{
+	std::vector<AABB> bounds;
+	bounds.reserve(triangles.size());
+	for (const auto& triangle : triangles)
+		bounds.push_back(triangle.bounds(*this));
+	return bounds;
+}
+
+inline std::vector<Vector3> Mesh::triangleCentroids() const
+{
+	std::vector<Vector3> centroids;
+	centroids.reserve(triangles.size());
+	for (const auto& triangle : triangles)
+		centroids.push_back(triangle.centroid(*this));
+	return centroids;
+}
+
+inline void Mesh::closestHitInLeaf(Ray& ray, HitInfo& hitInfo, uint32_t trianglesStart, uint32_t trianglesEnd,
+                                   bool backFaceCull) const
+{
+	// The kernel finds the nearest triangle of a leaf, the scalar test then fills in the details of its hit
+	const uint32_t reference = Kernels::active().closestTriangle(*this, ray, trianglesStart, trianglesEnd,
+	                                                             backFaceCull);
+	if (reference == Kernels::noTriangle)
+		return;
+
+	const uint32_t triangleIndex = triangleReferences.empty() ? reference : triangleReferences[reference];
+	HitInfo currHitInfo = triangles[triangleIndex].intersect(*this, ray, backFaceCull);
+	if (currHitInfo.hit && currHitInfo.t < hitInfo.t)
+	{
+		currHitInfo.triangleIndex = triangleIndex;
+		hitInfo = currHitInfo;
+		ray.maxT = hitInfo.t;
+	}
+}
+
+inline HitInfo Mesh::closestHit(Ray& ray, bool backFaceCull) const
+{
+	std::function closestHitFunc = [this, &ray, backFaceCull](HitInfo& hitInfo, uint32_t trianglesStart,
+	                                                          uint32_t trianglesEnd)
+	{
+		closestHitInLeaf(ray, hitInfo, trianglesStart, trianglesEnd, backFaceCull);
+		return false;
+	};
+	return bvh.traverse(ray, closestHitFunc);
+}
+
+inline TraversalTask Mesh::closestHitInterleaved(Ray& ray, bool backFaceCull, HitInfo& hitInfo,
+                                                 TraversalContext& context) const
+{
+	const auto closestHitFunc = [this, &ray, backFaceCull, &context](HitInfo& leafHitInfo, uint32_t trianglesStart,
+	                                                                 uint32_t trianglesEnd) -> TraversalTask
+	{
+		// Each level of indirection waits for the previous one: references, triangles, vertices
+		if (!triangleReferences.empty())
+		{
+			TraversalContext::prefetch(&triangleReferences[trianglesStart]);
+			TraversalContext::prefetch(&triangleReferences[trianglesEnd - 1]);
+			co_await context.suspend();
+		}
+
+		const auto triangleIndex = [this](uint32_t reference)
+		{
+			return triangleReferences.empty() ? reference : triangleReferences[reference];
+		};
+		for (uint32_t reference = trianglesStart; reference < trianglesEnd; ++reference)
+			TraversalContext::prefetch(&triangles[triangleIndex(reference)]);
+		co_await context.suspend();
+
+		for (uint32_t reference = trianglesStart; reference < trianglesEnd; ++reference)
+		{
+			for (uint32_t index : triangles[triangleIndex(reference)].indices)
+				TraversalContext::prefetch(&positions[index]);
+		}
+		co_await context.suspend();
+
+		closestHitInLeaf(ray, leafHitInfo, trianglesStart, trianglesEnd, backFaceCull);
+		co_return false;
+	};
+	co_return co_await bvh.traverseInterleaved(ray, hitInfo, closestHitFunc, context);
+}
+
+inline bool Mesh::anyHit(Ray& ray, bool backFaceCull, uint32_t* occluderIndex) const
+{
+	const auto anyTriangle = Kernels::active().anyTriangle;
+	std::function anyHitFunc = [this, &ray, backFaceCull, anyTriangle](HitInfo& hitInfo, uint32_t trianglesStart,
+	                                                                   uint32_t trianglesEnd)
+	{
+		const uint32_t reference = anyTriangle(*this, ray, trianglesStart, trianglesEnd, backFaceCull);
+		if (reference == Kernels::noTriangle)
+			return false;
+
+		hitInfo.hit = true;
+		hitInfo.triangleIndex = triangleReferences.empty() ? reference : triangleReferences[reference];
+		return true;
+	};
+	HitInfo hitInfo = bvh.traverse(ray, anyHitFunc);
+	if (hitInfo.hit && occluderIndex)
+		*occluderIndex = hitInfo.triangleIndex;
+	return hitInfo.hit;
+}
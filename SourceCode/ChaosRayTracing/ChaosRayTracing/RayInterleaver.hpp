@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <xmmintrin.h>
+
+// Interleaved traversal: the traversal of a ray is a coroutine that prefetches the node it needs next and suspends
+// before reading it. interleaveTraversals runs a batch of rays round robin, so while one ray waits for memory the
+// others work and the cache misses of the batch overlap. A traversal that enters a nested one, a mesh from a
+// top-level leaf, awaits it and the whole ray suspends with it.
+
+// Coroutine frames recycled per thread. Every ray starts a traversal and one more for each instance and leaf it
+// visits, which would otherwise be a heap allocation each.
+class TraversalFramePool
+{
+public:
+	~TraversalFramePool()
+	{
+		for (auto& frames : freeFrames)
+		{
+			for (void* frame : frames)
+				::operator delete(frame);
+		}
+	}
+
+	void* allocate(size_t size)
+	{
+		const size_t sizeClass = (size + granularity - 1) / granularity;
+		if (sizeClass >= sizeClassCount)
+			return ::operator new(size);
+		if (freeFrames[sizeClass].empty())
+			return ::operator new(sizeClass * granularity);
+
+		void* frame = freeFrames[sizeClass].back();
+		freeFrames[sizeClass].pop_back();
+		return frame;
+	}
+
+	void release(void* frame, size_t size)
+	{
+		const size_t sizeClass = (size + granularity - 1) / granularity;
+		if (sizeClass >= sizeClassCount)
+			::operator delete(frame);
+		else
+			freeFrames[sizeClass].push_back(frame);
+	}
+
+	static TraversalFramePool& local()
+	{
+		thread_local TraversalFramePool pool;
+		return pool;
+	}
+
+private:
+	static constexpr size_t granularity = 256;
+	static constexpr size_t sizeClassCount = 16;
+
+	std::vector<void*> freeFrames[sizeClassCount];
+};
+
+// Traversal coroutine, its result tells whether the traversal ended early like the hit functions of BVH::traverse
+class TraversalTask
+{
+public:
+	struct promise_type
+	{
+		bool result = false;
+		std::exception_ptr exception;
+		std::coroutine_handle<> continuation = std::noop_coroutine(); // the awaiting traversal, if nested
+
+		TraversalTask get_return_object()
+		{
+			return TraversalTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		// Continues the awaiting traversal, or returns to interleaveTraversals from the outermost one
+		auto final_suspend() noexcept
+		{
+			struct FinalAwaiter
+			{
+				bool await_ready() noexcept
+				{
+					return false;
+				}
+
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+				{
+					return handle.promise().continuation;
+				}
+
+				void await_resume() noexcept
+				{
+				}
+			};
+			return FinalAwaiter{};
+		}
+
+		void return_value(bool value)
+		{
+			result = value;
+		}
+
+		void unhandled_exception()
+		{
+			exception = std::current_exception();
+		}
+
+		static void* operator new(size_t size)
+		{
+			return TraversalFramePool::local().allocate(size);
+		}
+
+		static void operator delete(void* frame, size_t size)
+		{
+			TraversalFramePool::local().release(frame, size);
+		}
+	};
+
+	TraversalTask(TraversalTask&& other) noexcept : handle(std::exchange(other.handle, {}))
+	{
+	}
+
+	TraversalTask& operator=(TraversalTask&&) = delete;
+
+	~TraversalTask()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+	// co_await on a nested traversal runs it to its end and returns its result
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	bool await_resume() const
+	{
+		return result();
+	}
+
+	bool done() const
+	{
+		return handle.done();
+	}
+
+	bool result() const
+	{
+		if (handle.promise().exception)
+			std::rethrow_exception(handle.promise().exception);
+		return handle.promise().result;
+	}
+
+private:
+	template <typename StartFunction>
+	friend void interleaveTraversals(uint32_t rayCount, uint32_t width, StartFunction start);
+
+	explicit TraversalTask(std::coroutine_handle<promise_type> handle) : handle(handle)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+// State of one in-flight ray, passed to its traversal coroutines
+class TraversalContext
+{
+public:
+	// Requests the cache line at address, pair with co_await suspend() before the data is read
+	static void prefetch(const void* address)
+	{
+		_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+	}
+
+	// Lets the other rays of the batch run, the innermost suspended traversal is resumed later
+	auto suspend()
+	{
+		struct SuspendAwaiter
+		{
+			TraversalContext& context;
+
+			bool await_ready() const noexcept
+			{
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<> handle) noexcept
+			{
+				context.resumePoint = handle;
+			}
+
+			void await_resume() const noexcept
+			{
+			}
+		};
+		return SuspendAwaiter{*this};
+	}
+
+private:
+	template <typename StartFunction>
+	friend void interleaveTraversals(uint32_t rayCount, uint32_t width, StartFunction start);
+
+	std::optional<TraversalTask> task;
+	std::coroutine_handle<> resumePoint;
+};
+
+// Upper bound of the rays in flight, more only add misses of their own stacks
+constexpr uint32_t maxInterleavedRays = 32;
+
+// Traverses rayCount rays with up to width of them in flight. start(rayIndex, context) returns the traversal of a
+// ray, they are started in order and run until done.
+template <typename StartFunction>
+void interleaveTraversals(uint32_t rayCount, uint32_t width, StartFunction start)
+{
+	TraversalContext contexts[maxInterleavedRays];
+	const uint32_t slotCount = std::clamp(width, 1u, maxInterleavedRays);
+	uint32_t nextRay = 0;
+	uint32_t inFlight = 0;
+	const auto startNext = [&](TraversalContext& context)
+	{
+		context.task.emplace(start(nextRay++, context));
+		context.resumePoint = context.task->handle;
+		++inFlight;
+	};
+
+	for (uint32_t slot = 0; slot < slotCount && nextRay < rayCount; ++slot)
+		startNext(contexts[slot]);
+
+	while (inFlight > 0)
+	{
+		for (uint32_t slot = 0; slot < slotCount; ++slot)
+		{
+			TraversalContext& context = contexts[slot];
+			if (!context.task)
+				continue;
+
+			std::exchange(context.resumePoint, {}).resume();
+			if (!context.task->done())
+				continue;
+
+			context.task->result();
+			context.task.reset();
+			--inFlight;
+			if (nextRay < rayCount)
+				startNext(context);
+		}
+	}
+}
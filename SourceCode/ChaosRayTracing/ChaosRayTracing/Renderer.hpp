@@ -1,5 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
 #include <sstream>
 
 #include "PPMWriter.hpp"
@@ -11,12 +15,21 @@
 #include <utility>
 
 #include "Sampling.hpp"
+#include "VisibilityCache.hpp"
 
 class Renderer final
 {
 public:
-	Renderer(Scene& scene) : scene(scene)
+	// Called before every frame to move the geometry through Scene::setMeshPositions and Scene::setInstanceTransform
+	using AnimationFunction = std::function<void(Scene&, uint32_t frame)>;
+
+	Renderer(Scene& scene, AnimationFunction animation = {}) : scene(scene), animation(std::move(animation))
 	{
+		if (scene.settings.visibilityCacheCellSize > 0.f)
+		{
+			visibilityCache = std::make_unique<VisibilityCache>(scene.settings.visibilityCacheCellSize,
+			                                                    scene.settings.visibilityCacheMinSamples);
+		}
 	}
 
 	void renderImage()
@@ -26,6 +39,14 @@ public:
 		const uint32_t imageWidth = sceneSettings.imageSettings.width;
 		const uint32_t imageHeight = sceneSettings.imageSettings.height;
 
+		// Time to the first finished bucket, lazily built BVHs move work from scene loading into the first frame
+		const auto renderStart = std::chrono::high_resolution_clock::now();
+		std::atomic<bool> firstTileDone = false;
+
+		std::atomic<uint64_t> shadowRayCount = 0;
+		std::atomic<uint64_t> occludedCount = 0;
+		std::atomic<uint64_t> occluderCacheHitCount = 0;
+
 		for (uint32_t frame = 0; frame < frameCount; frame++)
 		{
 			// Set camera for the final scene
@@ -36,8 +57,21 @@ public:
 			Vector3 up(0.f, 1.f, 0.f);
 			scene.camera.transform = lookAtInverse(cameraPosition, center, up);
 
+			if (animation)
+			{
+				animation(scene, frame);
+				scene.updateAccelerationStructures();
+
+				// Cached visibility is only valid for the geometry it was traced against
+				if (visibilityCache)
+					visibilityCache->clear();
+			}
+
 			Image image(imageWidth, imageHeight);
 
+			std::atomic<uint64_t> pointLightQueryCount = 0;
+			std::atomic<uint64_t> visibilityCacheHitCount = 0;
+
 			ThreadPool threadPool;
 			std::vector<std::future<void>> results;
 			uint32_t bucketSize = sceneSettings.imageSettings.bucketSize;
@@ -49,34 +83,60 @@ public:
 					uint32_t endColumn = startColumn + bucketSize;
 					results.emplace_back(threadPool.Enqueue([&, startRow, endRow, startColumn, endColumn]
 					{
+						ShadowCache shadowCache(scene.lights.size() + 1);
+						std::vector<Ray> cameraRays;
+						std::vector<RayDifferentials> cameraRayDifferentials;
+						cameraRays.reserve(sampleCount);
+						cameraRayDifferentials.reserve(sampleCount);
 						for (uint32_t rowIdx = startRow; rowIdx < endRow; ++rowIdx)
 						{
 							for (uint32_t colIdx = startColumn; colIdx < endColumn; ++colIdx)
 							{
-								Vector3 color{0.f};
-
 								Sampling::RandomSampler randomSampler;
 
-								for (uint32_t sample = 0; sample < sampleCount; sample++)
-								{
-									float y = static_cast<float>(rowIdx) + randomSampler.next1D();
-									y /= static_cast<float>(imageHeight); // To NDC
-									y = 1.f - (2.f * y); // To screen space
-
-									float x = static_cast<float>(colIdx) + randomSampler.next1D();
-									x /= static_cast<float>(imageWidth); // To NDC
-									x = 2.f * x - 1.f; // To screen space
-									x *= static_cast<float>(imageWidth) / static_cast<float>(imageHeight);
-									// Consider aspect ratio
+								// All camera rays of the pixel first, so that they can traverse the scene together
+								cameraRays.clear();
+								cameraRayDifferentials.clear();
 
-									color += getPixel(x, y);
+								for (uint32_t sample = 0; sample < sampleCount; sample += Vector3x8::width)
+								{
+									float x[Vector3x8::width];
+									float y[Vector3x8::width];
+									for (uint32_t lane = 0; lane < Vector3x8::width; ++lane)
+									{
+										y[lane] = static_cast<float>(rowIdx) + randomSampler.next1D();
+										y[lane] /= static_cast<float>(imageHeight); // To NDC
+										y[lane] = 1.f - (2.f * y[lane]); // To screen space
+
+										x[lane] = static_cast<float>(colIdx) + randomSampler.next1D();
+										x[lane] /= static_cast<float>(imageWidth); // To NDC
+										x[lane] = 2.f * x[lane] - 1.f; // To screen space
+										x[lane] *= static_cast<float>(imageWidth) / static_cast<float>(imageHeight);
+										// Consider aspect ratio
+									}
+
+									addCameraRays(x, y, cameraRays, cameraRayDifferentials);
 								}
 
+								Vector3 color = traceCameraRays(cameraRays, cameraRayDifferentials, shadowCache);
 								color /= static_cast<float>(sampleCount);
 
 								image.setPixel(colIdx, rowIdx, color.toRGB());
 							}
 						}
+
+						shadowRayCount += shadowCache.rayCount;
+						occludedCount += shadowCache.occludedCount;
+						occluderCacheHitCount += shadowCache.hitCount;
+						pointLightQueryCount += shadowCache.pointLightQueryCount;
+						visibilityCacheHitCount += shadowCache.visibilityCacheHitCount;
+
+						if (!firstTileDone.exchange(true))
+						{
+							std::chrono::duration<double, std::milli> firstTileDuration =
+								std::chrono::high_resolution_clock::now() - renderStart;
+							std::cout << "First tile after " << firstTileDuration.count() << " ms." << std::endl;
+						}
 					}));
 				}
 			}
@@ -84,12 +144,201 @@ public:
 			for (auto&& result : results)
 				result.get();
 
+			if (frame == 0 && scene.settings.occluderCache && shadowRayCount > 0)
+			{
+				std::cout << "Shadow rays: " << shadowRayCount << ", " << 100.0 * occludedCount / shadowRayCount <<
+					"% occluded, " << 100.0 * occluderCacheHitCount / std::max<uint64_t>(occludedCount, 1) <<
+					"% of those answered by the occluder cache." << std::endl;
+			}
+
+			if (visibilityCache && pointLightQueryCount > 0)
+			{
+				std::cout << "Frame " << frame << ": " << 100.0 * visibilityCacheHitCount / pointLightQueryCount <<
+					"% of point light visibility queries answered by the visibility cache." << std::endl;
+			}
+
+			if (scene.textureCache)
+			{
+				for (const PagedTexture* pagedTexture : scene.textureCache->pagedTextures())
+				{
+					const PagedTexture::Statistics statistics = pagedTexture->statistics();
+					std::cout << "Frame " << frame << ", " << pagedTexture->sourcePath << ": " << statistics.hits <<
+						" page hits, " << statistics.misses << " misses, " << statistics.evictions << " evictions, " <<
+						statistics.residentPages * sizeof(PagedTexture::Page) / 1024 << " KiB resident." << std::endl;
+				}
+			}
+
 			writeToFile(image, sceneSettings, frame);
 		}
 	}
 
 private:
-	Vector3 getPixel(float x, float y)
+	// Last occluder per light and bounce when the occluder cache is enabled, the light after the point lights stands
+	// for all emissive samples. Each bucket has its own, so it is only used by one thread and neighbouring pixels are
+	// likely to hit the same occluders.
+	struct ShadowCache
+	{
+		std::vector<Scene::Occluder> occluders;
+		size_t lightCount;
+		uint64_t rayCount = 0;
+		uint64_t occludedCount = 0;
+		uint64_t hitCount = 0;
+		uint64_t pointLightQueryCount = 0;
+		uint64_t visibilityCacheHitCount = 0;
+
+		explicit ShadowCache(size_t lightCount) : occluders(lightCount * (maxDepth + 1)), lightCount(lightCount)
+		{
+		}
+	};
+
+	bool isOccluded(Ray& shadowRay, ShadowCache& shadowCache, size_t lightIndex, uint32_t depth) const
+	{
+		++shadowCache.rayCount;
+		if (!scene.settings.occluderCache)
+		{
+			const bool occluded = scene.anyHit(shadowRay);
+			shadowCache.occludedCount += occluded;
+			return occluded;
+		}
+
+		Scene::Occluder& occluder = shadowCache.occluders[depth * shadowCache.lightCount + lightIndex];
+		if (occluder.isValid() && scene.occludes(shadowRay, occluder))
+		{
+			++shadowCache.occludedCount;
+			++shadowCache.hitCount;
+			return true;
+		}
+
+		// A miss keeps the previous occluder, it may well block the next ray again
+		Scene::Occluder newOccluder;
+		if (!scene.anyHit(shadowRay, &newOccluder))
+			return false;
+
+		++shadowCache.occludedCount;
+		occluder = newOccluder;
+		return true;
+	}
+
+	// Point lights go through the visibility cache first when it is enabled. A fraction of the cached answers is traced
+	// anyway, a disagreeing ray turns a cell that settled on one side of a shadow boundary back into a traced one.
+	bool isPointLightVisible(const HitInfo& hitInfo, const Vector3& offsetOrigin, uint32_t lightIndex,
+	                         Sampling::RandomSampler& rnd, ShadowCache& shadowCache, uint32_t depth)
+	{
+		++shadowCache.pointLightQueryCount;
+		if (visibilityCache)
+		{
+			std::optional<bool> visible = visibilityCache->lookup(hitInfo.point, hitInfo.normal, lightIndex);
+			if (visible.has_value() && rnd.next1D() >= visibilityVerificationRate)
+			{
+				++shadowCache.visibilityCacheHitCount;
+				return *visible;
+			}
+		}
+
+		const Vector3 toLight = scene.lights[lightIndex].position - offsetOrigin;
+		const float distanceToLight = toLight.magnitude();
+		Ray shadowRay{offsetOrigin, toLight / distanceToLight, distanceToLight};
+		const bool visible = !isOccluded(shadowRay, shadowCache, lightIndex, depth);
+		if (visibilityCache)
+			visibilityCache->insert(hitInfo.point, hitInfo.normal, lightIndex, visible);
+		return visible;
+	}
+
+	// Resampled importance sampling of direct lighting: risCandidateCount cheap candidates are drawn from the point
+	// lights and the emissive sampler, one of them is picked in proportion to its unshadowed contribution over its
+	// source pdf and only that one gets a shadow ray. The cost per hit does not depend on the number of lights.
+	Vector3 sampleDirectLightingRIS(const HitInfo& hitInfo, const Vector3& normal, const Vector3& offsetOrigin,
+	                                const Vector3& albedo, Sampling::RandomSampler& rnd, ShadowCache& shadowCache,
+	                                uint32_t depth)
+	{
+		const size_t pointLightCount = scene.lights.size();
+		const bool hasEmissive = scene.emissiveSampler.size() > 0;
+		if (pointLightCount == 0 && !hasEmissive)
+			return Vector3{0.f};
+
+		// Point light candidates are discrete, emissive ones are measured in solid angle, the target and the source
+		// pdf of each candidate use the same measure so their ratio is well defined
+		const float pointLightProbability = !hasEmissive ? 1.f : pointLightCount == 0 ? 0.f : 0.5f;
+
+		struct Candidate
+		{
+			Vector3 position{0.f};
+			Vector3 contribution{0.f};
+			uint32_t pointLightIndex = std::numeric_limits<uint32_t>::max(); // emissive sample otherwise
+		};
+
+		const uint32_t candidateCount = scene.settings.risCandidateCount;
+		Candidate selected;
+		float selectedTarget = 0.f;
+		float weightSum = 0.f;
+		for (uint32_t i = 0; i < candidateCount; ++i)
+		{
+			Candidate candidate;
+			float sourcePdf;
+			if (rnd.next1D() < pointLightProbability)
+			{
+				const size_t lightIndex = std::min(static_cast<size_t>(rnd.next1D() * pointLightCount),
+				                                   pointLightCount - 1);
+				const auto& light = scene.lights[lightIndex];
+				const Vector3 toLight = light.position - offsetOrigin;
+				const float distSqr = Dot(toLight, toLight);
+				const float nDotL = std::max(0.f, Dot(normal, toLight / std::sqrt(distSqr)));
+				candidate.position = light.position;
+				candidate.contribution = albedo * nDotL * light.intensity / distSqr;
+				candidate.pointLightIndex = static_cast<uint32_t>(lightIndex);
+				sourcePdf = pointLightProbability / static_cast<float>(pointLightCount);
+			}
+			else
+			{
+				std::optional<EmissiveLightSample> lightSample = scene.emissiveSampler.sample(
+					offsetOrigin, hitInfo.normal, rnd.next3D());
+				if (!lightSample.has_value() || lightSample->pdf <= 0.f)
+					continue;
+
+				const float nDotL = std::max(0.f, Dot(normal, Normalize(lightSample->position - offsetOrigin)));
+				candidate.position = lightSample->position;
+				candidate.contribution = albedo / PI * nDotL * lightSample->Le;
+				sourcePdf = (1.f - pointLightProbability) * lightSample->pdf;
+			}
+
+			const float target = Luminance(candidate.contribution);
+			const float weight = target / sourcePdf;
+			if (weight <= 0.f)
+				continue;
+
+			weightSum += weight;
+			if (rnd.next1D() * weightSum < weight)
+			{
+				selected = candidate;
+				selectedTarget = target;
+			}
+		}
+
+		if (weightSum == 0.f)
+			return Vector3{0.f};
+
+		bool visible;
+		if (selected.pointLightIndex != std::numeric_limits<uint32_t>::max())
+		{
+			visible = isPointLightVisible(hitInfo, offsetOrigin, selected.pointLightIndex, rnd, shadowCache, depth);
+		}
+		else
+		{
+			const Vector3 toLight = selected.position - offsetOrigin;
+			const float distanceToLight = toLight.magnitude();
+			Ray shadowRay{offsetOrigin, toLight / distanceToLight, distanceToLight * (1.f - shadowRayEpsilon)};
+			visible = !isOccluded(shadowRay, shadowCache, scene.lights.size(), depth);
+		}
+
+		if (!visible)
+			return Vector3{0.f};
+		return selected.contribution * (weightSum / (static_cast<float>(candidateCount) * selectedTarget));
+	}
+
+	// Appends the camera rays through Vector3x8::width screen positions and their differentials. The camera basis is
+	// set up once for all of them and their directions are normalized together.
+	void addCameraRays(const float (&x)[Vector3x8::width], const float (&y)[Vector3x8::width], std::vector<Ray>& rays,
+	                   std::vector<RayDifferentials>& rayDifferentials)
 	{
 		Vector3 origin = scene.camera.getPosition();
 		Vector3 forward = scene.camera.getLookDirection();
@@ -98,14 +347,55 @@ private:
 		Vector3 up = Normalize(scene.camera.transform * Vector3(0.f, 1.f, 0.f));
 		Vector3 right = Cross(forward, up);
 
-		// Calculate direction to pixel in camera space
-		Vector3 direction = Normalize(forward + right * x + up * y);
+		// Calculate directions to the pixel samples in camera space
+		Vector3x8 directions(forward);
+		directions.addScaled(right, x).addScaled(up, y);
+		float invDistances[Vector3x8::width];
+		directions.normalize(invDistances);
 
-		Ray ray{origin, direction};
+		// A pixel step is 2 / height on the screen in both axes, x is scaled by the aspect ratio. The samples of a
+		// pixel already average over it, so each one tracks a proportionally smaller footprint, down to 1/8 pixel.
+		// Only the part of the step across the direction turns it.
+		float pixelStep = 2.f / static_cast<float>(scene.settings.imageSettings.height) *
+			std::max(0.125f, 1.f / std::sqrt(static_cast<float>(sampleCount)));
 
+		for (uint32_t lane = 0; lane < Vector3x8::width; ++lane)
+		{
+			const Vector3 direction = directions[lane];
+			rays.emplace_back(origin, direction);
+			RayDifferentials& differentials = rayDifferentials.emplace_back();
+			differentials.dDdx = (right - direction * Dot(direction, right)) * (pixelStep * invDistances[lane]);
+			differentials.dDdy = (up - direction * Dot(direction, up)) * (pixelStep * invDistances[lane]);
+			differentials.valid = true;
+		}
+	}
+
+	// Sum of the radiance along the camera rays. With settings.interleavedRayCount they first traverse the scene
+	// together through Scene::closestHits, up to that many at once, and are shaded afterwards. A wider setting than
+	// the rays of a pixel puts no more of them in flight.
+	Vector3 traceCameraRays(std::vector<Ray>& rays, const std::vector<RayDifferentials>& rayDifferentials,
+	                        ShadowCache& shadowCache)
+	{
 		Sampling::RandomSampler randomSampler;
-		Vector3 L = traceRay(ray, {}, randomSampler, 0);
+		Vector3 L{0.f};
+		const auto rayCount = static_cast<uint32_t>(rays.size());
+		if (scene.settings.interleavedRayCount == 0)
+		{
+			for (uint32_t rayIndex = 0; rayIndex < rayCount; ++rayIndex)
+				L += traceRay(rays[rayIndex], rayDifferentials[rayIndex], {}, randomSampler, shadowCache, 0);
+			return L;
+		}
 
+		// Reused, one per thread
+		thread_local std::vector<HitInfo> hitInfos;
+		hitInfos.resize(rayCount);
+		const uint32_t width = std::min(scene.settings.interleavedRayCount, rayCount);
+		scene.closestHits(rays.data(), hitInfos.data(), rayCount, width);
+		for (uint32_t rayIndex = 0; rayIndex < rayCount; ++rayIndex)
+		{
+			L += traceRay(rays[rayIndex], rayDifferentials[rayIndex], {}, randomSampler, shadowCache, 0,
+			              &hitInfos[rayIndex]);
+		}
 		return L;
 	}
 
@@ -113,65 +403,90 @@ private:
 	{
 		bool lightSampledByNEE = false;
 		float bsdfPdf = 1.f;
+		Vector3 normal{0.f}; // the light sampler's pdf depends on the normal of the surface it sampled from
 	};
 
-	Vector3 traceRay(Ray& ray, PrevBounceInfo prevBounceInfo, Sampling::RandomSampler& rnd, uint32_t depth)
+	// knownHit is the closest hit of ray when it was traced already, by an interleaved batch
+	Vector3 traceRay(Ray& ray, const RayDifferentials& rayDifferentials, PrevBounceInfo prevBounceInfo,
+	                 Sampling::RandomSampler& rnd, ShadowCache& shadowCache, uint32_t depth,
+	                 const HitInfo* knownHit = nullptr)
 	{
 		Vector3 L{0.f};
 		if (depth > maxDepth)
 			return L;
 
-		HitInfo hitInfo = scene.closestHit(ray);
+		HitInfo hitInfo = knownHit ? *knownHit : scene.closestHit(ray);
 		if (hitInfo.hit)
 		{
 			const auto& material = scene.materials[hitInfo.materialIndex];
 			Vector3 normal = hitInfo.normal;
-			const auto& triangle = scene.triangles[hitInfo.triangleIndex];
+			const auto& instance = scene.instances[hitInfo.instanceIndex];
+			const auto& mesh = scene.meshes[instance.meshIndex];
+			const auto& triangle = mesh.triangles[hitInfo.triangleIndex];
 
 			if (material.smoothShading)
-				normal = triangle.getNormal(hitInfo.barycentrics);
+				normal = instance.normalToWorld(triangle.getNormal(mesh, hitInfo.barycentrics));
+
+			// Footprint of the pixel on the surface and in texture space, only textures look at the latter
+			RayDifferentials surfaceDifferentials = rayDifferentials.transfer(ray.directionN, hitInfo.t,
+			                                                                  hitInfo.normal);
+			UVDifferentials uvDifferentials;
+			if (material.texture && surfaceDifferentials.valid)
+			{
+				uvDifferentials = triangle.getUVDifferentials(mesh, instance.vectorToObject(surfaceDifferentials.dOdx),
+				                                              instance.vectorToObject(surfaceDifferentials.dOdy));
+			}
 
 			Vector3 offsetOrigin = OffsetRayOrigin(hitInfo.point, hitInfo.normal);
 			if (material.type == Material::Type::DIFFUSE || material.type == Material::Type::CONSTANT)
 			{
-				Vector3 albedo = material.getAlbedo(hitInfo.barycentrics, triangle.getUVs(hitInfo.barycentrics));
+				Vector3 albedo = material.getAlbedo(hitInfo.barycentrics, triangle.getUVs(mesh, hitInfo.barycentrics),
+				                                    uvDifferentials);
 				Vector3 bsdf = albedo / PI;
 
-				// Iterate over explicit lights
-				for (const auto& light : scene.lights)
+				if (scene.settings.risCandidateCount > 0)
+				{
+					L += sampleDirectLightingRIS(hitInfo, normal, offsetOrigin, albedo, rnd, shadowCache, depth);
+				}
+				else
 				{
-					Vector3 dirToLight = Normalize(light.position - offsetOrigin);
-					float distanceToLight = (light.position - offsetOrigin).magnitude();
-					Ray shadowRay{ offsetOrigin, dirToLight, distanceToLight};
-					if (!scene.anyHit(shadowRay))
+					// Iterate over explicit lights
+					for (uint32_t lightIndex = 0; lightIndex < scene.lights.size(); ++lightIndex)
 					{
-						float attenuation = 1.0f / (distanceToLight * distanceToLight);
-						float nDotL = std::max(0.f, Dot(normal, dirToLight));
-						L += albedo * nDotL * attenuation * light.intensity;
+						const auto& light = scene.lights[lightIndex];
+						Vector3 dirToLight = Normalize(light.position - offsetOrigin);
+						float distanceToLight = (light.position - offsetOrigin).magnitude();
+						if (isPointLightVisible(hitInfo, offsetOrigin, lightIndex, rnd, shadowCache, depth))
+						{
+							float attenuation = 1.0f / (distanceToLight * distanceToLight);
+							float nDotL = std::max(0.f, Dot(normal, dirToLight));
+							L += albedo * nDotL * attenuation * light.intensity;
+						}
 					}
-				}
 
-				// Sample emissive geometry
-				std::optional<EmissiveLightSample> lightSampleOpt = scene.emissiveSampler.sample(
-					offsetOrigin, rnd.next3D());
-				if (lightSampleOpt.has_value())
-				{
-					EmissiveLightSample lightSample = lightSampleOpt.value();
-					Vector3 dirToLight = Normalize(lightSample.position - offsetOrigin);
-					float distanceToLight = (lightSample.position - offsetOrigin).magnitude();
-					Ray shadowRay{offsetOrigin, dirToLight, distanceToLight};
-					if (!scene.anyHit(shadowRay))
+					// Sample emissive geometry
+					std::optional<EmissiveLightSample> lightSampleOpt = scene.emissiveSampler.sample(
+						offsetOrigin, hitInfo.normal, rnd.next3D());
+					// Zero pdf samples face away, no need to trace them
+					if (lightSampleOpt.has_value() && lightSampleOpt->pdf > 0.f)
 					{
-						float nDotL = std::max(0.f, Dot(normal, dirToLight));
+						EmissiveLightSample lightSample = lightSampleOpt.value();
+						Vector3 dirToLight = Normalize(lightSample.position - offsetOrigin);
+						float distanceToLight = (lightSample.position - offsetOrigin).magnitude();
+						// Stop short of the sampled point, otherwise the light blocks its own sample
+						Ray shadowRay{offsetOrigin, dirToLight, distanceToLight * (1.f - shadowRayEpsilon)};
+						if (!isOccluded(shadowRay, shadowCache, scene.lights.size(), depth))
+						{
+							float nDotL = std::max(0.f, Dot(normal, dirToLight));
 
-						float lightPdf = lightSample.pdf;
-						float bsdfPdf = std::max(0.f, Dot(hitInfo.normal, dirToLight)) / PI;
+							float lightPdf = lightSample.pdf;
+							float bsdfPdf = std::max(0.f, Dot(hitInfo.normal, dirToLight)) / PI;
 
-						// Multiple importance sampling (MIS) weight
-						float misWeight = Sampling::powerHeuristic(lightPdf, bsdfPdf);
+							// Multiple importance sampling (MIS) weight
+							float misWeight = Sampling::powerHeuristic(lightPdf, bsdfPdf);
 
-						if (lightPdf > 0.f)
 							L += misWeight * bsdf * nDotL * lightSample.Le / lightPdf;
+						}
 					}
 				}
 
@@ -180,7 +495,9 @@ private:
 
 				float pdf = std::max(0.f, Dot(hitInfo.normal, randomDirection)) / PI;
 
-				Vector3 indirectLighting = traceRay(nextRay, { true, pdf }, rnd, depth + 1);
+				// A random direction has no footprint to track, lookups after the bounce use the finest texture level
+				Vector3 indirectLighting = traceRay(nextRay, {}, {true, pdf, hitInfo.normal}, rnd, shadowCache,
+				                                    depth + 1);
 				float nDotL = std::max(0.f, Dot(normal, randomDirection));
 
 				if (pdf > 0.f)
@@ -189,10 +506,16 @@ private:
 			else if (material.type == Material::Type::EMISSIVE)
 			{
 				float misWeight = 1.f;
-				if (prevBounceInfo.lightSampledByNEE)
+				if (prevBounceInfo.lightSampledByNEE && scene.settings.risCandidateCount > 0)
+				{
+					// RIS is not combined with BSDF sampling, the direct light estimate already covers all emitters
+					misWeight = 0.f;
+				}
+				else if (prevBounceInfo.lightSampledByNEE)
 				{
-					assert(triangle.emissiveIndex != -1);
-					float lightPdf = scene.emissiveSampler.evalPdf(triangle.emissiveIndex, ray.origin, hitInfo.point);
+					assert(instance.emissiveOffset != -1);
+					float lightPdf = scene.emissiveSampler.evalPdf(instance.emissiveOffset + hitInfo.triangleIndex,
+					                                               ray.origin, prevBounceInfo.normal, hitInfo.point);
 					misWeight = Sampling::powerHeuristic(prevBounceInfo.bsdfPdf, lightPdf);
 				}
 				L += material.emission * misWeight;
@@ -201,12 +524,15 @@ private:
 			{
 				Vector3 reflectionDir = Normalize(ray.directionN - normal * 2.f * Dot(normal, ray.directionN));
 				Ray reflectionRay{offsetOrigin, reflectionDir};
-				Vector3 albedo = material.getAlbedo(hitInfo.barycentrics, triangle.getUVs(hitInfo.barycentrics));
-				L += albedo * traceRay(reflectionRay, {}, rnd, depth + 1);
+				Vector3 albedo = material.getAlbedo(hitInfo.barycentrics, triangle.getUVs(mesh, hitInfo.barycentrics),
+				                                    uvDifferentials);
+				L += albedo * traceRay(reflectionRay, surfaceDifferentials.reflect(normal), {}, rnd, shadowCache,
+				                       depth + 1);
 			}
 			else if (material.type == Material::Type::REFRACTIVE)
 			{
-				Vector3 albedo = material.getAlbedo(hitInfo.barycentrics, triangle.getUVs(hitInfo.barycentrics));
+				Vector3 albedo = material.getAlbedo(hitInfo.barycentrics, triangle.getUVs(mesh, hitInfo.barycentrics),
+				                                    uvDifferentials);
 				float eta = material.ior;
 				Vector3 wi = -ray.directionN;
 				float cosThetaI = Dot(normal, wi);
@@ -225,7 +551,8 @@ private:
 					// Total internal reflection case
 					Vector3 reflectionDir = Normalize(ray.directionN - normal * 2.f * Dot(normal, ray.directionN));
 					Ray reflectionRay{offsetOrigin, reflectionDir};
-					L += albedo * traceRay(reflectionRay, {}, rnd, depth + 1);
+					L += albedo * traceRay(reflectionRay, surfaceDifferentials.reflect(normal), {}, rnd, shadowCache,
+					                       depth + 1);
 				}
 				else
 				{
@@ -236,7 +563,10 @@ private:
 						                                                 ? hitInfo.normal
 						                                                 : -hitInfo.normal);
 					Ray refractionRay{offsetOriginRefraction, wt};
-					Vector3 refractionL = albedo * traceRay(refractionRay, {}, rnd, depth + 1);
+					RayDifferentials refractionDifferentials =
+						surfaceDifferentials.refract(normal, 1.f / eta, cosThetaI, cosThetaT);
+					Vector3 refractionL = albedo * traceRay(refractionRay, refractionDifferentials, {}, rnd,
+					                                        shadowCache, depth + 1);
 
 					Vector3 reflectionDir = Normalize(ray.directionN - normal * 2.f * Dot(normal, ray.directionN));
 					Vector3 offsetOriginReflection = OffsetRayOrigin(hitInfo.point,
@@ -244,7 +574,8 @@ private:
 						                                                 ? -hitInfo.normal
 						                                                 : hitInfo.normal);
 					Ray reflectionRay{offsetOriginReflection, reflectionDir};
-					Vector3 reflectionL = albedo * traceRay(reflectionRay, {}, rnd, depth + 1);
+					Vector3 reflectionL = albedo * traceRay(reflectionRay, surfaceDifferentials.reflect(normal), {},
+					                                        rnd, shadowCache, depth + 1);
 
 					float fresnel = 0.5f * std::powf(1.f + Dot(ray.directionN, normal), 5);
 
@@ -263,9 +594,14 @@ private:
 	static void writeToFile(const Image& image, const Scene::Settings& sceneSettings, uint32_t frame);
 
 	static constexpr uint32_t maxDepth = 5;
+	static constexpr float shadowRayEpsilon = 1e-3f;
+	static constexpr float visibilityVerificationRate = 0.125f;
 	static constexpr uint32_t maxColorComponent = 255;
 	static constexpr uint32_t sampleCount = 256;
+	static_assert(sampleCount % Vector3x8::width == 0, "samples are traced in batches of Vector3x8::width");
 	static constexpr uint32_t frameCount = 144;
 
 	Scene& scene;
+	AnimationFunction animation;
+	std::unique_ptr<VisibilityCache> visibilityCache; // shared by all buckets and frames, null when disabled
 };
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "Math3D.hpp"
+
+// Throughput and variance of cosine hemisphere sampling. The sampler replaced by Malley's method is kept here as the
+// reference: it drew directions about +Z with acos, sqrt, sin and cos and flipped them into the hemisphere of the
+// normal, so its pdf is |z| / PI instead of the cosine to the normal. The variance is that of the irradiance from a
+// spherical light of radiance 1 and half-angle 25 degrees, 50 degrees off random normals, with 16 samples per
+// estimate. Returns whether the batch directions match the scalar ones up to rounding.
+inline bool runSamplingBenchmark()
+{
+	constexpr size_t sampleCount = size_t{1} << 16;
+	constexpr uint32_t repetitions = 20;
+	constexpr uint32_t estimateCount = 20000;
+	constexpr uint32_t samplesPerEstimate = 16;
+
+	const auto previousSampler = [](const Vector3& normal, const Vector2& rnd)
+	{
+		const float theta = std::acos(std::sqrt(1.f - rnd.x));
+		const float phi = 2.f * PI * rnd.y;
+		const Vector3 direction(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta));
+		return Dot(direction, normal) < 0.f ? -direction : direction;
+	};
+
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<float> distribution(0.f, 1.f);
+	std::vector<float> rnd1(sampleCount);
+	std::vector<float> rnd2(sampleCount);
+	for (size_t i = 0; i < sampleCount; ++i)
+	{
+		rnd1[i] = distribution(generator);
+		rnd2[i] = distribution(generator);
+	}
+
+	const Vector3 normal = Normalize(Vector3(0.3f, 0.5f, -0.8f));
+	std::vector<float> directionsX(sampleCount);
+	std::vector<float> directionsY(sampleCount);
+	std::vector<float> directionsZ(sampleCount);
+	const auto measure = [&](const char* sampler, const auto& sample)
+	{
+		double bestNanoseconds = std::numeric_limits<double>::max();
+		for (uint32_t repetition = 0; repetition < repetitions; ++repetition)
+		{
+			const auto start = std::chrono::high_resolution_clock::now();
+			sample();
+			const std::chrono::duration<double, std::nano> duration = std::chrono::high_resolution_clock::now() - start;
+			bestNanoseconds = std::min(bestNanoseconds, duration.count() / static_cast<double>(sampleCount));
+		}
+
+		float checksum = 0.f;
+		for (size_t i = 0; i < sampleCount; ++i)
+			checksum += directionsX[i] + directionsY[i] + directionsZ[i];
+		std::cout << sampler << " sampler: " << bestNanoseconds << " ns per direction (checksum " << checksum << ")"
+			<< std::endl;
+	};
+	const auto measureScalar = [&](const char* sampler, const auto& sampleDirection)
+	{
+		measure(sampler, [&]
+		{
+			for (size_t i = 0; i < sampleCount; ++i)
+			{
+				const Vector3 direction = sampleDirection(normal, Vector2(rnd1[i], rnd2[i]));
+				directionsX[i] = direction.x;
+				directionsY[i] = direction.y;
+				directionsZ[i] = direction.z;
+			}
+		});
+	};
+
+	measureScalar("previous", previousSampler);
+	measureScalar("scalar Malley", [](const Vector3& sampleNormal, const Vector2& rnd)
+	{
+		return randomInHemisphereCosine(sampleNormal, rnd);
+	});
+	measure("batch Malley", [&]
+	{
+		randomInHemisphereCosine(normal, rnd1.data(), rnd2.data(), sampleCount, directionsX.data(),
+		                         directionsY.data(), directionsZ.data());
+	});
+
+	float maxDifference = 0.f;
+	for (size_t i = 0; i < sampleCount; ++i)
+	{
+		const Vector3 direction = randomInHemisphereCosine(normal, Vector2(rnd1[i], rnd2[i]));
+		maxDifference = std::max({
+			maxDifference, std::abs(direction.x - directionsX[i]), std::abs(direction.y - directionsY[i]),
+			std::abs(direction.z - directionsZ[i])
+		});
+	}
+	constexpr float tolerance = 1e-5f;
+	std::cout << "batch against scalar directions: " << maxDifference << " max difference" << std::endl;
+
+	const float lightAngle = degToRad(25.f);
+	const float lightElevation = degToRad(50.f);
+	const double exactIrradiance = PI * std::pow(std::sin(lightAngle), 2.f) * std::cos(lightElevation);
+	for (bool malley : {false, true})
+	{
+		double sum = 0.0;
+		double squaredSum = 0.0;
+		for (uint32_t estimate = 0; estimate < estimateCount; ++estimate)
+		{
+			const Vector3 randomNormal = Normalize(Vector3(distribution(generator) * 2.f - 1.f,
+			                                               distribution(generator) * 2.f - 1.f,
+			                                               distribution(generator) * 2.f - 1.f));
+			Vector3 tangent;
+			Vector3 bitangent;
+			orthonormalBasis(randomNormal, tangent, bitangent);
+			const Vector3 toLight = randomNormal * std::cos(lightElevation) + tangent * std::sin(lightElevation);
+
+			double irradiance = 0.0;
+			for (uint32_t sample = 0; sample < samplesPerEstimate; ++sample)
+			{
+				const Vector2 rnd(distribution(generator), distribution(generator));
+				const Vector3 direction = malley ? randomInHemisphereCosine(randomNormal, rnd)
+					                          : previousSampler(randomNormal, rnd);
+				const float cosine = Dot(direction, randomNormal);
+				const float pdf = (malley ? cosine : std::abs(direction.z)) / PI;
+				if (pdf > 0.f && Dot(direction, toLight) > std::cos(lightAngle))
+					irradiance += cosine / pdf;
+			}
+			irradiance /= samplesPerEstimate;
+			sum += irradiance;
+			squaredSum += irradiance * irradiance;
+		}
+
+		const double mean = sum / estimateCount;
+		const double variance = squaredSum / estimateCount - mean * mean;
+		std::cout << (malley ? "Malley" : "previous") << " sampler irradiance: mean " << mean << " (exact "
+			<< exactIrradiance << "), variance " << variance << std::endl;
+	}
+
+	return maxDifference <= tolerance;
+}
@@ -2,16 +2,27 @@
 
 #include "Camera.hpp"
 #include "BVH.hpp"
+#include "BVHCache.hpp"
+#include "Instance.hpp"
 #include "Material.hpp"
+#include "Mesh.hpp"
 #include "SceneParser.hpp"
+#include "TextureCache.hpp"
 #include "Light.hpp"
 #include "EmissiveSampler.hpp"
+#include "ThreadPool.hpp"
 
 #include <vector>
 #include <algorithm>
 #include <map>
 #include <optional>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 
 class Scene final
 {
@@ -19,22 +30,35 @@ public:
 
     Scene(const std::string& fileName)
     {
+        auto parseStart = std::chrono::high_resolution_clock::now();
         SceneParser sceneParser(*this);
         sceneParser.parseSceneFile(fileName);
-        std::cout << fileName << " parsed.\n";
-        bvh = BVH(triangles);
-        std::cout << fileName << " BVH built.\n";
+        std::chrono::duration<double, std::milli> parseDuration =
+            std::chrono::high_resolution_clock::now() - parseStart;
+        std::cout << fileName << " parsed in " << parseDuration.count() << " ms.\n";
+        auto buildStart = std::chrono::high_resolution_clock::now();
+        buildAccelerationStructures();
+        std::chrono::duration<double, std::milli> buildDuration =
+            std::chrono::high_resolution_clock::now() - buildStart;
+        std::cout << fileName << (settings.lazyBVH ? " BVH top levels built in " : " BVH built in ") <<
+            buildDuration.count() << " ms.\n";
+        registerEmissiveInstances();
     }
 
     Scene(Scene&& other) noexcept
         : camera(std::move(other.camera)),
-        triangles(std::move(other.triangles)),
+        meshes(std::move(other.meshes)),
+        instances(std::move(other.instances)),
         bvh(std::move(other.bvh)),
+        instanceOrder(std::move(other.instanceOrder)),
         materials(std::move(other.materials)),
         textures(std::move(other.textures)),
+        textureCache(std::move(other.textureCache)),
         lights(std::move(other.lights)),
         emissiveSampler(std::move(other.emissiveSampler)),
-        settings(std::move(other.settings))
+        settings(std::move(other.settings)),
+        animatedMeshes(std::move(other.animatedMeshes)),
+        instancesMoved(other.instancesMoved)
     {
     }
 
@@ -43,13 +67,18 @@ public:
         if (this != &other)
         {
             camera = std::move(other.camera);
-            triangles = std::move(other.triangles);
+            meshes = std::move(other.meshes);
+            instances = std::move(other.instances);
             bvh = std::move(other.bvh);
+            instanceOrder = std::move(other.instanceOrder);
             materials = std::move(other.materials);
             textures = std::move(other.textures);
+            textureCache = std::move(other.textureCache);
             lights = std::move(other.lights);
             emissiveSampler = std::move(other.emissiveSampler);
             settings = std::move(other.settings);
+            animatedMeshes = std::move(other.animatedMeshes);
+            instancesMoved = other.instancesMoved;
         }
         return *this;
     }
@@ -69,25 +98,354 @@ public:
         std::string sceneName;
         Vector3 backgroundColor;
         ImageSettings imageSettings;
+        BVH::BuildSettings bvhSettings;
+        std::string bvhCacheDirectory = "bvh_cache"; // empty -> caching disabled
+        bool bvhQuantizedNodes = false; // mesh BVHs use QuantizedBVHNode
+        bool lazyBVH = false; // mesh BVHs build their top levels up front, their subtrees when a ray reaches them
+        bool compressVertexAttributes = false;
+        bool tiledTextures = false; // bitmap textures in 4x4 Morton ordered blocks instead of rows
+        bool compressedTextures = false; // bitmap textures in memory as BC1 blocks, 0.5 bytes per texel, lossy
+        std::string textureCacheDirectory; // empty -> bitmap textures are decoded into memory whole
+        uint64_t textureCacheMemoryBudget = uint64_t{256} << 20; // bytes of texture pages kept in memory
+        uint32_t risCandidateCount = 0; // 0 -> every point light and one emissive sample get a shadow ray
+        bool lightBVH = true; // emissive triangles are sampled by their estimated contribution instead of power only
+        bool sphericalTriangleSampling = false; // emissive points uniform in solid angle instead of area
+        float visibilityCacheCellSize = 0.f; // 0 -> point light shadow rays are always traced
+        uint32_t visibilityCacheMinSamples = 8;
+        bool occluderCache = false; // shadow rays first test the triangle that blocked the previous one
+        // Camera rays in flight at once when the 256 rays of a pixel traverse the scene together through closestHits,
+        // larger values act like 256. 0 -> one ray at a time.
+        uint32_t interleavedRayCount = 0;
+        float bvhRebuildCostGrowth = 1.5f; // refitted BVHs whose SAH cost grew more are rebuilt
     };
 
+    // Scene made in code instead of parsed from a file, e.g. by a benchmark
+    Scene(Settings settings, std::vector<Mesh> meshes, std::vector<Instance> instances,
+          std::vector<Material> materials)
+        : meshes(std::move(meshes)),
+        instances(std::move(instances)),
+        materials(std::move(materials)),
+        settings(std::move(settings))
+    {
+        buildAccelerationStructures();
+        registerEmissiveInstances();
+    }
 
     HitInfo closestHit(Ray& ray) const
     {
-        return bvh.closestHit(triangles, materials, ray);
+        std::function closestHitFunc = [this, &ray](HitInfo& hitInfo, uint32_t instancesStart, uint32_t instancesEnd)
+        {
+            for (uint32_t leafIndex = instancesStart; leafIndex < instancesEnd; ++leafIndex)
+            {
+                const uint32_t instanceIndex = instanceOrder[leafIndex];
+                const auto& instance = instances[instanceIndex];
+                const auto& material = materials[instance.materialIndex];
+
+                Ray objectRay = instance.rayToObject(ray);
+                keepNearerHit(ray, hitInfo, meshes[instance.meshIndex].closestHit(objectRay, material.cullBackFace()),
+                              instanceIndex);
+            }
+            return false;
+        };
+        return bvh.traverse(ray, closestHitFunc);
+    }
+
+    // closestHit for rayCount rays, with up to width of them in flight at once through interleaveTraversals. Pays
+    // off when the scene is much larger than the caches and single rays mostly wait for memory.
+    void closestHits(Ray* rays, HitInfo* hitInfos, uint32_t rayCount, uint32_t width) const
+    {
+        interleaveTraversals(rayCount, width, [this, rays, hitInfos](uint32_t rayIndex, TraversalContext& context)
+        {
+            hitInfos[rayIndex] = HitInfo{};
+            return closestHitInterleaved(rays[rayIndex], hitInfos[rayIndex], context);
+        });
+    }
+
+    // Triangle that blocked a shadow ray, see occludes
+    struct Occluder
+    {
+        uint32_t instanceIndex = std::numeric_limits<uint32_t>::max();
+        uint32_t triangleIndex = 0;
+
+        bool isValid() const
+        {
+            return instanceIndex != std::numeric_limits<uint32_t>::max();
+        }
+    };
+
+    // Tests the ray against the single triangle of a previous anyHit, much cheaper than a traversal when neighbouring
+    // shadow rays are blocked by the same triangle
+    bool occludes(const Ray& ray, const Occluder& occluder) const
+    {
+        const auto& instance = instances[occluder.instanceIndex];
+        const auto& mesh = meshes[instance.meshIndex];
+        if (occluder.triangleIndex >= mesh.triangles.size())
+            return false;
+
+        Ray objectRay = instance.rayToObject(ray);
+        const bool cullBackFace = materials[instance.materialIndex].cullBackFace();
+        return mesh.triangles[occluder.triangleIndex].intersect(mesh, objectRay, cullBackFace).hit;
+    }
+
+    // occluder, when given, receives the triangle that blocked the ray
+    bool anyHit(Ray& ray, Occluder* occluder = nullptr) const
+    {
+        std::function anyHitFunc = [this, &ray, occluder](HitInfo& hitInfo, uint32_t instancesStart,
+                                                          uint32_t instancesEnd)
+        {
+            for (uint32_t leafIndex = instancesStart; leafIndex < instancesEnd; ++leafIndex)
+            {
+                const uint32_t instanceIndex = instanceOrder[leafIndex];
+                const auto& instance = instances[instanceIndex];
+                const auto& material = materials[instance.materialIndex];
+                if (material.type == Material::Type::REFRACTIVE)
+                    continue;
+
+                Ray objectRay = instance.rayToObject(ray);
+                uint32_t* occluderIndex = occluder ? &occluder->triangleIndex : nullptr;
+                if (meshes[instance.meshIndex].anyHit(objectRay, material.cullBackFace(), occluderIndex))
+                {
+                    if (occluder)
+                        occluder->instanceIndex = instanceIndex;
+                    hitInfo.hit = true;
+                    return true;
+                }
+            }
+            return false;
+        };
+        return bvh.traverse(ray, anyHitFunc).hit;
+    }
+
+    // Vertex animation, the new positions are picked up by the next updateAccelerationStructures
+    void setMeshPositions(uint32_t meshIndex, std::vector<Vector3> positions)
+    {
+        assert(positions.size() == meshes[meshIndex].positions.size());
+        meshes[meshIndex].setPositions(std::move(positions));
+        animatedMeshes[meshIndex] = true;
     }
 
-    bool anyHit(Ray& ray) const
+    // Rigid animation, picked up by the next updateAccelerationStructures
+    void setInstanceTransform(uint32_t instanceIndex, const Matrix4& objectToWorld)
     {
-        return bvh.anyHit(triangles, materials, ray);
+        instances[instanceIndex].setTransform(objectToWorld);
+        instancesMoved = true;
+    }
+
+    // Refits the BVHs of the animated meshes in parallel and then the top level. Refitting keeps the topology, so a
+    // tree whose SAH cost grew past settings.bvhRebuildCostGrowth since its last build is rebuilt instead.
+    void updateAccelerationStructures()
+    {
+        const bool meshesAnimated = std::ranges::find(animatedMeshes, true) != animatedMeshes.end();
+        if (!meshesAnimated && !instancesMoved)
+            return;
+
+        std::atomic<uint32_t> rebuiltCount = 0;
+        {
+            ThreadPool threadPool;
+            std::vector<std::future<void>> results;
+            for (uint32_t meshIndex = 0; meshIndex < meshes.size(); ++meshIndex)
+            {
+                if (!animatedMeshes[meshIndex])
+                    continue;
+
+                results.emplace_back(threadPool.Enqueue([this, &mesh = meshes[meshIndex], &rebuiltCount]
+                {
+                    mesh.refitBVH();
+                    if (mesh.bvh.costGrowth() > settings.bvhRebuildCostGrowth)
+                    {
+                        mesh.buildBVH(settings.bvhSettings);
+                        if (settings.bvhQuantizedNodes)
+                            mesh.bvh.quantize();
+                        ++rebuiltCount;
+                    }
+                }));
+            }
+            for (auto&& result : results)
+                result.get();
+        }
+
+        std::vector<AABB> instanceBounds = instanceWorldBounds();
+        std::vector<AABB> leafBounds;
+        leafBounds.reserve(instanceOrder.size());
+        for (uint32_t instanceIndex : instanceOrder)
+            leafBounds.push_back(instanceBounds[instanceIndex]);
+        bvh.refit(leafBounds);
+        if (bvh.costGrowth() > settings.bvhRebuildCostGrowth)
+        {
+            buildTopLevel(instanceBounds);
+            ++rebuiltCount;
+        }
+
+        if (rebuiltCount > 0)
+            std::cout << rebuiltCount << " degraded BVHs rebuilt.\n";
+
+        // Rebuilt meshes reorder their triangles, so the emissive triangles are registered again in any case
+        registerEmissiveInstances();
+
+        animatedMeshes.assign(meshes.size(), false);
+        instancesMoved = false;
     }
 
     Camera camera;
-    std::vector<Triangle> triangles;
-    BVH bvh;
+    std::vector<Mesh> meshes;
+    std::vector<Instance> instances;
+    BVH bvh; // top level, over the instances
+    std::vector<uint32_t> instanceOrder; // top-level leaf order, instances themselves keep their indices
     std::vector<Material> materials;
     std::map<std::string, std::shared_ptr<const Texture>> textures;
+    std::shared_ptr<TextureCache> textureCache; // shared by the bitmap textures, which keep it alive
     std::vector<Light> lights;
     EmissiveSampler emissiveSampler;
     Settings settings;
+
+private:
+    std::vector<bool> animatedMeshes;
+    bool instancesMoved = false;
+
+
+    // Takes the hit of the instance in object space when it is nearer, moved to world space
+    void keepNearerHit(Ray& ray, HitInfo& hitInfo, HitInfo instanceHitInfo, uint32_t instanceIndex) const
+    {
+        if (!instanceHitInfo.hit || instanceHitInfo.t >= hitInfo.t)
+            return;
+
+        const auto& instance = instances[instanceIndex];
+        instanceHitInfo.point = ray(instanceHitInfo.t);
+        instanceHitInfo.normal = instance.normalToWorld(instanceHitInfo.normal);
+        instanceHitInfo.materialIndex = instance.materialIndex;
+        instanceHitInfo.instanceIndex = instanceIndex;
+        hitInfo = instanceHitInfo;
+        ray.maxT = hitInfo.t;
+    }
+
+    TraversalTask closestHitInterleaved(Ray& ray, HitInfo& hitInfo, TraversalContext& context) const
+    {
+        const auto closestHitFunc = [this, &ray, &context](HitInfo& leafHitInfo, uint32_t instancesStart,
+                                                           uint32_t instancesEnd) -> TraversalTask
+        {
+            for (uint32_t leafIndex = instancesStart; leafIndex < instancesEnd; ++leafIndex)
+            {
+                const uint32_t instanceIndex = instanceOrder[leafIndex];
+                const auto& instance = instances[instanceIndex];
+                const auto& material = materials[instance.materialIndex];
+
+                Ray objectRay = instance.rayToObject(ray);
+                HitInfo instanceHitInfo;
+                co_await meshes[instance.meshIndex].closestHitInterleaved(objectRay, material.cullBackFace(),
+                                                                          instanceHitInfo, context);
+                keepNearerHit(ray, leafHitInfo, instanceHitInfo, instanceIndex);
+            }
+            co_return false;
+        };
+        co_return co_await bvh.traverseInterleaved(ray, hitInfo, closestHitFunc, context);
+    }
+
+    // Returns whether the BVH was loaded from the cache. Lazy builds do not use it, the cache stores whole trees.
+    bool buildMeshBVH(Mesh& mesh, bool lazy) const
+    {
+        if (lazy)
+        {
+            mesh.buildLazyBVH(settings.bvhSettings, settings.bvhQuantizedNodes);
+            return false;
+        }
+
+        bool loadedFromCache = false;
+        if (settings.bvhCacheDirectory.empty())
+            mesh.buildBVH(settings.bvhSettings);
+        else
+            loadedFromCache = BVHCache(settings.bvhCacheDirectory).loadOrBuild(mesh, settings.bvhSettings);
+
+        // The cache keeps the binary nodes, quantizing is cheap enough to redo on every load
+        if (settings.bvhQuantizedNodes)
+            mesh.bvh.quantize();
+        return loadedFromCache;
+    }
+
+    void buildAccelerationStructures()
+    {
+        // In lazy mode the meshes of emissive instances are still built whole, expanding a subtree reorders its
+        // triangles and the light sampler registers them in their final order
+        std::vector<bool> lazy(meshes.size(), settings.lazyBVH);
+        if (settings.lazyBVH)
+        {
+            for (const auto& instance : instances)
+            {
+                if (materials[instance.materialIndex].type == Material::Type::EMISSIVE)
+                    lazy[instance.meshIndex] = false;
+            }
+        }
+
+        // Bottom level, one BVH per mesh in object space
+        std::atomic<uint32_t> loadedFromCache = 0;
+        {
+            ThreadPool threadPool;
+            std::vector<std::future<void>> results;
+            for (uint32_t meshIndex = 0; meshIndex < meshes.size(); ++meshIndex)
+            {
+                results.emplace_back(threadPool.Enqueue([this, &mesh = meshes[meshIndex], meshLazy = lazy[meshIndex],
+                                                         &loadedFromCache]
+                {
+                    if (buildMeshBVH(mesh, meshLazy))
+                        ++loadedFromCache;
+                }));
+            }
+            for (auto&& result : results)
+                result.get();
+        }
+        if (loadedFromCache > 0)
+            std::cout << loadedFromCache << " of " << meshes.size() << " mesh BVHs loaded from cache.\n";
+        const auto lazyCount = std::ranges::count(lazy, true);
+        if (lazyCount > 0)
+            std::cout << lazyCount << " of " << meshes.size() << " mesh BVHs build their subtrees on demand.\n";
+
+        buildTopLevel(instanceWorldBounds());
+        animatedMeshes.assign(meshes.size(), false);
+    }
+
+    std::vector<AABB> instanceWorldBounds() const
+    {
+        std::vector<AABB> instanceBounds;
+        instanceBounds.reserve(instances.size());
+        for (const auto& instance : instances)
+            instanceBounds.push_back(instance.boundsToWorld(meshes[instance.meshIndex].bounds()));
+        return instanceBounds;
+    }
+
+    void buildTopLevel(const std::vector<AABB>& instanceBounds)
+    {
+        std::vector<Vector3> instanceCentroids;
+        instanceCentroids.reserve(instanceBounds.size());
+        for (const auto& bounds : instanceBounds)
+            instanceCentroids.push_back(bounds.isValid() ? bounds.center() : Vector3(0.f));
+
+        // Instances are few and large compared to triangles, so the top level always uses SAH and single-instance
+        // leaves, with the depth only limited by the traversal stack
+        BVH::BuildSettings topLevelSettings = settings.bvhSettings;
+        topLevelSettings.splitHeuristic = BVH::SplitHeuristic::SAH;
+        topLevelSettings.maxDepth = std::numeric_limits<uint32_t>::max();
+        topLevelSettings.maxPrimitiveCountPerLeaf = 1;
+        instanceOrder = bvh.build(instanceBounds, instanceCentroids, topLevelSettings);
+    }
+
+    // Emissive triangles are registered per instance in world space, after the BVHs fixed the triangle order
+    void registerEmissiveInstances()
+    {
+        emissiveSampler.clear();
+        for (auto& instance : instances)
+        {
+            const auto& material = materials[instance.materialIndex];
+            if (material.type != Material::Type::EMISSIVE)
+                continue;
+
+            const auto& mesh = meshes[instance.meshIndex];
+            instance.emissiveOffset = static_cast<int32_t>(emissiveSampler.size());
+            for (const auto& triangle : mesh.triangles)
+            {
+                emissiveSampler.addTriangle(instance.pointToWorld(triangle.position(mesh, 0)),
+                                            instance.pointToWorld(triangle.position(mesh, 1)),
+                                            instance.pointToWorld(triangle.position(mesh, 2)), material.emission);
+            }
+        }
+        emissiveSampler.finalize(settings.lightBVH, settings.sphericalTriangleSampling);
+    }
 };
\ No newline at end of file
@@ -8,7 +8,9 @@
 #include "Light.hpp"
 #include "Material.hpp"
 #include "Scene.hpp"
+#include "TextureCache.hpp"
 #include "Textures.hpp"
+#include "ThreadPool.hpp"
 
 // Helper functions
 inline Vector3 loadVector(const rapidjson::Value::ConstArray& arr)
@@ -74,6 +76,31 @@ inline std::vector<uint32_t> loadIndices(const rapidjson::Value::ConstArray& arr
 	return result;
 }
 
+inline std::vector<Vector3> computeVertexNormals(const std::vector<Vector3>& vertices,
+                                                 const std::vector<uint32_t>& indices)
+{
+	std::vector<Vector3> vertexNormals(vertices.size(), {0.0f, 0.0f, 0.0f});
+	for (uint32_t i = 0; i < indices.size(); i += 3)
+	{
+		const auto& i0 = indices[i];
+		const auto& i1 = indices[i + 1];
+		const auto& i2 = indices[i + 2];
+		const auto& v0 = vertices[i0];
+		const auto& v1 = vertices[i1];
+		const auto& v2 = vertices[i2];
+		Vector3 faceNormal = Normalize(Cross(v1 - v0, v2 - v0));
+
+		vertexNormals[i0] += faceNormal;
+		vertexNormals[i1] += faceNormal;
+		vertexNormals[i2] += faceNormal;
+	}
+	// Normalize
+	for (auto& vertexNormal : vertexNormals)
+		vertexNormal = Normalize(vertexNormal);
+
+	return vertexNormals;
+}
+
 rapidjson::Document SceneParser::getJsonDocument(const std::string& fileName)
 {
 	using namespace rapidjson;
@@ -126,6 +153,186 @@ void SceneParser::parseSceneFile(const std::string& fileName) const
 				scene.settings.imageSettings.bucketSize = bucketSizeVal.GetInt();
 			}
 		}
+
+		if (settingsVal.HasMember(kCompressVertexAttributesStr.c_str()))
+		{
+			const Value& compressVal = settingsVal.FindMember(kCompressVertexAttributesStr.c_str())->value;
+			assert(!compressVal.IsNull() && compressVal.IsBool());
+			scene.settings.compressVertexAttributes = compressVal.GetBool();
+		}
+
+		if (settingsVal.HasMember(kTiledTexturesStr.c_str()))
+		{
+			const Value& tiledTexturesVal = settingsVal.FindMember(kTiledTexturesStr.c_str())->value;
+			assert(!tiledTexturesVal.IsNull() && tiledTexturesVal.IsBool());
+			scene.settings.tiledTextures = tiledTexturesVal.GetBool();
+		}
+
+		if (settingsVal.HasMember(kCompressedTexturesStr.c_str()))
+		{
+			const Value& compressedTexturesVal = settingsVal.FindMember(kCompressedTexturesStr.c_str())->value;
+			assert(!compressedTexturesVal.IsNull() && compressedTexturesVal.IsBool());
+			scene.settings.compressedTextures = compressedTexturesVal.GetBool();
+		}
+
+		if (settingsVal.HasMember(kTextureCacheStr.c_str()))
+		{
+			const Value& textureCacheVal = settingsVal.FindMember(kTextureCacheStr.c_str())->value;
+			assert(!textureCacheVal.IsNull() && textureCacheVal.IsObject());
+
+			const Value& cacheDirectoryVal = textureCacheVal.FindMember(kCacheDirectoryStr.c_str())->value;
+			assert(!cacheDirectoryVal.IsNull() && cacheDirectoryVal.IsString());
+			scene.settings.textureCacheDirectory = cacheDirectoryVal.GetString();
+
+			if (textureCacheVal.HasMember(kMemoryBudgetStr.c_str()))
+			{
+				const Value& memoryBudgetVal = textureCacheVal.FindMember(kMemoryBudgetStr.c_str())->value;
+				assert(!memoryBudgetVal.IsNull() && memoryBudgetVal.IsNumber());
+				const double megabytes = memoryBudgetVal.GetDouble();
+				scene.settings.textureCacheMemoryBudget = static_cast<uint64_t>(megabytes * (1 << 20));
+			}
+		}
+
+		if (settingsVal.HasMember(kLightBVHStr.c_str()))
+		{
+			const Value& lightBVHVal = settingsVal.FindMember(kLightBVHStr.c_str())->value;
+			assert(!lightBVHVal.IsNull() && lightBVHVal.IsBool());
+			scene.settings.lightBVH = lightBVHVal.GetBool();
+		}
+
+		if (settingsVal.HasMember(kSphericalTriangleSamplingStr.c_str()))
+		{
+			const Value& sphericalVal = settingsVal.FindMember(kSphericalTriangleSamplingStr.c_str())->value;
+			assert(!sphericalVal.IsNull() && sphericalVal.IsBool());
+			scene.settings.sphericalTriangleSampling = sphericalVal.GetBool();
+		}
+
+		if (settingsVal.HasMember(kRISCandidatesStr.c_str()))
+		{
+			const Value& risCandidatesVal = settingsVal.FindMember(kRISCandidatesStr.c_str())->value;
+			assert(!risCandidatesVal.IsNull() && risCandidatesVal.IsInt());
+			scene.settings.risCandidateCount = risCandidatesVal.GetInt();
+		}
+
+		if (settingsVal.HasMember(kVisibilityCacheStr.c_str()))
+		{
+			const Value& visibilityCacheVal = settingsVal.FindMember(kVisibilityCacheStr.c_str())->value;
+			assert(!visibilityCacheVal.IsNull() && visibilityCacheVal.IsObject());
+
+			const Value& cellSizeVal = visibilityCacheVal.FindMember(kCellSizeStr.c_str())->value;
+			assert(!cellSizeVal.IsNull() && cellSizeVal.IsNumber());
+			scene.settings.visibilityCacheCellSize = cellSizeVal.GetFloat();
+
+			if (visibilityCacheVal.HasMember(kMinSamplesStr.c_str()))
+			{
+				const Value& minSamplesVal = visibilityCacheVal.FindMember(kMinSamplesStr.c_str())->value;
+				assert(!minSamplesVal.IsNull() && minSamplesVal.IsInt());
+				scene.settings.visibilityCacheMinSamples = minSamplesVal.GetInt();
+			}
+		}
+
+		if (settingsVal.HasMember(kOccluderCacheStr.c_str()))
+		{
+			const Value& occluderCacheVal = settingsVal.FindMember(kOccluderCacheStr.c_str())->value;
+			assert(!occluderCacheVal.IsNull() && occluderCacheVal.IsBool());
+			scene.settings.occluderCache = occluderCacheVal.GetBool();
+		}
+
+		if (settingsVal.HasMember(kInterleavedRaysStr.c_str()))
+		{
+			const Value& interleavedRaysVal = settingsVal.FindMember(kInterleavedRaysStr.c_str())->value;
+			assert(!interleavedRaysVal.IsNull() && interleavedRaysVal.IsInt());
+			scene.settings.interleavedRayCount = interleavedRaysVal.GetInt();
+		}
+
+		if (settingsVal.HasMember(kBVHStr.c_str()))
+		{
+			const Value& bvhVal = settingsVal.FindMember(kBVHStr.c_str())->value;
+			assert(!bvhVal.IsNull() && bvhVal.IsObject());
+			auto& bvhSettings = scene.settings.bvhSettings;
+
+			if (bvhVal.HasMember(kSplitHeuristicStr.c_str()))
+			{
+				const std::map<std::string, BVH::SplitHeuristic> splitHeuristicMap = {
+					{"equal", BVH::SplitHeuristic::Equal},
+					{"middle", BVH::SplitHeuristic::Middle},
+					{"sah", BVH::SplitHeuristic::SAH},
+				};
+				const Value& splitHeuristicVal = bvhVal.FindMember(kSplitHeuristicStr.c_str())->value;
+				assert(!splitHeuristicVal.IsNull() && splitHeuristicVal.IsString());
+				bvhSettings.splitHeuristic = splitHeuristicMap.at(splitHeuristicVal.GetString());
+			}
+
+			if (bvhVal.HasMember(kMaxDepthStr.c_str()))
+			{
+				const Value& maxDepthVal = bvhVal.FindMember(kMaxDepthStr.c_str())->value;
+				assert(!maxDepthVal.IsNull() && maxDepthVal.IsInt());
+				bvhSettings.maxDepth = maxDepthVal.GetInt();
+			}
+
+			if (bvhVal.HasMember(kMaxLeafSizeStr.c_str()))
+			{
+				const Value& maxLeafSizeVal = bvhVal.FindMember(kMaxLeafSizeStr.c_str())->value;
+				assert(!maxLeafSizeVal.IsNull() && maxLeafSizeVal.IsInt());
+				bvhSettings.maxPrimitiveCountPerLeaf = maxLeafSizeVal.GetInt();
+			}
+
+			if (bvhVal.HasMember(kSpatialSplitsStr.c_str()))
+			{
+				const Value& spatialSplitsVal = bvhVal.FindMember(kSpatialSplitsStr.c_str())->value;
+				assert(!spatialSplitsVal.IsNull() && spatialSplitsVal.IsBool());
+				bvhSettings.spatialSplits = spatialSplitsVal.GetBool();
+			}
+
+			if (bvhVal.HasMember(kSpatialSplitOverlapStr.c_str()))
+			{
+				const Value& spatialSplitOverlapVal = bvhVal.FindMember(kSpatialSplitOverlapStr.c_str())->value;
+				assert(!spatialSplitOverlapVal.IsNull() && spatialSplitOverlapVal.IsNumber());
+				bvhSettings.spatialSplitOverlap = spatialSplitOverlapVal.GetFloat();
+			}
+
+			if (bvhVal.HasMember(kSpatialSplitBudgetStr.c_str()))
+			{
+				const Value& spatialSplitBudgetVal = bvhVal.FindMember(kSpatialSplitBudgetStr.c_str())->value;
+				assert(!spatialSplitBudgetVal.IsNull() && spatialSplitBudgetVal.IsNumber());
+				bvhSettings.spatialSplitBudget = spatialSplitBudgetVal.GetFloat();
+			}
+
+			if (bvhVal.HasMember(kOptimizeStr.c_str()))
+			{
+				const Value& optimizeVal = bvhVal.FindMember(kOptimizeStr.c_str())->value;
+				assert(!optimizeVal.IsNull() && optimizeVal.IsBool());
+				bvhSettings.optimize = optimizeVal.GetBool();
+			}
+
+			if (bvhVal.HasMember(kQuantizedNodesStr.c_str()))
+			{
+				const Value& quantizedNodesVal = bvhVal.FindMember(kQuantizedNodesStr.c_str())->value;
+				assert(!quantizedNodesVal.IsNull() && quantizedNodesVal.IsBool());
+				scene.settings.bvhQuantizedNodes = quantizedNodesVal.GetBool();
+			}
+
+			if (bvhVal.HasMember(kLazyStr.c_str()))
+			{
+				const Value& lazyVal = bvhVal.FindMember(kLazyStr.c_str())->value;
+				assert(!lazyVal.IsNull() && lazyVal.IsBool());
+				scene.settings.lazyBVH = lazyVal.GetBool();
+			}
+
+			if (bvhVal.HasMember(kCacheDirectoryStr.c_str()))
+			{
+				const Value& cacheDirectoryVal = bvhVal.FindMember(kCacheDirectoryStr.c_str())->value;
+				assert(!cacheDirectoryVal.IsNull() && cacheDirectoryVal.IsString());
+				scene.settings.bvhCacheDirectory = cacheDirectoryVal.GetString();
+			}
+
+			if (bvhVal.HasMember(kRebuildCostGrowthStr.c_str()))
+			{
+				const Value& rebuildCostGrowthVal = bvhVal.FindMember(kRebuildCostGrowthStr.c_str())->value;
+				assert(!rebuildCostGrowthVal.IsNull() && rebuildCostGrowthVal.IsNumber());
+				scene.settings.bvhRebuildCostGrowth = rebuildCostGrowthVal.GetFloat();
+			}
+		}
 	}
 
 	const Value& cameraVal = doc.FindMember(kCameraStr.c_str())->value;
@@ -162,6 +369,11 @@ void SceneParser::parseSceneFile(const std::string& fileName) const
 		}
 	}
 
+	// Bitmap textures are decoded on the pool while the materials and meshes are parsed, the mesh tasks queue behind
+	// them
+	ThreadPool threadPool;
+	std::vector<std::shared_ptr<BitmapTexture>> pendingTextures;
+
 	// Load textures
 	const Value& texturesValue = doc.FindMember(kTexturesStr.c_str())->value;
 	if (!texturesValue.IsNull() && texturesValue.IsArray())
@@ -225,7 +437,28 @@ void SceneParser::parseSceneFile(const std::string& fileName) const
 				if (!path.empty() && path[0] == '/')
 					path.erase(0, 1);
 
-				scene.textures.emplace(name, std::make_shared<const BitmapTexture>(name, path));
+				if (!scene.textureCache)
+				{
+					scene.textureCache = std::make_shared<TextureCache>(scene.settings.textureCacheDirectory,
+					                                                    scene.settings.textureCacheMemoryBudget);
+				}
+
+				// The textures share ownership of the cache through the aliasing constructor
+				if (const PagedTexture* pagedTexture = scene.textureCache->openPaged(path))
+				{
+					scene.textures.emplace(name, std::make_shared<const BitmapTexture>(
+						name, std::shared_ptr<const PagedTexture>(scene.textureCache, pagedTexture)));
+					continue;
+				}
+
+				TextureLayout layout = TextureLayout::Linear;
+				if (scene.settings.compressedTextures)
+					layout = TextureLayout::BC1;
+				else if (scene.settings.tiledTextures)
+					layout = TextureLayout::Tiled;
+				pendingTextures.push_back(
+					std::make_shared<BitmapTexture>(name, scene.textureCache->loadLevels(path, layout, threadPool)));
+				scene.textures.emplace(name, pendingTextures.back());
 			}
 			else
 			{
@@ -303,86 +536,174 @@ void SceneParser::parseSceneFile(const std::string& fileName) const
 		}
 	}
 
+	// Every object is a mesh placed once with the identity transform. Meshes listed under "meshes" are only placed
+	// through "instances", which reference meshes and objects by name.
+	struct MeshData
+	{
+		const Value* value;
+		uint32_t meshIndex;
+		uint32_t triangleCount;
+		std::vector<uint32_t> indices;
+		VertexCompression::ErrorReport compressionReport;
+	};
+
+	std::vector<MeshData> meshesData;
+	std::map<std::string, uint32_t> meshIndexByName;
+	auto addMeshes = [this, &meshesData, &meshIndexByName](const Value& meshesValue, bool isObject)
+	{
+		for (Value::ConstValueIterator it = meshesValue.Begin(); it != meshesValue.End(); ++it)
+		{
+			const Value& trianglesValue = it->FindMember(kTrianglesStr.c_str())->value;
+			assert(!trianglesValue.IsNull() && trianglesValue.IsArray());
+
+			const uint32_t meshIndex = static_cast<uint32_t>(scene.meshes.size());
+			scene.meshes.emplace_back();
+			meshesData.push_back({.value = &*it, .meshIndex = meshIndex, .triangleCount = trianglesValue.Size() / 3});
+
+			if (it->HasMember(kNameStr.c_str()))
+			{
+				const Value& nameValue = it->FindMember(kNameStr.c_str())->value;
+				assert(!nameValue.IsNull() && nameValue.IsString());
+				meshIndexByName.emplace(nameValue.GetString(), meshIndex);
+			}
+
+			if (isObject)
+			{
+				// Get material index
+				const Value& materialIndexValue = it->FindMember(kMaterialIndexStr.c_str())->value;
+				assert(!materialIndexValue.IsNull() && materialIndexValue.IsInt());
+				scene.instances.push_back(Instance{
+					.meshIndex = meshIndex,
+					.materialIndex = static_cast<uint32_t>(materialIndexValue.GetInt())
+				});
+			}
+		}
+	};
+
 	const Value& objectsValue = doc.FindMember(kObjectsStr.c_str())->value;
 	if (!objectsValue.IsNull() && objectsValue.IsArray())
+		addMeshes(objectsValue, true);
+
+	if (doc.HasMember(kMeshesStr.c_str()))
 	{
-		for (Value::ConstValueIterator it = objectsValue.Begin(); it != objectsValue.End(); ++it)
+		const Value& meshesValue = doc.FindMember(kMeshesStr.c_str())->value;
+		assert(!meshesValue.IsNull() && meshesValue.IsArray());
+		addMeshes(meshesValue, false);
+	}
+
+	{
+		std::vector<std::future<void>> results;
+
+		// Load vertex data and compute smooth normals, one task per mesh
+		for (auto& meshData : meshesData)
 		{
-			const Value& verticesValue = it->FindMember(kVerticesStr.c_str())->value;
-			assert(!verticesValue.IsNull() && verticesValue.IsArray());
-			std::vector<Vector3> vertices = loadVertices(verticesValue.GetArray());
+			results.emplace_back(threadPool.Enqueue([this, &meshData]
+			{
+				const Value& meshValue = *meshData.value;
+				auto& mesh = scene.meshes[meshData.meshIndex];
+
+				const Value& verticesValue = meshValue.FindMember(kVerticesStr.c_str())->value;
+				assert(!verticesValue.IsNull() && verticesValue.IsArray());
+				mesh.positions = loadVertices(verticesValue.GetArray());
+
+				if (meshValue.HasMember(kUVsStr.c_str()))
+				{
+					const Value& uvsValue = meshValue.FindMember(kUVsStr.c_str())->value;
+					assert(!uvsValue.IsNull() && uvsValue.IsArray());
+					mesh.uvs = loadUVs(uvsValue.GetArray());
+				}
+
+				const Value& trianglesValue = meshValue.FindMember(kTrianglesStr.c_str())->value;
+				meshData.indices = loadIndices(trianglesValue.GetArray());
+
+				mesh.normals = computeVertexNormals(mesh.positions, meshData.indices);
+
+				if (scene.settings.compressVertexAttributes)
+					meshData.compressionReport = mesh.compressAttributes();
+
+				mesh.triangles.resize(meshData.triangleCount);
+			}));
+		}
+		for (auto&& result : results)
+			result.get();
+		results.clear();
+
+		if (scene.settings.compressVertexAttributes)
+		{
+			VertexCompression::ErrorReport compressionReport;
+			for (const auto& meshData : meshesData)
+				compressionReport += meshData.compressionReport;
+			std::cout << "Vertex attributes compressed: " << compressionReport.toString() << "\n";
+		}
 
-			std::vector<Vector2> uvs;
-			if (it->HasMember(kUVsStr.c_str()))
+		// Expand the index buffers into triangles, very large meshes are split into several chunks that write
+		// disjoint ranges of the presized triangle arrays
+		constexpr uint32_t trianglesPerTask = 1 << 16;
+		for (const auto& meshData : meshesData)
+		{
+			for (uint32_t chunkStart = 0; chunkStart < meshData.triangleCount; chunkStart += trianglesPerTask)
 			{
-				const Value& uvsValue = it->FindMember(kUVsStr.c_str())->value;
-				assert(!uvsValue.IsNull() && uvsValue.IsArray());
-				uvs = loadUVs(uvsValue.GetArray());
+				const uint32_t chunkEnd = std::min(chunkStart + trianglesPerTask, meshData.triangleCount);
+				results.emplace_back(threadPool.Enqueue([this, &meshData, chunkStart, chunkEnd]
+				{
+					const auto& indices = meshData.indices;
+					auto& triangles = scene.meshes[meshData.meshIndex].triangles;
+					for (uint32_t triangleIndex = chunkStart; triangleIndex < chunkEnd; ++triangleIndex)
+					{
+						const uint32_t i = triangleIndex * 3;
+						triangles[triangleIndex] = Triangle{.indices = {indices[i], indices[i + 1], indices[i + 2]}};
+					}
+				}));
 			}
+		}
+		for (auto&& result : results)
+			result.get();
+	}
 
-			const Value& trianglesValue = it->FindMember(kTrianglesStr.c_str())->value;
-			assert(!trianglesValue.IsNull() && trianglesValue.IsArray());
-			std::vector<uint32_t> indices = loadIndices(trianglesValue.GetArray());
-
-			// Compute vertex normals
-			std::vector<Vector3> vertexNormals(vertices.size(), {0.0f, 0.0f, 0.0f});
-			for (uint32_t i = 0; i < indices.size(); i += 3)
+	if (doc.HasMember(kInstancesStr.c_str()))
+	{
+		const Value& instancesValue = doc.FindMember(kInstancesStr.c_str())->value;
+		assert(!instancesValue.IsNull() && instancesValue.IsArray());
+		for (Value::ConstValueIterator it = instancesValue.Begin(); it != instancesValue.End(); ++it)
+		{
+			const Value& meshNameValue = it->FindMember(kMeshStr.c_str())->value;
+			assert(!meshNameValue.IsNull() && meshNameValue.IsString());
+			auto meshIt = meshIndexByName.find(meshNameValue.GetString());
+			if (meshIt == meshIndexByName.end())
 			{
-				const auto& i0 = indices[i];
-				const auto& i1 = indices[i + 1];
-				const auto& i2 = indices[i + 2];
-				const auto& v0 = vertices[i0];
-				const auto& v1 = vertices[i1];
-				const auto& v2 = vertices[i2];
-				Vector3 faceNormal = Normalize(Cross(v1 - v0, v2 - v0));
-
-				vertexNormals[i0] += faceNormal;
-				vertexNormals[i1] += faceNormal;
-				vertexNormals[i2] += faceNormal;
+				std::cout << "Invalid instance, unknown mesh " << meshNameValue.GetString() << std::endl;
+				continue;
 			}
-			// Normalize
-			for (auto& vertexNormal : vertexNormals)
-				vertexNormal = Normalize(vertexNormal);
 
-			// Get material index
 			const Value& materialIndexValue = it->FindMember(kMaterialIndexStr.c_str())->value;
 			assert(!materialIndexValue.IsNull() && materialIndexValue.IsInt());
-			uint32_t materialIndex = materialIndexValue.GetInt();
-			const auto& material = scene.materials[materialIndex];
-			bool isEmissive = material.type == Material::Type::EMISSIVE;
 
-			scene.triangles.reserve(scene.triangles.size() + indices.size() / 3);
-			for (uint32_t i = 0; i < indices.size(); i += 3)
+			Matrix4 rotation = Matrix4::identity();
+			if (it->HasMember(kMatrixStr.c_str()))
 			{
-				const auto& i0 = indices[i];
-				const auto& i1 = indices[i + 1];
-				const auto& i2 = indices[i + 2];
-
-				const auto& v0 = vertices[i0];
-				const auto& v1 = vertices[i1];
-				const auto& v2 = vertices[i2];
-
-				const auto& n0 = vertexNormals[i0];
-				const auto& n1 = vertexNormals[i1];
-				const auto& n2 = vertexNormals[i2];
-
-				const auto& uv0 = !uvs.empty() ? uvs[i0] : 1.f;
-				const auto& uv1 = !uvs.empty() ? uvs[i1] : 1.f;
-				const auto& uv2 = !uvs.empty() ? uvs[i2] : 1.f;
-
-				scene.triangles.emplace_back(
-					Vertex{v0, n0, uv0},
-					Vertex{v1, n1, uv1},
-					Vertex{v2, n2, uv2},
-					materialIndex,
-					isEmissive ? scene.emissiveSampler.emissiveTriangles.size() : -1
-				);
-
-				if (isEmissive)
-				{
-					scene.emissiveSampler.emissiveTriangles.emplace_back(scene.triangles.back(), material.emission);
-				}
+				const Value& matrixVal = it->FindMember(kMatrixStr.c_str())->value;
+				assert(!matrixVal.IsNull() && matrixVal.IsArray());
+				rotation = loadMatrix(matrixVal.GetArray());
+			}
+
+			Matrix4 translation = Matrix4::identity();
+			if (it->HasMember(kPositionStr.c_str()))
+			{
+				const Value& positionVal = it->FindMember(kPositionStr.c_str())->value;
+				assert(!positionVal.IsNull() && positionVal.IsArray());
+				translation = makeTranslation(loadVector(positionVal.GetArray()));
 			}
+
+			Instance instance{
+				.meshIndex = meshIt->second,
+				.materialIndex = static_cast<uint32_t>(materialIndexValue.GetInt())
+			};
+			instance.setTransform(translation * rotation);
+			scene.instances.push_back(instance);
 		}
 	}
+
+	// The materials already point at the textures, only their levels have to be in place before rendering
+	for (const auto& texture : pendingTextures)
+		texture->Resolve();
 }
@@ -18,12 +18,41 @@ private:
 	inline static const std::string kImageWidthStr{"width"};
 	inline static const std::string kImageHeightStr{"height"};
 	inline static const std::string kBucketSizeStr{"bucket_size"};
+	inline static const std::string kBVHStr{"bvh"};
+	inline static const std::string kSplitHeuristicStr{"split_heuristic"};
+	inline static const std::string kMaxDepthStr{"max_depth"};
+	inline static const std::string kMaxLeafSizeStr{"max_leaf_size"};
+	inline static const std::string kSpatialSplitsStr{"spatial_splits"};
+	inline static const std::string kSpatialSplitOverlapStr{"spatial_split_overlap"};
+	inline static const std::string kSpatialSplitBudgetStr{"spatial_split_budget"};
+	inline static const std::string kOptimizeStr{"optimize"};
+	inline static const std::string kQuantizedNodesStr{"quantized_nodes"};
+	inline static const std::string kLazyStr{"lazy"};
+	inline static const std::string kCacheDirectoryStr{"cache_directory"};
+	inline static const std::string kRebuildCostGrowthStr{"rebuild_cost_growth"};
+	inline static const std::string kCompressVertexAttributesStr{"compress_vertex_attributes"};
+	inline static const std::string kTiledTexturesStr{"tiled_textures"};
+	inline static const std::string kCompressedTexturesStr{"compressed_textures"};
+	inline static const std::string kTextureCacheStr{"texture_cache"};
+	inline static const std::string kMemoryBudgetStr{"memory_budget_mb"};
+	inline static const std::string kLightBVHStr{"light_bvh"};
+	inline static const std::string kSphericalTriangleSamplingStr{"spherical_triangle_sampling"};
+	inline static const std::string kRISCandidatesStr{"ris_candidates"};
+	inline static const std::string kVisibilityCacheStr{"visibility_cache"};
+	inline static const std::string kCellSizeStr{"cell_size"};
+	inline static const std::string kMinSamplesStr{"min_samples"};
+	inline static const std::string kOccluderCacheStr{"occluder_cache"};
+	inline static const std::string kInterleavedRaysStr{"interleaved_rays"};
 	inline static const std::string kCameraStr{"camera"};
 	inline static const std::string kMatrixStr{"matrix"};
 	inline static const std::string kLightsStr{"lights"};
 	inline static const std::string kIntensityStr{"intensity"};
 	inline static const std::string kPositionStr{"position"};
 	inline static const std::string kObjectsStr{"objects"};
+	inline static const std::string kMeshesStr{"meshes"};
+	inline static const std::string kInstancesStr{"instances"};
+	inline static const std::string kNameStr{"name"};
+	inline static const std::string kMeshStr{"mesh"};
 	inline static const std::string kVerticesStr{"vertices"};
 	inline static const std::string kUVsStr{"uvs"};
 	inline static const std::string kTrianglesStr{"triangles"};
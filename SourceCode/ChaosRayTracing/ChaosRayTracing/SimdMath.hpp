@@ -0,0 +1,78 @@
+#pragma once
+
+// Four-lane float operations on SSE registers, the backend of Vector3A, Vector4, Vector3x8 and the Matrix4 products in
+// Math3D.hpp. SSE2 is part of x64; 32-bit builds get it from /arch:SSE2, the MSVC default. The sums and products are
+// in the order of the scalar Math3D functions and never fused, so they round the same way.
+
+#include <xmmintrin.h>
+
+#if !(defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#error "SimdMath.hpp needs SSE2"
+#endif
+
+namespace SimdMath
+{
+	template <int lane>
+	__m128 splat(__m128 v)
+	{
+		return _mm_shuffle_ps(v, v, _MM_SHUFFLE(lane, lane, lane, lane));
+	}
+
+	// Three floats into the first lanes, the fourth lane 0. Reads only the three floats, unlike a 16-byte load.
+	inline __m128 load3(const float* values)
+	{
+		const __m128 xy = _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(values));
+		return _mm_movelh_ps(xy, _mm_load_ss(values + 2));
+	}
+
+	inline void store3(float* values, __m128 v)
+	{
+		_mm_storel_pi(reinterpret_cast<__m64*>(values), v);
+		_mm_store_ss(values + 2, _mm_movehl_ps(v, v));
+	}
+
+	// x * x' + y * y' + z * z' in every lane, summed in that order like Dot
+	inline __m128 dot3(__m128 a, __m128 b)
+	{
+		const __m128 products = _mm_mul_ps(a, b);
+		const __m128 sum = _mm_add_ss(_mm_add_ss(products, splat<1>(products)), splat<2>(products));
+		return splat<0>(sum);
+	}
+
+	// Same products and differences as Cross, the fourth lane stays 0 when it is 0 in both
+	inline __m128 cross3(__m128 a, __m128 b)
+	{
+		const __m128 aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+		const __m128 bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+		const __m128 aZXY = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+		const __m128 bZXY = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+		return _mm_sub_ps(_mm_mul_ps(aYZX, bZXY), _mm_mul_ps(aZXY, bYZX));
+	}
+
+	// 1 / x and 1 / sqrt(x) from the 12-bit hardware estimates and one Newton-Raphson step, good to about 22 bits at a
+	// fraction of the latency of a division. Not for 0 and infinity, nor for magnitudes beyond 2^126 in reciprocal:
+	// their estimates are infinite or flushed to 0, and the step turns those into NaN.
+	inline __m128 reciprocal(__m128 x)
+	{
+		const __m128 estimate = _mm_rcp_ps(x);
+		return _mm_mul_ps(estimate, _mm_sub_ps(_mm_set1_ps(2.f), _mm_mul_ps(x, estimate)));
+	}
+
+	inline __m128 rsqrt(__m128 x)
+	{
+		const __m128 estimate = _mm_rsqrt_ps(x);
+		const __m128 halfX = _mm_mul_ps(x, _mm_set1_ps(0.5f));
+		return _mm_mul_ps(estimate,
+		                  _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(halfX, _mm_mul_ps(estimate, estimate))));
+	}
+
+	inline float reciprocal(float x)
+	{
+		return _mm_cvtss_f32(reciprocal(_mm_set_ss(x)));
+	}
+
+	inline float rsqrt(float x)
+	{
+		return _mm_cvtss_f32(rsqrt(_mm_set_ss(x)));
+	}
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Textures.hpp"
+
+// Throughput of bitmap texture lookups per storage layout. Random uvs are the access pattern of incoherent secondary
+// rays, spans of lookups one texel apart along a random direction the one of neighbouring rays crossing a rotated
+// surface. A zero footprint reads the full resolution level, a footprint of 1/256 of the texture a level of at most
+// 256x256 texels, which fits in the caches. The compressed layout trades a palette decode per block for an eighth of
+// the bytes of the tiled one, its error is reported against the linear layout.
+inline void runTextureBenchmark(const std::string& filePath)
+{
+	constexpr size_t lookupCount = size_t{1} << 22;
+	constexpr size_t spanLength = 16;
+	constexpr uint32_t repetitions = 8;
+
+	const BitmapTexture linear("linear", filePath, TextureLayout::Linear);
+	const BitmapTexture tiled("tiled", filePath, TextureLayout::Tiled);
+	const BitmapTexture compressed("BC1", filePath, TextureLayout::BC1);
+	if (linear.Width() == 0)
+		return;
+
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<float> distribution(0.f, 1.f);
+	std::vector<Vector2> randomUVs(lookupCount);
+	for (Vector2& uv : randomUVs)
+		uv = {distribution(generator), distribution(generator)};
+
+	std::vector<Vector2> spanUVs(lookupCount);
+	const float texelSize = 1.f / static_cast<float>(linear.Width());
+	for (size_t spanStart = 0; spanStart < lookupCount; spanStart += spanLength)
+	{
+		const Vector2 start{distribution(generator), distribution(generator)};
+		const float angle = 2.f * PI * distribution(generator);
+		const Vector2 step{std::cos(angle) * texelSize, std::sin(angle) * texelSize};
+		for (size_t i = 0; i < spanLength; ++i)
+			spanUVs[spanStart + i] = start + step * static_cast<float>(i);
+	}
+
+	constexpr size_t layoutCount = 3;
+	const BitmapTexture* textures[layoutCount] = {&linear, &tiled, &compressed};
+
+	const auto measure = [&textures](const char* pattern, const std::vector<Vector2>& uvs)
+	{
+		for (float footprint : {0.f, 1.f / 256.f})
+		{
+			UVDifferentials uvDifferentials;
+			uvDifferentials.dUVdx = Vector2(footprint, footprint);
+
+			// Layouts alternate within a repetition so that all see the same machine load
+			double bestNanoseconds[layoutCount];
+			std::fill(std::begin(bestNanoseconds), std::end(bestNanoseconds), std::numeric_limits<double>::max());
+			Vector3 checksums[layoutCount] = {Vector3{0.f}, Vector3{0.f}, Vector3{0.f}};
+			for (uint32_t repetition = 0; repetition < repetitions; ++repetition)
+			{
+				for (size_t layout = 0; layout < layoutCount; ++layout)
+				{
+					const auto start = std::chrono::high_resolution_clock::now();
+					for (const Vector2& uv : uvs)
+						checksums[layout] += textures[layout]->GetColor({}, uv, uvDifferentials);
+					const std::chrono::duration<double, std::nano> duration =
+						std::chrono::high_resolution_clock::now() - start;
+					bestNanoseconds[layout] =
+						std::min(bestNanoseconds[layout], duration.count() / static_cast<double>(uvs.size()));
+				}
+			}
+
+			for (size_t layout = 0; layout < layoutCount; ++layout)
+			{
+				std::cout << pattern << " uvs, " << textures[layout]->name << " layout, footprint " << footprint
+					<< ": " << bestNanoseconds[layout] << " ns per lookup, " << textures[layout]->SizeInBytes() / 1024
+					<< " KiB (checksum " << checksums[layout].x << ")" << std::endl;
+			}
+		}
+	};
+	measure("random", randomUVs);
+	measure("spans", spanUVs);
+
+	// Root mean square error per channel in 8-bit units at the full resolution level
+	for (size_t layout = 1; layout < layoutCount; ++layout)
+	{
+		double squaredError = 0.0;
+		for (const Vector2& uv : randomUVs)
+		{
+			const Vector3 difference =
+				textures[layout]->GetColor({}, uv, {}) - textures[0]->GetColor({}, uv, {});
+			squaredError += static_cast<double>(difference.x * difference.x + difference.y * difference.y +
+				difference.z * difference.z);
+		}
+		std::cout << textures[layout]->name << " layout error: "
+			<< 255.0 * std::sqrt(squaredError / (3.0 * static_cast<double>(randomUVs.size()))) << " RMS" << std::endl;
+	}
+}
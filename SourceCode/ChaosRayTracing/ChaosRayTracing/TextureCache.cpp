@@ -0,0 +1,448 @@
+#include "TextureCache.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "FileUtils.hpp"
+
+PagedTexture::LevelReader::LevelReader(const PagedTexture& texture, uint32_t level)
+	: width(texture.levels[level].width), height(texture.levels[level].height), texture(texture),
+	  firstPage(texture.levels[level].firstPage), pagesPerRow(texture.levels[level].pagesPerRow),
+	  hazard(TextureCache::beginRead())
+{
+}
+
+PagedTexture::LevelReader::~LevelReader()
+{
+	if (hitCount > 0)
+		texture.hitCounters[hitCounterIndex()].count.fetch_add(hitCount, std::memory_order_relaxed);
+	hazard.store(nullptr, std::memory_order_release);
+	TextureCache::endRead();
+}
+
+const uint8_t* PagedTexture::LevelReader::texel(int x, int y)
+{
+	const uint32_t index = firstPage + static_cast<uint32_t>(y / pageSize) * pagesPerRow + x / pageSize;
+	if (index != pageIndex)
+	{
+		page = texture.fetch(index, hazard, hitCount);
+		pageIndex = index;
+	}
+	return page->texels[(y % pageSize) * pageSize + x % pageSize];
+}
+
+PagedTexture::PagedTexture(TextureCache& cache, std::string sourcePath, const std::filesystem::path& filePath,
+                           std::vector<Level> levels, uint32_t pageCount, uint64_t pagesOffset)
+	: sourcePath(std::move(sourcePath)), cache(cache), levels(std::move(levels)), pagesOffset(pagesOffset),
+	  file(filePath, std::ios::in | std::ios::binary),
+	  pages(std::make_unique<std::atomic<const Page*>[]>(pageCount)),
+	  lastUse(std::make_unique<std::atomic<uint64_t>[]>(pageCount))
+{
+}
+
+PagedTexture::Statistics PagedTexture::statistics() const
+{
+	Statistics statistics;
+	for (const HitCounter& hitCounter : hitCounters)
+		statistics.hits += hitCounter.count.load(std::memory_order_relaxed);
+	statistics.misses = missCount.load(std::memory_order_relaxed);
+	statistics.evictions = evictionCount.load(std::memory_order_relaxed);
+	statistics.residentPages = residentCount.load(std::memory_order_relaxed);
+	return statistics;
+}
+
+uint32_t PagedTexture::hitCounterIndex()
+{
+	static std::atomic<uint32_t> threadCount = 0;
+	thread_local const uint32_t index = threadCount.fetch_add(1, std::memory_order_relaxed) % hitCounterCount;
+	return index;
+}
+
+const PagedTexture::Page* PagedTexture::fetch(uint32_t pageIndex, std::atomic<const Page*>& hazard,
+                                              uint64_t& hitCount) const
+{
+	// The page is published before it is used and then looked up again, both in one total order with the evicting
+	// thread's table store and hazard loads. That thread either sees the page published, or removed it from the table
+	// before the second lookup, which then misses.
+	const Page* page = pages[pageIndex].load(std::memory_order_acquire);
+	while (page)
+	{
+		hazard.store(page, std::memory_order_seq_cst);
+		const Page* current = pages[pageIndex].load(std::memory_order_seq_cst);
+		if (current == page)
+			break;
+		page = current;
+	}
+	if (!page)
+		return load(pageIndex, hazard, hitCount);
+
+	++hitCount;
+
+	// Only write the stamp when it changes, pages used by many threads would bounce between the caches otherwise
+	const uint64_t now = cache.clock.load(std::memory_order_relaxed);
+	if (lastUse[pageIndex].load(std::memory_order_relaxed) != now)
+		lastUse[pageIndex].store(now, std::memory_order_relaxed);
+	return page;
+}
+
+const PagedTexture::Page* PagedTexture::load(uint32_t pageIndex, std::atomic<const Page*>& hazard,
+                                             uint64_t& hitCount) const
+{
+	// One page is read at a time. Threads that missed the same page wait here and find it loaded. Evictions also
+	// happen under the mutex, so a page published here is seen by all of them.
+	std::lock_guard lock(cache.mutex);
+	if (const Page* page = pages[pageIndex].load(std::memory_order_acquire))
+	{
+		hazard.store(page, std::memory_order_relaxed);
+		++hitCount;
+		return page;
+	}
+
+	auto newPage = std::make_unique<Page>();
+	file.clear();
+	file.seekg(static_cast<std::streamoff>(pagesOffset + static_cast<uint64_t>(pageIndex) * sizeof(Page)));
+	if (!file.read(reinterpret_cast<char*>(newPage->texels), sizeof(Page)))
+	{
+		// The file was validated when opened, so only an outside change gets here. Black beats a crash mid-render.
+		std::memset(newPage->texels, 0, sizeof(Page));
+	}
+
+	missCount.fetch_add(1, std::memory_order_relaxed);
+	residentCount.fetch_add(1, std::memory_order_relaxed);
+	lastUse[pageIndex].store(cache.clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	const Page* page = newPage.get();
+	hazard.store(page, std::memory_order_relaxed);
+	pages[pageIndex].store(page, std::memory_order_release);
+	cache.admit(*this, pageIndex, std::move(newPage));
+	return page;
+}
+
+BitmapTexture::PendingLevels TextureCache::loadLevels(const std::string& filePath, TextureLayout layout,
+                                                     ThreadPool& threadPool)
+{
+	std::lock_guard lock(mutex);
+	auto& levels = loadedLevels[normalizedPath(filePath)];
+	if (!levels.valid())
+	{
+		levels = threadPool.Enqueue([filePath, layout]
+		{
+			return std::make_shared<const std::vector<TextureStorage>>(ToTextureLevels(LoadMipChain(filePath), layout));
+		}).share();
+	}
+	return levels;
+}
+
+const PagedTexture* TextureCache::openPaged(const std::string& filePath)
+{
+	if (!paging())
+		return nullptr;
+
+	std::lock_guard lock(mutex);
+	const std::string path = normalizedPath(filePath);
+	auto& pagedTexture = openedPagedTextures[path];
+	if (pagedTexture)
+		return pagedTexture.get();
+
+	char fileName[32];
+	const uint64_t key = computeKey(path);
+	std::snprintf(fileName, sizeof(fileName), "%016llx.tex", static_cast<unsigned long long>(key));
+	const std::filesystem::path cachePath = directory / fileName;
+
+	pagedTexture = open(cachePath, filePath, key);
+	if (!pagedTexture && convert(cachePath, filePath, key))
+		pagedTexture = open(cachePath, filePath, key);
+	if (!pagedTexture)
+	{
+		openedPagedTextures.erase(path);
+		return nullptr;
+	}
+	return pagedTexture.get();
+}
+
+std::vector<const PagedTexture*> TextureCache::pagedTextures() const
+{
+	std::lock_guard lock(mutex);
+	std::vector<const PagedTexture*> result;
+	for (const auto& [path, pagedTexture] : openedPagedTextures)
+		result.push_back(pagedTexture.get());
+	return result;
+}
+
+std::string TextureCache::normalizedPath(const std::string& filePath)
+{
+	std::error_code error;
+	const std::filesystem::path path = std::filesystem::weakly_canonical(filePath, error);
+	return error ? filePath : path.string();
+}
+
+uint64_t TextureCache::computeKey(const std::string& path)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	auto hashBytes = [&hash](const void* data, size_t size)
+	{
+		const auto* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+	};
+
+	const uint32_t formatVersion = version;
+	const uint32_t pageBytes = sizeof(PagedTexture::Page);
+	hashBytes(&formatVersion, sizeof(formatVersion));
+	hashBytes(&pageBytes, sizeof(pageBytes));
+	hashBytes(path.data(), path.size());
+
+	// An edited source file gets a new entry
+	std::error_code error;
+	const uint64_t fileSize = std::filesystem::file_size(path, error);
+	const int64_t writeTime = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+	hashBytes(&fileSize, sizeof(fileSize));
+	hashBytes(&writeTime, sizeof(writeTime));
+	return hash;
+}
+
+std::vector<PagedTexture::Level> TextureCache::pageLayout(const std::vector<LevelHeader>& levelHeaders,
+                                                          uint32_t& pageCount)
+{
+	std::vector<PagedTexture::Level> levels;
+	pageCount = 0;
+	for (const LevelHeader& levelHeader : levelHeaders)
+	{
+		PagedTexture::Level level;
+		level.width = levelHeader.width;
+		level.height = levelHeader.height;
+		level.firstPage = pageCount;
+		level.pagesPerRow = (levelHeader.width + PagedTexture::pageSize - 1) / PagedTexture::pageSize;
+		pageCount += level.pagesPerRow * ((levelHeader.height + PagedTexture::pageSize - 1) / PagedTexture::pageSize);
+		levels.push_back(level);
+	}
+	return levels;
+}
+
+bool TextureCache::convert(const std::filesystem::path& cachePath, const std::string& sourcePath, uint64_t key)
+{
+	const std::vector<RGBImage> mipChain = LoadMipChain(sourcePath);
+	if (mipChain.empty())
+		return false;
+
+	std::error_code error;
+	std::filesystem::create_directories(cachePath.parent_path(), error);
+	if (error)
+		return false;
+
+	std::vector<LevelHeader> levelHeaders;
+	for (const RGBImage& image : mipChain)
+		levelHeaders.push_back({image.width, image.height});
+	uint32_t pageCount;
+	const std::vector<PagedTexture::Level> levels = pageLayout(levelHeaders, pageCount);
+
+	Header header{};
+	std::memcpy(header.magic, magic, sizeof(header.magic));
+	header.version = version;
+	header.pageSize = PagedTexture::pageSize;
+	header.key = key;
+	header.levelCount = static_cast<uint32_t>(levelHeaders.size());
+	header.pageCount = pageCount;
+
+	return WriteFileAtomically(cachePath, [&](std::ofstream& ofs)
+	{
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(levelHeaders.data()), levelHeaders.size() * sizeof(LevelHeader));
+
+		// Texels past the edge of a level stay black, lookups wrap before reaching them
+		auto page = std::make_unique<PagedTexture::Page>();
+		for (size_t levelIndex = 0; levelIndex < mipChain.size(); ++levelIndex)
+		{
+			const RGBImage& image = mipChain[levelIndex];
+			const uint32_t pageRows = (image.height + PagedTexture::pageSize - 1) / PagedTexture::pageSize;
+			for (uint32_t pageRow = 0; pageRow < pageRows; ++pageRow)
+			{
+				for (uint32_t pageColumn = 0; pageColumn < levels[levelIndex].pagesPerRow; ++pageColumn)
+				{
+					std::memset(page->texels, 0, sizeof(PagedTexture::Page));
+					for (int y = 0; y < PagedTexture::pageSize; ++y)
+					{
+						const int row = static_cast<int>(pageRow) * PagedTexture::pageSize + y;
+						for (int x = 0; x < PagedTexture::pageSize && row < image.height; ++x)
+						{
+							const int column = static_cast<int>(pageColumn) * PagedTexture::pageSize + x;
+							if (column >= image.width)
+								break;
+
+							const uint8_t* source =
+								image.texels.data() + (static_cast<size_t>(row) * image.width + column) * 3;
+							uint8_t* destination = page->texels[y * PagedTexture::pageSize + x];
+							destination[0] = source[0];
+							destination[1] = source[1];
+							destination[2] = source[2];
+							destination[3] = 255;
+						}
+					}
+					ofs.write(reinterpret_cast<const char*>(page->texels), sizeof(PagedTexture::Page));
+				}
+			}
+		}
+		return static_cast<bool>(ofs);
+	});
+}
+
+std::unique_ptr<PagedTexture> TextureCache::open(const std::filesystem::path& cachePath, const std::string& sourcePath,
+                                                 uint64_t key)
+{
+	std::ifstream ifs(cachePath, std::ios::in | std::ios::binary);
+	if (!ifs.is_open())
+		return nullptr;
+
+	Header header{};
+	if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return nullptr;
+
+	if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.version != version ||
+		header.pageSize != PagedTexture::pageSize || header.key != key || header.levelCount == 0 ||
+		header.levelCount > 32)
+		return nullptr;
+
+	std::vector<LevelHeader> levelHeaders(header.levelCount);
+	if (!ifs.read(reinterpret_cast<char*>(levelHeaders.data()), levelHeaders.size() * sizeof(LevelHeader)))
+		return nullptr;
+
+	// Reject truncated or corrupted entries, every level halves the previous one down to 1x1
+	if (levelHeaders[0].width <= 0 || levelHeaders[0].height <= 0 || levelHeaders.back().width != 1 ||
+		levelHeaders.back().height != 1)
+		return nullptr;
+	for (size_t level = 1; level < levelHeaders.size(); ++level)
+	{
+		if (levelHeaders[level].width != std::max(1, levelHeaders[level - 1].width / 2) ||
+			levelHeaders[level].height != std::max(1, levelHeaders[level - 1].height / 2))
+			return nullptr;
+	}
+
+	uint32_t pageCount;
+	std::vector<PagedTexture::Level> levels = pageLayout(levelHeaders, pageCount);
+	const uint64_t pagesOffset = sizeof(Header) + levelHeaders.size() * sizeof(LevelHeader);
+	std::error_code error;
+	if (pageCount != header.pageCount ||
+		std::filesystem::file_size(cachePath, error) != pagesOffset + uint64_t{pageCount} * sizeof(PagedTexture::Page))
+		return nullptr;
+
+	auto pagedTexture =
+		std::make_unique<PagedTexture>(*this, sourcePath, cachePath, std::move(levels), pageCount, pagesOffset);
+	if (!pagedTexture->file.is_open())
+		return nullptr;
+	return pagedTexture;
+}
+
+TextureCache::ReaderSlot& TextureCache::readerSlot()
+{
+	// Claimed on the first lookup of a thread and given back when it ends
+	struct Claim
+	{
+		ReaderSlot* slot = nullptr;
+
+		Claim()
+		{
+			std::lock_guard lock(readerSlotsMutex);
+			for (ReaderSlot& readerSlot : readerSlots)
+			{
+				if (!readerSlot.claimed)
+				{
+					slot = &readerSlot;
+					break;
+				}
+			}
+			if (!slot)
+				slot = &readerSlots.emplace_back();
+			slot->claimed = true;
+		}
+
+		~Claim()
+		{
+			std::lock_guard lock(readerSlotsMutex);
+			slot->claimed = false;
+		}
+	};
+
+	thread_local Claim claim;
+	return *claim.slot;
+}
+
+std::atomic<const PagedTexture::Page*>& TextureCache::beginRead()
+{
+	ReaderSlot& slot = readerSlot();
+	assert(slot.depth < maxReaderDepth);
+	return slot.hazards[slot.depth++];
+}
+
+void TextureCache::endRead()
+{
+	--readerSlot().depth;
+}
+
+void TextureCache::freeUnreadPages()
+{
+	if (evictedPages.empty())
+		return;
+
+	std::vector<const PagedTexture::Page*> readPages;
+	{
+		std::lock_guard lock(readerSlotsMutex);
+		for (const ReaderSlot& slot : readerSlots)
+		{
+			for (const std::atomic<const PagedTexture::Page*>& hazard : slot.hazards)
+			{
+				if (const PagedTexture::Page* page = hazard.load(std::memory_order_seq_cst))
+					readPages.push_back(page);
+			}
+		}
+	}
+	std::sort(readPages.begin(), readPages.end());
+	std::erase_if(evictedPages, [&readPages](const std::unique_ptr<const PagedTexture::Page>& page)
+	{
+		return !std::binary_search(readPages.begin(), readPages.end(), page.get());
+	});
+}
+
+void TextureCache::admit(const PagedTexture& texture, uint32_t pageIndex,
+                         std::unique_ptr<const PagedTexture::Page> page)
+{
+	residentPages.push_back({&texture, pageIndex, 0, std::move(page)});
+	const size_t maxPageCount = memoryBudget / sizeof(PagedTexture::Page);
+	if (residentPages.size() + evictedPages.size() <= maxPageCount)
+		return;
+
+	freeUnreadPages();
+	if (residentPages.size() + evictedPages.size() <= maxPageCount)
+		return;
+
+	// Evict down to 7/8 of the budget, together with the evicted pages still held, at once so that the partition is
+	// paid for by many misses. Stamps keep changing under concurrent hits, so the order is taken from a snapshot.
+	const size_t targetCount = maxPageCount * 7 / 8;
+	const size_t keepCount = std::max<size_t>(1, targetCount > evictedPages.size() ? targetCount - evictedPages.size()
+		                                                                             : 0);
+	if (residentPages.size() <= keepCount)
+		return;
+
+	const size_t evictCount = residentPages.size() - keepCount;
+	for (ResidentPage& residentPage : residentPages)
+		residentPage.lastUse = residentPage.texture->lastUse[residentPage.pageIndex].load(std::memory_order_relaxed);
+	std::nth_element(residentPages.begin(), residentPages.begin() + evictCount, residentPages.end(),
+	                 [](const ResidentPage& a, const ResidentPage& b) { return a.lastUse < b.lastUse; });
+
+	// Readers that published an evicted page keep it until they move on, later ones cannot find it
+	for (size_t i = 0; i < evictCount; ++i)
+	{
+		const PagedTexture& evictedTexture = *residentPages[i].texture;
+		evictedTexture.pages[residentPages[i].pageIndex].store(nullptr, std::memory_order_seq_cst);
+		evictedTexture.evictionCount.fetch_add(1, std::memory_order_relaxed);
+		evictedTexture.residentCount.fetch_sub(1, std::memory_order_relaxed);
+		evictedPages.push_back(std::move(residentPages[i].page));
+	}
+	residentPages.erase(residentPages.begin(), residentPages.begin() + evictCount);
+	freeUnreadPages();
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Textures.hpp"
+#include "ThreadPool.hpp"
+
+class TextureCache;
+
+// Mip pyramid of one image in a TextureCache file, read a page at a time on first access. A page is a block of
+// 32x32 RGBA texels stored row by row, 4 KiB like a memory page.
+class PagedTexture
+{
+public:
+	static constexpr int pageSize = 32;
+
+	struct Page
+	{
+		uint8_t texels[pageSize * pageSize][4];
+	};
+
+	// Page lookups since the texture was opened, a miss reads the page from the file
+	struct Statistics
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint64_t residentPages = 0;
+	};
+
+	// Texels of one level for a single filtered lookup. The page of the last texel is kept, so a footprint within one
+	// page costs one page table lookup. Its hits are added to the statistics once, when the reader is destroyed. The
+	// kept page is published to the cache, which does not free it when it is evicted until the reader moves on.
+	class LevelReader
+	{
+	public:
+		LevelReader(const PagedTexture& texture, uint32_t level);
+		~LevelReader();
+
+		LevelReader(const LevelReader&) = delete;
+		LevelReader& operator=(const LevelReader&) = delete;
+
+		// RGB bytes of the texel in column x and row y, both in range, valid until the next call
+		const uint8_t* texel(int x, int y);
+
+		int width;
+		int height;
+
+	private:
+		const PagedTexture& texture;
+		uint32_t firstPage;
+		uint32_t pagesPerRow;
+		uint32_t pageIndex = std::numeric_limits<uint32_t>::max();
+		const Page* page = nullptr;
+		std::atomic<const Page*>& hazard; // the published page
+		uint64_t hitCount = 0;
+	};
+
+	struct Level
+	{
+		int width;
+		int height;
+		uint32_t firstPage; // index among the pages of all levels
+		uint32_t pagesPerRow;
+	};
+
+	PagedTexture(TextureCache& cache, std::string sourcePath, const std::filesystem::path& filePath,
+	             std::vector<Level> levels, uint32_t pageCount, uint64_t pagesOffset);
+
+	uint32_t levelCount() const
+	{
+		return static_cast<uint32_t>(levels.size());
+	}
+
+	int width(uint32_t level) const
+	{
+		return levels[level].width;
+	}
+
+	int height(uint32_t level) const
+	{
+		return levels[level].height;
+	}
+
+	Statistics statistics() const;
+
+	const std::string sourcePath;
+
+private:
+	friend class TextureCache;
+
+	// The page is published in hazard and stays valid until hazard changes. hitCount is incremented when the page was
+	// resident.
+	const Page* fetch(uint32_t pageIndex, std::atomic<const Page*>& hazard, uint64_t& hitCount) const;
+	const Page* load(uint32_t pageIndex, std::atomic<const Page*>& hazard, uint64_t& hitCount) const;
+
+	// Every thread adds its hits to its own counter, a shared one would bounce between the cores on every lookup
+	struct alignas(64) HitCounter
+	{
+		std::atomic<uint64_t> count = 0;
+	};
+
+	static constexpr uint32_t hitCounterCount = 64;
+
+	static uint32_t hitCounterIndex();
+
+	TextureCache& cache;
+	std::vector<Level> levels;
+	uint64_t pagesOffset; // of the first page in the file
+	mutable std::ifstream file; // only read under the cache mutex
+
+	// Resident pages, nullptr until loaded and after an eviction, and the value of the cache clock at their last use.
+	// The pages are owned by the cache.
+	std::unique_ptr<std::atomic<const Page*>[]> pages;
+	std::unique_ptr<std::atomic<uint64_t>[]> lastUse;
+
+	mutable HitCounter hitCounters[hitCounterCount];
+	mutable std::atomic<uint64_t> missCount = 0;
+	mutable std::atomic<uint64_t> evictionCount = 0;
+	mutable std::atomic<uint64_t> residentCount = 0;
+};
+
+// Bitmap texture data shared by the textures of a scene. Each file is loaded once however many textures refer to
+// it. With a directory the images are converted once into a paged file there and read on demand, keeping at most
+// memoryBudget bytes of pages in memory and evicting the least recently used ones. Evicted pages that a lookup still
+// reads count against the budget until it moves on. Conversion is keyed like BVHCache, by the path, size and
+// modification time of the source file.
+class TextureCache
+{
+public:
+	// directory empty -> textures are decoded into memory whole
+	TextureCache(std::filesystem::path directory, uint64_t memoryBudget)
+		: directory(std::move(directory)), memoryBudget(memoryBudget)
+	{
+	}
+
+	TextureCache(const TextureCache&) = delete;
+	TextureCache& operator=(const TextureCache&) = delete;
+
+	bool paging() const
+	{
+		return !directory.empty();
+	}
+
+	// Mip levels of the image in memory, decoded by a task on threadPool, empty when it cannot be decoded
+	BitmapTexture::PendingLevels loadLevels(const std::string& filePath, TextureLayout layout, ThreadPool& threadPool);
+
+	// nullptr when paging is off or the image cannot be converted, the caller falls back to loadLevels
+	const PagedTexture* openPaged(const std::string& filePath);
+
+	std::vector<const PagedTexture*> pagedTextures() const;
+
+private:
+	friend class PagedTexture;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t pageSize;
+		uint64_t key;
+		uint32_t levelCount;
+		uint32_t pageCount;
+	};
+
+	struct LevelHeader
+	{
+		int32_t width;
+		int32_t height;
+	};
+
+	struct ResidentPage
+	{
+		const PagedTexture* texture;
+		uint32_t pageIndex;
+		uint64_t lastUse; // snapshot for sorting
+		std::unique_ptr<const PagedTexture::Page> page;
+	};
+
+	// Hazard pointers of the LevelReaders of one thread. A reader publishes the page it keeps before using it, an
+	// evicted page is freed once no slot publishes it, so at most one evicted page per reader stays in memory.
+	static constexpr uint32_t maxReaderDepth = 4;
+
+	struct alignas(64) ReaderSlot
+	{
+		std::atomic<const PagedTexture::Page*> hazards[maxReaderDepth] = {};
+		uint32_t depth = 0; // nested readers of the owning thread
+		bool claimed = false; // by a thread, guarded by readerSlotsMutex
+	};
+
+	static std::string normalizedPath(const std::string& filePath);
+	static uint64_t computeKey(const std::string& path);
+	static std::vector<PagedTexture::Level> pageLayout(const std::vector<LevelHeader>& levelHeaders,
+	                                                   uint32_t& pageCount);
+	static bool convert(const std::filesystem::path& cachePath, const std::string& sourcePath, uint64_t key);
+	std::unique_ptr<PagedTexture> open(const std::filesystem::path& cachePath, const std::string& sourcePath,
+	                                   uint64_t key);
+
+	// Called with the mutex held after a page was loaded, takes ownership of it
+	void admit(const PagedTexture& texture, uint32_t pageIndex, std::unique_ptr<const PagedTexture::Page> page);
+
+	// Frees the evicted pages that no reader can still hold, called with the mutex held
+	void freeUnreadPages();
+
+	static ReaderSlot& readerSlot();
+	static std::atomic<const PagedTexture::Page*>& beginRead();
+	static void endRead();
+
+	static constexpr char magic[8] = {'C', 'R', 'T', 'T', 'E', 'X', '\0', '\0'};
+	static constexpr uint32_t version = 1;
+
+	std::filesystem::path directory;
+	uint64_t memoryBudget;
+
+	// Guards the maps, the resident list and page loads. Page hits and level decoding do not take it.
+	mutable std::mutex mutex;
+	std::atomic<uint64_t> clock = 0; // advanced by every page miss
+	std::vector<ResidentPage> residentPages;
+	std::vector<std::unique_ptr<const PagedTexture::Page>> evictedPages; // still read, count against the budget
+	std::map<std::string, BitmapTexture::PendingLevels> loadedLevels;
+	std::map<std::string, std::unique_ptr<PagedTexture>> openedPagedTextures;
+
+	// Shared by all caches, so that one slot per thread serves them all
+	inline static std::mutex readerSlotsMutex;
+	inline static std::deque<ReaderSlot> readerSlots; // slots of finished threads are reused
+};
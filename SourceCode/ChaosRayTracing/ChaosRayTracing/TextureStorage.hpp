@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "BlockCompression.hpp"
+
+enum class TextureLayout
+{
+	Linear, // RGB rows as decoded
+	Tiled, // 4x4 blocks of RGBA, Morton order inside a block
+	BC1 // 4x4 blocks compressed to 8 bytes, lossy, read through BlockReader
+};
+
+// Texels of one image level. In the tiled layout a block is one 64 byte cache line, so a bilinear footprint mostly
+// stays within one line and nearby lookups from incoherent rays share lines, where rows would put every texel row of
+// the footprint on its own line. The padding to RGBA keeps every texel 4-byte aligned.
+//
+// For every layout the byte offset of a texel, or of its block when compressed, is a per column plus a per row offset
+// from small tables. Computing the swizzle instead cost more than the saved misses, random lookups are bound by how
+// many misses are in flight.
+class TextureStorage
+{
+public:
+	TextureStorage() = default;
+
+	// rgbTexels: width * height RGB texels row by row, the first row is the top of the image
+	TextureStorage(int width, int height, const std::vector<uint8_t>& rgbTexels, TextureLayout layout)
+		: width(width), height(height), layout(layout), columnOffsets(width), rowOffsets(height)
+	{
+		if (layout == TextureLayout::BC1)
+		{
+			compressBlocks(rgbTexels);
+			return;
+		}
+
+		if (layout == TextureLayout::Linear)
+		{
+			for (int x = 0; x < width; ++x)
+				columnOffsets[x] = static_cast<uint32_t>(x) * 3;
+			for (int y = 0; y < height; ++y)
+				rowOffsets[y] = static_cast<uint32_t>(y * width) * 3;
+
+			lines.resize((rgbTexels.size() + sizeof(CacheLine) - 1) / sizeof(CacheLine));
+			std::copy(rgbTexels.begin(), rgbTexels.end(), lines.data()->bytes);
+			return;
+		}
+
+		// Morton order inside a block, x in the even bits of the slot and y in the odd ones
+		const auto blocksPerRow = static_cast<uint32_t>((width + blockSize - 1) / blockSize);
+		for (int x = 0; x < width; ++x)
+		{
+			const auto localX = static_cast<uint32_t>(x % blockSize);
+			const uint32_t slot = (localX & 1) | (localX & 2) << 1;
+			columnOffsets[x] = static_cast<uint32_t>(x / blockSize) * sizeof(CacheLine) + slot * 4;
+		}
+		for (int y = 0; y < height; ++y)
+		{
+			const auto localY = static_cast<uint32_t>(y % blockSize);
+			const uint32_t slot = (localY & 1) << 1 | (localY & 2) << 2;
+			rowOffsets[y] = static_cast<uint32_t>(y / blockSize) * blocksPerRow * sizeof(CacheLine) + slot * 4;
+		}
+
+		lines.resize(static_cast<size_t>(blocksPerRow) * ((height + blockSize - 1) / blockSize));
+		for (int y = 0; y < height; ++y)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				const uint8_t* source = rgbTexels.data() + (static_cast<size_t>(y) * width + x) * 3;
+				uint8_t* destination = lines.data()->bytes + columnOffsets[x] + rowOffsets[y];
+				destination[0] = source[0];
+				destination[1] = source[1];
+				destination[2] = source[2];
+				destination[3] = 255;
+			}
+		}
+	}
+
+	// RGB bytes of the texel in column x and row y, both in range, uncompressed layouts only
+	const uint8_t* texel(int x, int y) const
+	{
+		assert(layout != TextureLayout::BC1);
+		return lines.data()->bytes + columnOffsets[x] + rowOffsets[y];
+	}
+
+	// Texels of a compressed level for a single filtered lookup. The palette of the last block is kept, a bilinear
+	// footprint mostly falls within one block.
+	class BlockReader
+	{
+	public:
+		explicit BlockReader(const TextureStorage& storage)
+			: width(storage.width), height(storage.height), storage(storage)
+		{
+		}
+
+		// RGB bytes of the texel in column x and row y, both in range, valid until the reader is gone
+		const uint8_t* texel(int x, int y)
+		{
+			const uint8_t* block = storage.lines.data()->bytes + storage.columnOffsets[x] + storage.rowOffsets[y];
+			if (block != lastBlock)
+			{
+				BlockCompression::decodePalette(block, palette);
+				lastBlock = block;
+			}
+			return palette[BlockCompression::paletteIndex(block, (y % blockSize) * blockSize + x % blockSize)];
+		}
+
+		int width;
+		int height;
+
+	private:
+		const TextureStorage& storage;
+		const uint8_t* lastBlock = nullptr;
+		uint8_t palette[4][3];
+	};
+
+	size_t sizeInBytes() const
+	{
+		return lines.size() * sizeof(CacheLine) + (columnOffsets.size() + rowOffsets.size()) * sizeof(uint32_t);
+	}
+
+	int width = 0;
+	int height = 0;
+	TextureLayout layout = TextureLayout::Linear;
+
+private:
+	static constexpr int blockSize = 4;
+
+	struct alignas(64) CacheLine
+	{
+		uint8_t bytes[64];
+	};
+
+	void compressBlocks(const std::vector<uint8_t>& rgbTexels)
+	{
+		const auto blocksPerRow = static_cast<uint32_t>((width + blockSize - 1) / blockSize);
+		const auto blockRows = static_cast<uint32_t>((height + blockSize - 1) / blockSize);
+		for (int x = 0; x < width; ++x)
+			columnOffsets[x] = static_cast<uint32_t>(x / blockSize) * BlockCompression::blockBytes;
+		for (int y = 0; y < height; ++y)
+			rowOffsets[y] = static_cast<uint32_t>(y / blockSize) * blocksPerRow * BlockCompression::blockBytes;
+
+		const size_t byteCount = static_cast<size_t>(blocksPerRow) * blockRows * BlockCompression::blockBytes;
+		lines.resize((byteCount + sizeof(CacheLine) - 1) / sizeof(CacheLine));
+		for (uint32_t blockRow = 0; blockRow < blockRows; ++blockRow)
+		{
+			for (uint32_t blockColumn = 0; blockColumn < blocksPerRow; ++blockColumn)
+			{
+				// Blocks over the edge of the image repeat its last row and column
+				uint8_t blockTexels[16][3];
+				for (int texel = 0; texel < 16; ++texel)
+				{
+					const int x = std::min(static_cast<int>(blockColumn) * blockSize + texel % blockSize, width - 1);
+					const int y = std::min(static_cast<int>(blockRow) * blockSize + texel / blockSize, height - 1);
+					const uint8_t* source = rgbTexels.data() + (static_cast<size_t>(y) * width + x) * 3;
+					std::copy(source, source + 3, blockTexels[texel]);
+				}
+				uint8_t* block = lines.data()->bytes + columnOffsets[blockColumn * blockSize] +
+					rowOffsets[blockRow * blockSize];
+				BlockCompression::encodeBlock(blockTexels, block);
+			}
+		}
+	}
+
+	std::vector<CacheLine> lines;
+	std::vector<uint32_t> columnOffsets;
+	std::vector<uint32_t> rowOffsets;
+};
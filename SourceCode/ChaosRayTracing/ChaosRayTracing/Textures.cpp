@@ -1,9 +1,14 @@
 #include "Textures.hpp"
 
+#include <iostream>
+
+#include "TextureCache.hpp"
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-Vector3 EdgesTexture::GetColor(const Vector2& barycentrics, const Vector2& uv) const
+Vector3 EdgesTexture::GetColor(const Vector2& barycentrics, const Vector2& uv,
+                               const UVDifferentials& uvDifferentials) const
 {
 	if (barycentrics.x < edgeWidth || barycentrics.y < edgeWidth)
 		return edgeColor;
@@ -14,7 +19,8 @@ Vector3 EdgesTexture::GetColor(const Vector2& barycentrics, const Vector2& uv) c
 	return innerColor;
 }
 
-Vector3 CheckerTexture::GetColor(const Vector2& barycentrics, const Vector2& uv) const
+Vector3 CheckerTexture::GetColor(const Vector2& barycentrics, const Vector2& uv,
+                                 const UVDifferentials& uvDifferentials) const
 {
 	const float& u = uv.x;
 	const float& v = uv.y;
@@ -27,28 +33,166 @@ Vector3 CheckerTexture::GetColor(const Vector2& barycentrics, const Vector2& uv)
 	return colorB;
 }
 
-Vector3 BitmapTexture::GetColor(const Vector2& barycentrics, const Vector2& uv) const
+Vector3 BitmapTexture::GetColor(const Vector2& barycentrics, const Vector2& uv,
+                                const UVDifferentials& uvDifferentials) const
 {
-	assert(image);
+	if (pagedTexture)
+	{
+		const auto sampleLevel = [this](size_t level, const Vector2& uv)
+		{
+			PagedTexture::LevelReader reader(*pagedTexture, static_cast<uint32_t>(level));
+			return Bilinear(reader, uv);
+		};
+		return Trilinear(pagedTexture->levelCount(), pagedTexture->width(0), pagedTexture->height(0), uv,
+		                 uvDifferentials, sampleLevel);
+	}
 
-	int x = static_cast<int>(uv.x * width);
-	int y = static_cast<int>((1.f - uv.y) * height);
+	assert(levels && !levels->empty());
+	if ((*levels)[0].layout == TextureLayout::BC1)
+	{
+		const auto sampleLevel = [this](size_t level, const Vector2& uv)
+		{
+			TextureStorage::BlockReader reader((*levels)[level]);
+			return Bilinear(reader, uv);
+		};
+		return Trilinear(levels->size(), (*levels)[0].width, (*levels)[0].height, uv, uvDifferentials, sampleLevel);
+	}
+
+	const auto sampleLevel = [this](size_t level, const Vector2& uv)
+	{
+		return Bilinear((*levels)[level], uv);
+	};
+	return Trilinear(levels->size(), (*levels)[0].width, (*levels)[0].height, uv, uvDifferentials, sampleLevel);
+}
 
-	unsigned char* pixel = image + (y * width + x) * channels;
+template <typename SampleLevel>
+Vector3 BitmapTexture::Trilinear(size_t levelCount, int width, int height, const Vector2& uv,
+                                 const UVDifferentials& uvDifferentials, const SampleLevel& sampleLevel)
+{
+	// The longer axis of the footprint in texels of the full resolution image picks the level
+	const Vector2 size(static_cast<float>(width), static_cast<float>(height));
+	const Vector2 footprintX = uvDifferentials.dUVdx * size;
+	const Vector2 footprintY = uvDifferentials.dUVdy * size;
+	const float footprintSqr = std::max(footprintX.x * footprintX.x + footprintX.y * footprintX.y,
+	                                    footprintY.x * footprintY.x + footprintY.y * footprintY.y);
+	if (footprintSqr <= 1.f)
+		return sampleLevel(0, uv);
 
-	unsigned char r = pixel[0];
-	unsigned char g = pixel[1];
-	unsigned char b = pixel[2];
+	const float level = std::min(0.5f * std::log2(footprintSqr), static_cast<float>(levelCount - 1));
+	const auto lowerLevel = static_cast<size_t>(level);
+	if (lowerLevel + 1 >= levelCount)
+		return sampleLevel(levelCount - 1, uv);
 
-	return {static_cast<float>(r) / 255.f, static_cast<float>(g) / 255.f, static_cast<float>(b) / 255.f};
+	const float t = level - static_cast<float>(lowerLevel);
+	return sampleLevel(lowerLevel, uv) * (1.f - t) + sampleLevel(lowerLevel + 1, uv) * t;
 }
 
-BitmapTexture::~BitmapTexture()
+template <typename Level>
+Vector3 BitmapTexture::Bilinear(Level& level, const Vector2& uv)
 {
+	// Texel centers sit at half-integer coordinates
+	const float x = uv.x * static_cast<float>(level.width) - 0.5f;
+	const float y = (1.f - uv.y) * static_cast<float>(level.height) - 0.5f;
+
+	// Integer floor and wrap, the library calls would dominate the lookup. Coordinates are almost always in range.
+	const auto floorWrap = [](float coordinate, int size, float& fraction)
+	{
+		int index = static_cast<int>(coordinate);
+		index -= coordinate < static_cast<float>(index);
+		fraction = coordinate - static_cast<float>(index);
+		if (static_cast<unsigned>(index) >= static_cast<unsigned>(size))
+		{
+			index %= size;
+			index += index < 0 ? size : 0;
+		}
+		return index;
+	};
+	float tx;
+	float ty;
+	const int column0 = floorWrap(x, level.width, tx);
+	const int column1 = column0 + 1 < level.width ? column0 + 1 : 0;
+	const int row0 = floorWrap(y, level.height, ty);
+	const int row1 = row0 + 1 < level.height ? row0 + 1 : 0;
+
+	const auto texel = [&level](int column, int row)
+	{
+		const uint8_t* pixel = level.texel(column, row);
+		return Vector3{static_cast<float>(pixel[0]), static_cast<float>(pixel[1]), static_cast<float>(pixel[2])};
+	};
+	const Vector3 top = texel(column0, row0) * (1.f - tx) + texel(column1, row0) * tx;
+	const Vector3 bottom = texel(column0, row1) * (1.f - tx) + texel(column1, row1) * tx;
+	return (top * (1.f - ty) + bottom * ty) * (1.f / 255.f);
+}
+
+size_t BitmapTexture::SizeInBytes() const
+{
+	size_t size = 0;
+	if (levels)
+	{
+		for (const TextureStorage& level : *levels)
+			size += level.sizeInBytes();
+	}
+	return size;
+}
+
+std::vector<RGBImage> LoadMipChain(const std::string& filePath)
+{
+	int width;
+	int height;
+	int channels;
+	unsigned char* image = stbi_load(filePath.c_str(), &width, &height, &channels, 3);
+	if (!image)
+	{
+		std::cerr << "Failed to load texture " << filePath << ": " << stbi_failure_reason() << std::endl;
+		return {};
+	}
+
+	std::vector<RGBImage> mipChain;
+	mipChain.push_back({width, height, std::vector<uint8_t>(image, image + static_cast<size_t>(width) * height * 3)});
 	stbi_image_free(image);
+
+	// Box filter over 2x2 texels, the last row or column of an odd sized level is repeated
+	while (mipChain.back().width > 1 || mipChain.back().height > 1)
+	{
+		const RGBImage& source = mipChain.back();
+		RGBImage level;
+		level.width = std::max(1, source.width / 2);
+		level.height = std::max(1, source.height / 2);
+		level.texels.resize(static_cast<size_t>(level.width) * level.height * 3);
+		for (int row = 0; row < level.height; ++row)
+		{
+			const int sourceRow0 = std::min(2 * row, source.height - 1);
+			const int sourceRow1 = std::min(2 * row + 1, source.height - 1);
+			for (int column = 0; column < level.width; ++column)
+			{
+				const int sourceColumn0 = std::min(2 * column, source.width - 1);
+				const int sourceColumn1 = std::min(2 * column + 1, source.width - 1);
+				const auto sourceTexel = [&source](int sourceRow, int sourceColumn)
+				{
+					return source.texels.data() + (static_cast<size_t>(sourceRow) * source.width + sourceColumn) * 3;
+				};
+				const uint8_t* texel00 = sourceTexel(sourceRow0, sourceColumn0);
+				const uint8_t* texel01 = sourceTexel(sourceRow0, sourceColumn1);
+				const uint8_t* texel10 = sourceTexel(sourceRow1, sourceColumn0);
+				const uint8_t* texel11 = sourceTexel(sourceRow1, sourceColumn1);
+				uint8_t* texel = level.texels.data() + (static_cast<size_t>(row) * level.width + column) * 3;
+				for (int channel = 0; channel < 3; ++channel)
+				{
+					const int sum = texel00[channel] + texel01[channel] + texel10[channel] + texel11[channel];
+					texel[channel] = static_cast<uint8_t>((sum + 2) / 4);
+				}
+			}
+		}
+		mipChain.push_back(std::move(level));
+	}
+	return mipChain;
 }
 
-void BitmapTexture::LoadImageTexture(const std::string& filePath)
+std::vector<TextureStorage> ToTextureLevels(const std::vector<RGBImage>& mipChain, TextureLayout layout)
 {
-	image = stbi_load(filePath.c_str(), &width, &height, &channels, 0);
+	std::vector<TextureStorage> levels;
+	levels.reserve(mipChain.size());
+	for (const RGBImage& image : mipChain)
+		levels.emplace_back(image.width, image.height, image.texels, layout);
+	return levels;
 }
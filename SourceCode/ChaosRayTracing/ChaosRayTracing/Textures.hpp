@@ -1,6 +1,12 @@
 #pragma once
 
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "Math3D.hpp"
+#include "TextureStorage.hpp"
 
 class Texture
 {
@@ -11,7 +17,9 @@ public:
 
 	virtual ~Texture() = default;
 
-	virtual Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv) const = 0;
+	// uvDifferentials is the footprint of the pixel in texture space, filtering textures pick their detail from it
+	virtual Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv,
+	                         const UVDifferentials& uvDifferentials) const = 0;
 
 	std::string name;
 };
@@ -23,7 +31,11 @@ public:
 	{
 	}
 
-	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv) const override { return albedo; }
+	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv,
+	                 const UVDifferentials& uvDifferentials) const override
+	{
+		return albedo;
+	}
 
 private:
 	Vector3 albedo;
@@ -37,7 +49,8 @@ public:
 	{
 	}
 
-	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv) const override;
+	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv,
+	                 const UVDifferentials& uvDifferentials) const override;
 
 private:
 	Vector3 edgeColor;
@@ -54,7 +67,8 @@ public:
 		numSquares = 1.f / squareSize;
 	}
 
-	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv) const override;
+	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv,
+	                 const UVDifferentials& uvDifferentials) const override;
 
 private:
 	Vector3 colorA;
@@ -63,24 +77,85 @@ private:
 	float numSquares;
 };
 
+// RGB texels row by row, the first row is the top of the image
+struct RGBImage
+{
+	int width = 0;
+	int height = 0;
+	std::vector<uint8_t> texels;
+};
+
+// The image decoded through stb_image followed by its box filtered mip levels down to 1x1, empty on failure
+std::vector<RGBImage> LoadMipChain(const std::string& filePath);
+
+// Mip levels in memory, levels[0] is the full resolution image and each next one is half as large
+std::vector<TextureStorage> ToTextureLevels(const std::vector<RGBImage>& mipChain, TextureLayout layout);
+
+class PagedTexture;
+
+// Image with its mip pyramid, either decoded into memory whole or paged in from a TextureCache file. The pyramid is
+// shared between textures of the same file. Lookups are trilinear, the level comes from the pixel footprint, and
+// wrap around outside [0, 1].
 class BitmapTexture : public Texture
 {
 public:
-	BitmapTexture(std::string name, const std::string& filePath)
-		: Texture(std::move(name))
+	// Levels decoded by a task on a thread pool
+	using PendingLevels = std::shared_future<std::shared_ptr<const std::vector<TextureStorage>>>;
+
+	BitmapTexture(std::string name, std::shared_ptr<const std::vector<TextureStorage>> levels)
+		: Texture(std::move(name)), levels(std::move(levels))
+	{
+	}
+
+	// Resolve() must be called before the first lookup
+	BitmapTexture(std::string name, PendingLevels pendingLevels)
+		: Texture(std::move(name)), pendingLevels(std::move(pendingLevels))
 	{
-		LoadImageTexture(filePath);
 	}
 
-	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv) const override;
+	BitmapTexture(std::string name, std::shared_ptr<const PagedTexture> pagedTexture)
+		: Texture(std::move(name)), pagedTexture(std::move(pagedTexture))
+	{
+	}
 
-	~BitmapTexture() override;
+	BitmapTexture(std::string name, const std::string& filePath, TextureLayout layout = TextureLayout::Linear)
+		: Texture(std::move(name)),
+		  levels(std::make_shared<const std::vector<TextureStorage>>(ToTextureLevels(LoadMipChain(filePath), layout)))
+	{
+	}
 
-private:
-	void LoadImageTexture(const std::string& filePath);
+	Vector3 GetColor(const Vector2& barycentrics, const Vector2& uv,
+	                 const UVDifferentials& uvDifferentials) const override;
 
-	int width;
-	int height;
-	int channels;
-	unsigned char* image = nullptr;
+	// Waits for pending levels. Lookups do not check for them, the scene resolves its textures before rendering.
+	void Resolve()
+	{
+		if (pendingLevels.valid())
+		{
+			levels = pendingLevels.get();
+			pendingLevels = {};
+		}
+	}
+
+	// In memory textures only
+	size_t SizeInBytes() const;
+
+	int Width() const
+	{
+		return levels && !levels->empty() ? (*levels)[0].width : 0;
+	}
+
+private:
+	// sampleLevel(level, uv) filters one level, the footprint picks the pair to blend
+	template <typename SampleLevel>
+	static Vector3 Trilinear(size_t levelCount, int width, int height, const Vector2& uv,
+	                         const UVDifferentials& uvDifferentials, const SampleLevel& sampleLevel);
+
+	// level: anything with width, height and texel(x, y) like TextureStorage
+	template <typename Level>
+	static Vector3 Bilinear(Level& level, const Vector2& uv);
+
+	std::shared_ptr<const std::vector<TextureStorage>> levels;
+	std::shared_ptr<const PagedTexture> pagedTexture;
+	PendingLevels pendingLevels;
 };
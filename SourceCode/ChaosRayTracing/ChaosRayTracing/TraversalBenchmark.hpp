@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "Scene.hpp"
+
+// Closest-hit throughput of single rays against interleaved batches of several widths, on a soup of random triangles
+// in one mesh traversed by random rays. Around ten million triangles the BVH and the vertices take several hundred
+// MiB, far more than the caches, and single rays mostly wait for memory. Both node layouts are measured on the same
+// tree. Returns whether every interleaved hit equals the single-ray one.
+inline bool runTraversalBenchmark(uint32_t triangleCount)
+{
+	constexpr uint32_t rayCount = 200000;
+	constexpr uint32_t repetitions = 2;
+	constexpr uint32_t widths[] = {1, 4, 8, 16, 32};
+
+	std::mt19937 generator(1);
+	std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+	const auto randomVector = [&]
+	{
+		const float x = distribution(generator);
+		const float y = distribution(generator);
+		return Vector3(x, y, distribution(generator));
+	};
+
+	// Triangles of about the mean spacing of their centers, so that rays cross a few hundred leaves
+	Mesh mesh;
+	mesh.positions.reserve(static_cast<size_t>(triangleCount) * 3);
+	mesh.triangles.reserve(triangleCount);
+	const float triangleSize = 1.5f / std::cbrt(static_cast<float>(triangleCount));
+	for (uint32_t triangleIndex = 0; triangleIndex < triangleCount; ++triangleIndex)
+	{
+		const Vector3 center = randomVector();
+		Triangle triangle;
+		for (uint32_t vertex = 0; vertex < 3; ++vertex)
+		{
+			triangle.indices[vertex] = static_cast<uint32_t>(mesh.positions.size());
+			mesh.positions.push_back(center + randomVector() * triangleSize);
+		}
+		mesh.triangles.push_back(triangle);
+	}
+
+	Scene::Settings settings;
+	settings.bvhSettings.splitHeuristic = BVH::SplitHeuristic::SAH;
+	settings.bvhSettings.maxDepth = 30;
+	settings.bvhCacheDirectory.clear();
+	Material material;
+	material.type = Material::DIFFUSE;
+	material.ior = 1.f;
+	std::vector<Mesh> meshes;
+	meshes.push_back(std::move(mesh));
+
+	const auto buildStart = std::chrono::high_resolution_clock::now();
+	Scene scene(settings, std::move(meshes), {Instance{.meshIndex = 0, .materialIndex = 0}}, {material});
+	const std::chrono::duration<double> buildDuration = std::chrono::high_resolution_clock::now() - buildStart;
+	const Mesh& builtMesh = scene.meshes[0];
+	std::cout << triangleCount << " triangles, BVH built in " << buildDuration.count() << " s, vertices and triangles "
+		<< (builtMesh.positions.size() * sizeof(Vector3) + builtMesh.triangles.size() * sizeof(Triangle)) / (1 << 20)
+		<< " MiB." << std::endl;
+
+	std::vector<Ray> rays;
+	rays.reserve(rayCount);
+	for (uint32_t rayIndex = 0; rayIndex < rayCount; ++rayIndex)
+	{
+		const Vector3 origin = randomVector();
+		rays.emplace_back(origin, Normalize(randomVector()));
+	}
+
+	bool hitsEqual = true;
+	std::vector<Ray> tracedRays;
+	std::vector<HitInfo> singleHits(rayCount);
+	std::vector<HitInfo> interleavedHits(rayCount);
+	const auto measure = [&](const char* layout, uint32_t width)
+	{
+		double bestSeconds = std::numeric_limits<double>::max();
+		for (uint32_t repetition = 0; repetition < repetitions; ++repetition)
+		{
+			tracedRays = rays;
+			const auto start = std::chrono::high_resolution_clock::now();
+			if (width == 0)
+			{
+				for (uint32_t rayIndex = 0; rayIndex < rayCount; ++rayIndex)
+					singleHits[rayIndex] = scene.closestHit(tracedRays[rayIndex]);
+			}
+			else
+			{
+				scene.closestHits(tracedRays.data(), interleavedHits.data(), rayCount, width);
+			}
+			const std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+			bestSeconds = std::min(bestSeconds, duration.count());
+		}
+
+		std::cout << layout << " nodes, ";
+		if (width == 0)
+			std::cout << "single rays: ";
+		else
+			std::cout << "width " << width << ": ";
+		std::cout << rayCount / bestSeconds / 1e6 << " Mrays/s";
+
+		if (width > 0)
+		{
+			uint32_t mismatchCount = 0;
+			for (uint32_t rayIndex = 0; rayIndex < rayCount; ++rayIndex)
+			{
+				const HitInfo& single = singleHits[rayIndex];
+				const HitInfo& interleaved = interleavedHits[rayIndex];
+				mismatchCount += single.hit != interleaved.hit || (single.hit &&
+					(single.t != interleaved.t || single.triangleIndex != interleaved.triangleIndex ||
+						single.instanceIndex != interleaved.instanceIndex));
+			}
+			std::cout << ", " << mismatchCount << " hits differ";
+			hitsEqual &= mismatchCount == 0;
+		}
+		std::cout << std::endl;
+	};
+
+	for (bool quantized : {false, true})
+	{
+		const char* layout = quantized ? "quantized" : "binary";
+		if (quantized)
+			scene.meshes[0].bvh.quantize();
+		std::cout << layout << " nodes: " << scene.meshes[0].bvh.memoryUsage() / (1 << 20) << " MiB" << std::endl;
+
+		measure(layout, 0);
+		for (uint32_t width : widths)
+			measure(layout, width);
+	}
+	return hitsEqual;
+}
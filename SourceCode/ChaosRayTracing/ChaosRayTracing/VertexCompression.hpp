@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cfloat>
+#include <string>
+#include <vector>
+
+#include "Math3D.hpp"
+
+namespace VertexCompression
+{
+	inline float signNotZero(float v)
+	{
+		return v >= 0.f ? 1.f : -1.f;
+	}
+
+	inline int16_t toSnorm16(float v)
+	{
+		return static_cast<int16_t>(std::round(std::clamp(v, -1.f, 1.f) * 32767.f));
+	}
+
+	inline float fromSnorm16(int16_t v)
+	{
+		return std::max(static_cast<float>(v) / 32767.f, -1.f);
+	}
+
+	// Octahedral mapping of a unit vector, both components stored as 16-bit snorm
+	inline uint32_t encodeNormal(const Vector3& n)
+	{
+		float invL1Norm = 1.f / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+		float x = n.x * invL1Norm;
+		float y = n.y * invL1Norm;
+		if (n.z < 0.f)
+		{
+			float foldedX = (1.f - std::abs(y)) * signNotZero(x);
+			float foldedY = (1.f - std::abs(x)) * signNotZero(y);
+			x = foldedX;
+			y = foldedY;
+		}
+
+		return static_cast<uint16_t>(toSnorm16(x)) |
+			static_cast<uint32_t>(static_cast<uint16_t>(toSnorm16(y))) << 16;
+	}
+
+	inline Vector3 decodeNormal(uint32_t packed)
+	{
+		float x = fromSnorm16(static_cast<int16_t>(packed & 0xffff));
+		float y = fromSnorm16(static_cast<int16_t>(packed >> 16));
+		float z = 1.f - std::abs(x) - std::abs(y);
+		if (z < 0.f)
+		{
+			float unfoldedX = (1.f - std::abs(y)) * signNotZero(x);
+			float unfoldedY = (1.f - std::abs(x)) * signNotZero(y);
+			x = unfoldedX;
+			y = unfoldedY;
+		}
+		return Normalize(Vector3(x, y, z));
+	}
+
+	// UVs are stored as 16-bit unorm relative to the UV bounds of their mesh, which keeps the precision uniform over
+	// the whole range (half floats lose bits towards 1 and beyond when textures tile)
+	struct UVQuantization
+	{
+		Vector2 minUV{0.f};
+		Vector2 extent{1.f};
+
+		UVQuantization() = default;
+
+		UVQuantization(const std::vector<Vector2>& uvs)
+		{
+			if (uvs.empty())
+				return;
+
+			Vector2 maxUV = uvs.front();
+			minUV = uvs.front();
+			for (const auto& uv : uvs)
+			{
+				minUV = {std::min(minUV.x, uv.x), std::min(minUV.y, uv.y)};
+				maxUV = {std::max(maxUV.x, uv.x), std::max(maxUV.y, uv.y)};
+			}
+			extent = {std::max(maxUV.x - minUV.x, FLT_MIN), std::max(maxUV.y - minUV.y, FLT_MIN)};
+		}
+
+		uint32_t encode(const Vector2& uv) const
+		{
+			auto toUnorm16 = [](float v)
+			{
+				return static_cast<uint32_t>(std::round(std::clamp(v, 0.f, 1.f) * 65535.f));
+			};
+			return toUnorm16((uv.x - minUV.x) / extent.x) | toUnorm16((uv.y - minUV.y) / extent.y) << 16;
+		}
+
+		Vector2 decode(uint32_t packed) const
+		{
+			constexpr float scale = 1.f / 65535.f;
+			return minUV + extent * Vector2(static_cast<float>(packed & 0xffff) * scale,
+			                                static_cast<float>(packed >> 16) * scale);
+		}
+	};
+
+	// Round-trip error of a compressed mesh, accumulated over all of its vertices
+	struct ErrorReport
+	{
+		size_t vertexCount = 0;
+		size_t originalBytes = 0;
+		size_t compressedBytes = 0;
+		float maxNormalErrorDegrees = 0.f;
+		double sumNormalErrorDegrees = 0.0;
+		float maxUVError = 0.f;
+
+		ErrorReport& operator+=(const ErrorReport& other)
+		{
+			vertexCount += other.vertexCount;
+			originalBytes += other.originalBytes;
+			compressedBytes += other.compressedBytes;
+			maxNormalErrorDegrees = std::max(maxNormalErrorDegrees, other.maxNormalErrorDegrees);
+			sumNormalErrorDegrees += other.sumNormalErrorDegrees;
+			maxUVError = std::max(maxUVError, other.maxUVError);
+			return *this;
+		}
+
+		std::string toString() const
+		{
+			const double meanNormalError = vertexCount ? sumNormalErrorDegrees / static_cast<double>(vertexCount) : 0.0;
+			return "normals max " + std::to_string(maxNormalErrorDegrees) + " deg, mean " +
+				std::to_string(meanNormalError) + " deg; uvs max " + std::to_string(maxUVError) + "; " +
+				std::to_string(originalBytes) + " -> " + std::to_string(compressedBytes) + " bytes";
+		}
+	};
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "Math3D.hpp"
+
+// Point-light visibility of surface points, shared by all render threads and kept across frames while the geometry and
+// the lights stay put. Points are bucketed into a sparse hash of cells (quantized position plus the dominant axis of
+// the normal, so the two sides of a thin wall do not share a cell).
+//
+// A cell only answers once its first minSamples shadow rays all agreed. A single disagreeing ray marks it as a shadow
+// boundary for good and its rays are traced from then on, so the error is limited to penumbrae thinner than a cell
+// that the first minSamples rays of the cell happened to miss.
+class VisibilityCache
+{
+public:
+	VisibilityCache(float cellSize, uint32_t minSamples, uint32_t capacityLog2 = 20)
+		: invCellSize(1.f / cellSize), minSamples(std::min(minSamples, countMask)), capacityLog2(capacityLog2),
+		  capacityMask((size_t{1} << capacityLog2) - 1),
+		  entries(std::make_unique<std::atomic<uint64_t>[]>(capacityMask + 1))
+	{
+		clear();
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i <= capacityMask; ++i)
+			entries[i].store(0, std::memory_order_relaxed);
+	}
+
+	// Visibility of the light from the point if the cell is settled
+	std::optional<bool> lookup(const Vector3& point, const Vector3& normal, uint32_t lightIndex) const
+	{
+		const uint64_t hash = cellHash(point, normal, lightIndex);
+		const uint64_t tag = hash & tagMask;
+		for (size_t probe = 0, slot = firstSlot(hash); probe < maxProbes; ++probe, slot = (slot + 1) & capacityMask)
+		{
+			const uint64_t entry = entries[slot].load(std::memory_order_relaxed);
+			if (entry == 0)
+				return std::nullopt;
+			if ((entry & tagMask) != tag)
+				continue;
+
+			const uint32_t visibleCount = (entry >> visibleShift) & countMask;
+			const uint32_t occludedCount = (entry >> occludedShift) & countMask;
+			if (visibleCount >= minSamples && occludedCount == 0)
+				return true;
+			if (occludedCount >= minSamples && visibleCount == 0)
+				return false;
+			return std::nullopt;
+		}
+		return std::nullopt;
+	}
+
+	// Records a traced shadow ray, lock-free. Drops the sample when the probe sequence is full.
+	void insert(const Vector3& point, const Vector3& normal, uint32_t lightIndex, bool visible)
+	{
+		const uint64_t hash = cellHash(point, normal, lightIndex);
+		const uint64_t tag = hash & tagMask;
+		const uint32_t shift = visible ? visibleShift : occludedShift;
+		for (size_t probe = 0, slot = firstSlot(hash); probe < maxProbes; ++probe, slot = (slot + 1) & capacityMask)
+		{
+			uint64_t entry = entries[slot].load(std::memory_order_relaxed);
+			if (entry == 0)
+			{
+				// Claim the empty slot, whoever wins the race the slot may still belong to this cell
+				if (!entries[slot].compare_exchange_strong(entry, tag, std::memory_order_relaxed))
+				{
+					if ((entry & tagMask) != tag)
+						continue;
+				}
+				else
+					entry = tag;
+			}
+			else if ((entry & tagMask) != tag)
+				continue;
+
+			const uint64_t increment = uint64_t{1} << shift;
+			while (((entry >> shift) & countMask) < countMask)
+			{
+				if (entries[slot].compare_exchange_weak(entry, entry + increment, std::memory_order_relaxed))
+					break;
+			}
+			return;
+		}
+	}
+
+private:
+	// Tag in the low bits, saturating counts of visible and occluded samples in the top two bytes. The tag is never
+	// zero, so zero marks an empty slot.
+	static constexpr uint32_t visibleShift = 48;
+	static constexpr uint32_t occludedShift = 56;
+	static constexpr uint32_t countMask = 0xff;
+	static constexpr uint64_t tagMask = (uint64_t{1} << visibleShift) - 1;
+	static constexpr size_t maxProbes = 16;
+
+	uint64_t cellHash(const Vector3& point, const Vector3& normal, uint32_t lightIndex) const
+	{
+		const Vector3 absNormal(std::abs(normal.x), std::abs(normal.y), std::abs(normal.z));
+		const uint32_t axis = absNormal.x > absNormal.y ? (absNormal.x > absNormal.z ? 0 : 2)
+		                                                : (absNormal.y > absNormal.z ? 1 : 2);
+		const uint32_t normalBin = axis * 2 + (normal.data[axis] < 0.f);
+
+		uint64_t hash = lightIndex * 6ull + normalBin;
+		for (uint32_t dimension = 0; dimension < 3; ++dimension)
+		{
+			const auto cell = static_cast<int64_t>(std::floor(point.data[dimension] * invCellSize));
+			hash = mix(hash ^ static_cast<uint64_t>(cell));
+		}
+		return (hash & tagMask) ? hash : hash | 1;
+	}
+
+	// The top bits, the tag already uses the low ones
+	size_t firstSlot(uint64_t hash) const
+	{
+		return static_cast<size_t>(hash >> (64 - capacityLog2));
+	}
+
+	// splitmix64 finalizer
+	static uint64_t mix(uint64_t x)
+	{
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	float invCellSize;
+	uint32_t minSamples;
+	uint32_t capacityLog2;
+	size_t capacityMask;
+	std::unique_ptr<std::atomic<uint64_t>[]> entries;
+};